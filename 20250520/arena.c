@@ -0,0 +1,133 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+// Frame arenas replacing the malloc and free pairs of the frame loops.
+// Allocator calls in the middle of a frame show up as jitter of the frame
+// times, so buffers come from a block reserved once and reused every frame.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+struct c21_arena_block {
+    c21_arena_block* next;
+    size_t capacity;
+    size_t used;
+    _Alignas(C21_ARENA_ALIGN) uint8_t data[];
+};
+
+static size_t align_up(size_t size) {
+    return (size + C21_ARENA_ALIGN - 1) & ~(size_t)(C21_ARENA_ALIGN - 1);
+}
+
+// Function to reserve the base block of an arena
+int c21_arena_init(c21_arena* arena, size_t capacity) {
+    memset(arena, 0, sizeof(*arena));
+    arena->capacity = align_up(capacity);
+    if (arena->capacity == 0) {
+        return 1;
+    }
+    arena->heap_calls++;
+    if (posix_memalign((void**)&arena->base, C21_ARENA_ALIGN, arena->capacity) != 0) {
+        arena->base = NULL;
+        arena->capacity = 0;
+        fprintf(stderr, "Failed to reserve %zu bytes for an arena\n", capacity);
+        return 0;
+    }
+    return 1;
+}
+
+// Function to give the overflow blocks back to the heap
+static void free_overflow(c21_arena* arena) {
+    while (arena->overflow) {
+        c21_arena_block* next = arena->overflow->next;
+        free(arena->overflow);
+        arena->heap_calls++;
+        arena->overflow = next;
+    }
+    arena->overflow_size = 0;
+}
+
+void c21_arena_free(c21_arena* arena) {
+    free_overflow(arena);
+    if (arena->base) {
+        free(arena->base);
+        arena->heap_calls++;
+    }
+    arena->base = NULL;
+    arena->capacity = 0;
+    arena->used = 0;
+}
+
+// Function to bump allocate from the base, or from an overflow block once
+// the base is used up
+void* c21_arena_alloc(c21_arena* arena, size_t size) {
+    size = align_up(size);
+    if (arena->used + size <= arena->capacity) {
+        void* memory = arena->base + arena->used;
+        arena->used += size;
+        return memory;
+    }
+    if (arena->overflow && arena->overflow->used + size <= arena->overflow->capacity) {
+        void* memory = arena->overflow->data + arena->overflow->used;
+        arena->overflow->used += size;
+        arena->overflow_size += size;
+        return memory;
+    }
+
+    // Blocks double, so a frame outgrowing the base takes few of them
+    size_t capacity = arena->overflow ? arena->overflow->capacity * 2 : arena->capacity;
+    if (capacity < size) {
+        capacity = size;
+    }
+    c21_arena_block* block;
+    arena->heap_calls++;
+    if (posix_memalign((void**)&block, C21_ARENA_ALIGN, sizeof(c21_arena_block) + capacity) != 0) {
+        fprintf(stderr, "Failed to grow an arena by %zu bytes\n", capacity);
+        return NULL;
+    }
+    block->next = arena->overflow;
+    block->capacity = capacity;
+    block->used = size;
+    arena->overflow = block;
+    arena->overflow_size += size;
+    return block->data;
+}
+
+void* c21_arena_calloc(c21_arena* arena, size_t count, size_t size) {
+    void* memory = c21_arena_alloc(arena, count * size);
+    if (memory) {
+        memset(memory, 0, count * size);
+    }
+    return memory;
+}
+
+// Function to start a new frame. If the last frame overflowed, the base is
+// replaced by one block large enough for all of it.
+void c21_arena_reset(c21_arena* arena) {
+    if (arena->overflow) {
+        size_t capacity = arena->used + arena->overflow_size;
+        free_overflow(arena);
+        if (arena->base) {
+            free(arena->base);
+            arena->heap_calls++;
+        }
+        arena->base = NULL;
+        arena->capacity = 0;
+        arena->heap_calls++;
+        if (posix_memalign((void**)&arena->base, C21_ARENA_ALIGN, capacity) != 0) {
+            arena->base = NULL;
+            fprintf(stderr, "Failed to grow an arena to %zu bytes\n", capacity);
+        } else {
+            arena->capacity = capacity;
+        }
+    }
+    arena->used = 0;
+}
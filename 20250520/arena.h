@@ -0,0 +1,44 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Alignment of every allocation, a cache line
+#define C21_ARENA_ALIGN 64
+
+typedef struct c21_arena_block c21_arena_block;
+
+// Memory of one frame or one file, handed out by bumping a pointer and
+// given back all at once. A frame that does not fit takes extra blocks from
+// the heap, the next reset merges them into the base, so a steady stream of
+// frames settles with no heap calls at all.
+typedef struct {
+    uint8_t* base;
+    size_t capacity;
+    size_t used;
+    c21_arena_block* overflow;  // Blocks taken since the last reset
+    size_t overflow_size;
+    size_t heap_calls;          // Every malloc and free made by this arena
+} c21_arena;
+
+// Allocates capacity bytes up front, returns 0 on failure
+int c21_arena_init(c21_arena* arena, size_t capacity);
+void c21_arena_free(c21_arena* arena);
+// Returns size bytes valid until the next reset, NULL if the heap is out of memory
+void* c21_arena_alloc(c21_arena* arena, size_t size);
+// Same as c21_arena_alloc with the bytes cleared
+void* c21_arena_calloc(c21_arena* arena, size_t count, size_t size);
+// Gives back everything allocated, the base grows to the largest frame seen
+void c21_arena_reset(c21_arena* arena);
+
+#endif
@@ -0,0 +1,327 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+/*
+gcc -O2 -o bench.out bench.c codec21.c decoder.c source.c && ./bench.out > bench.csv
+*/
+
+// Microbenchmarks of the codec kernels.
+// Every kernel runs over one line of fixed pseudo random content, so runs
+// are comparable between builds. A sample repeats the line until it takes
+// long enough to time reliably. After a warmup the samples are sorted and
+// the median and the 99th percentile are printed as CSV on stdout.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "codec21.h"
+#include "source.h"
+
+#define LINE_PIXELS 1920
+#define DEFAULT_SAMPLES 200
+#define WARMUP_SAMPLES 20
+#define SAMPLE_TARGET_NS 20000.0
+#define MAX_LUT_ENTRIES 4
+
+// Kernels of codec21.c that are not part of the public interface
+size_t skip_run_length(const Vector3D* input, const Vector3D* reference, size_t max_length);
+size_t encode_linear(const c21_context* context, const Vector3D* input, const Vector3D* reference,
+                     size_t input_size, uint8_t* output);
+size_t encode_lut(const c21_context* context, const Vector3D* input, const Vector3D* reference,
+                  size_t input_size, uint8_t* output);
+size_t encode_quantized(const Vector3D* input, const Vector3D* reference, size_t input_size,
+                        uint8_t* output, int start_mask_idx, int end_mask_idx);
+int find_most_frequent(const Vector3D* data, size_t length, Vector3D* lut, size_t lut_size,
+                       uint32_t threshold);
+size_t write_bitplane(const Vector3D* input, size_t block_length, int mask_idx, uint8_t* output);
+size_t write_linear(const Vector3D* input, size_t block_length, uint8_t* output);
+size_t write_lut(const Vector3D* input, size_t block_length, const Vector3D* lut,
+                 uint8_t* output, Vector3D* reconstructed);
+
+typedef struct {
+    c21_context context;
+    Vector3D noise[LINE_PIXELS];
+    Vector3D noise_copy[LINE_PIXELS];
+    Vector3D gradient[LINE_PIXELS];
+    Vector3D palette[LINE_PIXELS];
+    Vector3D photo[LINE_PIXELS];
+    Vector3D photo_reference[LINE_PIXELS];
+    Vector3D flipped[4][LINE_PIXELS];  // Noise with one bit pair changed
+    Vector3D zero[LINE_PIXELS];
+    uint32_t argb32[LINE_PIXELS];  // Noise as captured, 32 and 16 bits per pixel
+    uint16_t rgb565[LINE_PIXELS];
+    Vector3D output[LINE_PIXELS];
+    uint8_t compressed[LINE_PIXELS * sizeof(Vector3D) * 2];
+    // Streams of a single verb over the whole line
+    uint8_t skip_stream[8];
+    size_t skip_size;
+    uint8_t linear_stream[LINE_PIXELS];
+    size_t linear_size;
+    uint8_t lut_stream[LINE_PIXELS * 2];
+    size_t lut_size;
+    uint8_t bitplane_stream[4][LINE_PIXELS * sizeof(Vector3D)];
+    size_t bitplane_size[4];
+    uint8_t photo_stream[LINE_PIXELS * sizeof(Vector3D) * 2];
+    size_t photo_size;
+} BenchData;
+
+typedef struct {
+    const char* name;
+    size_t (*run)(BenchData* data, int arg);  // Returns pixels processed
+    int arg;
+} Kernel;
+
+static BenchData data;
+static volatile size_t sink;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint32_t next_random(uint32_t* seed) {
+    *seed = *seed * 1103515245u + 12345u;
+    return *seed >> 8;
+}
+
+// Function to fill the inputs and the single verb streams
+void prepare(BenchData* d) {
+    c21_context_init(&d->context, LINE_PIXELS, 1);
+    uint32_t seed = 2025;
+    static const Vector3D colors[3] = {{240, 240, 240}, {20, 20, 90}, {200, 40, 40}};
+    for (int i = 0; i < LINE_PIXELS; i++) {
+        d->noise[i] = (Vector3D){next_random(&seed), next_random(&seed), next_random(&seed)};
+        d->noise_copy[i] = d->noise[i];
+        d->argb32[i] = 0xFF000000u | (d->noise[i].x << 16) | (d->noise[i].y << 8) | d->noise[i].z;
+        d->rgb565[i] = (uint16_t)(((d->noise[i].x >> 3) << 11) | ((d->noise[i].y >> 2) << 5) | (d->noise[i].z >> 3));
+        d->gradient[i] = (Vector3D){(uint8_t)(i / 8), (uint8_t)(255 - i / 8), (uint8_t)(i / 16)};
+        d->palette[i] = colors[(i / 5 + i / 13) % 3];
+        int n = (int)(next_random(&seed) % 5) - 2;
+        d->photo[i] = (Vector3D){(uint8_t)(i / 8 + n), (uint8_t)(100 + n), (uint8_t)(i / 12 + 20)};
+        d->photo_reference[i] = (i % 64 < 40) ? d->photo[i] : d->gradient[i];
+        for (int k = 0; k < 4; k++) {
+            uint8_t flip = (uint8_t)(1 << (6 - 2 * k));
+            d->flipped[k][i] = (Vector3D){d->noise[i].x ^ flip, d->noise[i].y ^ flip, d->noise[i].z ^ flip};
+        }
+    }
+
+    d->skip_size = start_block(VERB_SKIP, LINE_PIXELS, d->skip_stream);
+    d->linear_size = 0;
+    for (size_t i = 0; i < LINE_PIXELS; i += d->context.linear_length) {
+        size_t length = LINE_PIXELS - i < d->context.linear_length ? LINE_PIXELS - i : d->context.linear_length;
+        d->linear_size += write_linear(&d->gradient[i], length, &d->linear_stream[d->linear_size]);
+    }
+    d->lut_size = 0;
+    for (size_t i = 0; i < LINE_PIXELS; i += d->context.lut_size) {
+        size_t length = LINE_PIXELS - i < d->context.lut_size ? LINE_PIXELS - i : d->context.lut_size;
+        Vector3D lut[MAX_LUT_ENTRIES];
+        find_most_frequent(&d->palette[i], length, lut, MAX_LUT_ENTRIES, d->context.lut_threshold);
+        d->lut_size += write_lut(&d->palette[i], length, lut, &d->lut_stream[d->lut_size], NULL);
+    }
+    for (int k = 0; k < 4; k++) {
+        d->bitplane_size[k] = 0;
+        for (size_t i = 0; i < LINE_PIXELS; i += d->context.quantized_size) {
+            d->bitplane_size[k] += write_bitplane(&d->flipped[k][i], d->context.quantized_size, k,
+                                                  &d->bitplane_stream[k][d->bitplane_size[k]]);
+        }
+    }
+    d->photo_size = encode_block(&d->context, d->photo, d->photo_reference, LINE_PIXELS,
+                                 d->photo_stream, sizeof(d->photo_stream));
+}
+
+size_t run_skip_scan(BenchData* d, int arg) {
+    (void)arg;
+    sink += skip_run_length(d->noise, d->noise_copy, LINE_PIXELS);
+    return LINE_PIXELS;
+}
+
+size_t run_dirty_spans(BenchData* d, int arg) {
+    (void)arg;
+    c21_span spans[C21_MAX_LINE_SPANS];
+    sink += find_dirty_spans(d->photo, d->photo_reference, LINE_PIXELS, spans, C21_MAX_LINE_SPANS);
+    return LINE_PIXELS;
+}
+
+size_t run_source_line(BenchData* d, int format) {
+    c21_source source = {(const uint8_t*)d->argb32, sizeof(d->argb32), (c21_pixel_format)format};
+    if (format == C21_FORMAT_RGB565) {
+        source.base = (const uint8_t*)d->rgb565;
+        source.stride = sizeof(d->rgb565);
+    }
+    sink += (size_t)c21_source_line(&source, 0, 0, LINE_PIXELS, d->output);
+    return LINE_PIXELS;
+}
+
+size_t run_surface_write(BenchData* d, int arg) {
+    c21_surface surface = {d->argb32, LINE_PIXELS, NULL};
+    c21_surface_write(&surface, 0, 0, d->noise, LINE_PIXELS);
+    sink += d->argb32[arg];
+    return LINE_PIXELS;
+}
+
+size_t run_encode_linear(BenchData* d, int arg) {
+    (void)arg;
+    size_t step = d->context.linear_length;
+    for (size_t i = 0; i + step <= LINE_PIXELS; i += step) {
+        sink += encode_linear(&d->context, &d->gradient[i], &d->zero[i], step, d->compressed);
+    }
+    return LINE_PIXELS / step * step;
+}
+
+size_t run_encode_lut(BenchData* d, int arg) {
+    (void)arg;
+    size_t step = d->context.lut_size;
+    for (size_t i = 0; i + step <= LINE_PIXELS; i += step) {
+        sink += encode_lut(&d->context, &d->palette[i], &d->zero[i], step, d->compressed);
+    }
+    return LINE_PIXELS / step * step;
+}
+
+size_t run_encode_quantized(BenchData* d, int mask_idx) {
+    size_t step = d->context.quantized_size;
+    for (size_t i = 0; i + step <= LINE_PIXELS; i += step) {
+        sink += encode_quantized(&d->flipped[mask_idx][i], &d->noise[i], step, d->compressed,
+                                 mask_idx, mask_idx + 1);
+    }
+    return LINE_PIXELS / step * step;
+}
+
+size_t run_find_most_frequent(BenchData* d, int arg) {
+    (void)arg;
+    size_t step = d->context.lut_size;
+    Vector3D lut[MAX_LUT_ENTRIES];
+    for (size_t i = 0; i + step <= LINE_PIXELS; i += step) {
+        sink += find_most_frequent(&d->palette[i], step, lut, MAX_LUT_ENTRIES, d->context.lut_threshold);
+    }
+    return LINE_PIXELS / step * step;
+}
+
+size_t run_encode_block(BenchData* d, int arg) {
+    (void)arg;
+    sink += encode_block(&d->context, d->photo, d->photo_reference, LINE_PIXELS,
+                         d->compressed, sizeof(d->compressed));
+    return LINE_PIXELS;
+}
+
+size_t run_decode_skip(BenchData* d, int arg) {
+    (void)arg;
+    return decode_blocks(&d->context, d->skip_stream, d->skip_size, d->output, d->noise);
+}
+
+size_t run_decode_linear(BenchData* d, int arg) {
+    (void)arg;
+    return decode_blocks(&d->context, d->linear_stream, d->linear_size, d->output, d->zero);
+}
+
+size_t run_decode_lut(BenchData* d, int arg) {
+    (void)arg;
+    return decode_blocks(&d->context, d->lut_stream, d->lut_size, d->output, d->zero);
+}
+
+size_t run_decode_bitplane(BenchData* d, int mask_idx) {
+    return decode_blocks(&d->context, d->bitplane_stream[mask_idx], d->bitplane_size[mask_idx],
+                         d->output, d->noise);
+}
+
+size_t run_decode_blocks(BenchData* d, int arg) {
+    (void)arg;
+    return decode_blocks(&d->context, d->photo_stream, d->photo_size, d->output, d->photo_reference);
+}
+
+int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[]) {
+    int samples = DEFAULT_SAMPLES;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            samples = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-n samples]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (samples < 1) samples = 1;
+
+    const Kernel kernels[] = {
+        {"skip_scan", run_skip_scan, 0},
+        {"dirty_spans", run_dirty_spans, 0},
+        {"source_argb32", run_source_line, C21_FORMAT_ARGB32},
+        {"source_rgb565", run_source_line, C21_FORMAT_RGB565},
+        {"surface_write", run_surface_write, 0},
+        {"encode_linear", run_encode_linear, 0},
+        {"encode_lut", run_encode_lut, 0},
+        {"encode_quantized_bit7and6", run_encode_quantized, 0},
+        {"encode_quantized_bit5and4", run_encode_quantized, 1},
+        {"encode_quantized_bit3and2", run_encode_quantized, 2},
+        {"encode_quantized_bit1and0", run_encode_quantized, 3},
+        {"find_most_frequent", run_find_most_frequent, 0},
+        {"encode_block", run_encode_block, 0},
+        {"decode_skip", run_decode_skip, 0},
+        {"decode_linear", run_decode_linear, 0},
+        {"decode_lookup", run_decode_lut, 0},
+        {"decode_bit7and6", run_decode_bitplane, 0},
+        {"decode_bit5and4", run_decode_bitplane, 1},
+        {"decode_bit3and2", run_decode_bitplane, 2},
+        {"decode_bit1and0", run_decode_bitplane, 3},
+        {"decode_blocks", run_decode_blocks, 0},
+    };
+
+    prepare(&data);
+    double* times = malloc(samples * sizeof(double));
+    if (!times) {
+        fprintf(stderr, "Failed to allocate samples\n");
+        return 1;
+    }
+
+    printf("kernel,pixels_per_sample,samples,median_ns,p99_ns,median_mpix_per_s,p99_mpix_per_s,"
+           "median_bytes_per_s\n");
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        const Kernel* kernel = &kernels[k];
+
+        // Warm up and find how many lines make a sample long enough
+        int repeat = 1;
+        size_t pixels = 0;
+        for (int w = 0; w < WARMUP_SAMPLES; w++) {
+            double start = now_ns();
+            pixels = 0;
+            for (int r = 0; r < repeat; r++) {
+                pixels += kernel->run(&data, kernel->arg);
+            }
+            double elapsed = now_ns() - start;
+            if (elapsed < SAMPLE_TARGET_NS && repeat < (1 << 20)) {
+                repeat *= 2;
+            }
+        }
+
+        for (int s = 0; s < samples; s++) {
+            double start = now_ns();
+            for (int r = 0; r < repeat; r++) {
+                kernel->run(&data, kernel->arg);
+            }
+            times[s] = now_ns() - start;
+        }
+        qsort(times, samples, sizeof(double), compare_double);
+        double median = times[samples / 2];
+        double p99 = times[(samples * 99) / 100 < samples ? (samples * 99) / 100 : samples - 1];
+
+        printf("%s,%zu,%d,%.0f,%.0f,%.2f,%.2f,%.0f\n", kernel->name, pixels, samples, median, p99,
+               pixels / median * 1000.0, pixels / p99 * 1000.0,
+               pixels * sizeof(Vector3D) / median * 1e9);
+    }
+
+    free(times);
+    return 0;
+}
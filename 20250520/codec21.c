@@ -14,21 +14,85 @@
 #include <stdlib.h>
 #include <float.h>
 #include <stdio.h>
+#if defined(__SSE2__) || defined(__SSSE3__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include "codec21.h"
+
+// Function to set the resolution and the default encoder tunables
+void c21_context_init(c21_context* context, int width, int height) {
+    context->width = width;
+    context->height = height;
+    context->stride = width;
+    context->linear_length = 20;
+    context->quantized_size = 8;
+    context->lut_size = 30; // Optimal 50
+    context->linear_tolerance = 6;
+    // 20% compression improvement of 4 vs 1
+    context->lut_threshold = 8 * 8 * sizeof(Vector3D);
+}
 
-const size_t linear_length = 20;
-const size_t quantized_size = 8;
-const size_t lut_size = 30; // Optimal 50
-const int linear_tolerance = 6;
+// Function to read encoder tunables from a profile of key=value lines.
+// Keys that are not listed keep their value. Returns 0 on failure.
+int c21_context_load_profile(c21_context* context, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror("Failed to open profile");
+        return 0;
+    }
 
-// Structure to represent a 3D byte vector, literally a red, green, blue pixel
-typedef struct {
-    uint8_t x;
-    uint8_t y;
-    uint8_t z;
-} Vector3D;
+    c21_context loaded = *context;
+    char line[256];
+    int line_number = 0;
+    int ok = 1;
+    while (ok && fgets(line, sizeof(line), file)) {
+        line_number++;
+        char key[64];
+        unsigned long value;
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+            continue;
+        }
+        if (sscanf(line, " %63[^= ] = %lu", key, &value) != 2) {
+            fprintf(stderr, "%s:%d: expected key=value\n", path, line_number);
+            ok = 0;
+        } else if (strcmp(key, "quantized_size") == 0 && value >= 1 && value <= MAX_BLOCK_LENGTH) {
+            loaded.quantized_size = value;
+        } else if (strcmp(key, "linear_length") == 0 && value >= 3 && value <= MAX_BLOCK_LENGTH) {
+            loaded.linear_length = value;
+        } else if (strcmp(key, "lut_size") == 0 && value >= 1 && value <= MAX_BLOCK_LENGTH) {
+            loaded.lut_size = value;
+        } else if (strcmp(key, "linear_tolerance") == 0 && value <= 255) {
+            loaded.linear_tolerance = (int)value;
+        } else if (strcmp(key, "lut_threshold") == 0 && value <= 3 * 255 * 255 + 1) {
+            loaded.lut_threshold = (uint32_t)value;
+        } else {
+            fprintf(stderr, "%s:%d: unknown key or value out of range: %s", path, line_number, line);
+            ok = 0;
+        }
+    }
+    fclose(file);
 
-// 20% compression improvement of 4 vs 1
-const uint32_t lut_threshold = 8 * 8 * sizeof(Vector3D);
+    if (ok) {
+        *context = loaded;
+    }
+    return ok;
+}
+
+// Function to write the encoder tunables as a profile. Returns 0 on failure.
+int c21_context_save_profile(const c21_context* context, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        perror("Failed to create profile");
+        return 0;
+    }
+    fprintf(file, "# codec21 encoder profile\n");
+    fprintf(file, "quantized_size=%zu\n", context->quantized_size);
+    fprintf(file, "linear_length=%zu\n", context->linear_length);
+    fprintf(file, "lut_size=%zu\n", context->lut_size);
+    fprintf(file, "linear_tolerance=%d\n", context->linear_tolerance);
+    fprintf(file, "lut_threshold=%u\n", context->lut_threshold);
+    return fclose(file) == 0;
+}
 
 // Function to calculate squared distance between two 3D vectors
 uint32_t vector_distance_sq(Vector3D a, Vector3D b) {
@@ -38,24 +102,6 @@ uint32_t vector_distance_sq(Vector3D a, Vector3D b) {
     return dx*dx + dy*dy + dz*dz;
 }
 
-typedef enum {
-    VERB_SKIP =    0b000 << 5,  // 0x00
-    VERB_LINEAR =  0b001 << 5,  // 0x20
-    VERB_LOOKUP =  0b010 << 5,  // 0x40
-    VERB_BIT7AND6 = 0b011 << 5, // 0x60
-    VERB_BIT5AND4 = 0b100 << 5, // 0x80
-    VERB_BIT3AND2 = 0b101 << 5, // 0xA0
-    VERB_BIT1AND0 = 0b110 << 5, // 0xC0
-} VerbList;
-
-// Masks for extracting verb and length
-#define VERB_MASK 0xE0      // Bits 7-5
-#define LENGTH_FLAG 0x10    // Bit 4 - indicates if extended length is used
-#define SHORT_LENGTH_MASK 0x0F  // Bits 3-0 for short length
-#define EXT_LENGTH_BITS 8   // Number of bits in the extension byte
-#define MAX_SHORT_LENGTH 15  // Maximum length that can be encoded in 4 bits
-#define MAX_BLOCK_LENGTH 4095  // Maximum length that can be encoded in 12 bits (4+8)
-
 // Function to write a block header with length
 size_t start_block(uint8_t verb, size_t length, uint8_t* output) {
     size_t bytes_written = 1;
@@ -73,94 +119,173 @@ size_t start_block(uint8_t verb, size_t length, uint8_t* output) {
     return bytes_written;
 }
 
-// Function to read a block header with length
-size_t open_block(const uint8_t* input, uint8_t* verb, size_t* length) {
-    size_t bytes_read = 1;
-    *verb = input[0] & VERB_MASK;
-    
-    if (input[0] & LENGTH_FLAG) {
-        // Extended length format
-        *length = (input[0] & SHORT_LENGTH_MASK) | ((size_t)input[1] << 4);
-        bytes_read = 2;
-    } else {
-        // Short length format
-        *length = input[0] & SHORT_LENGTH_MASK;
+// Function to measure the run of pixels equal to the reference.
+// Pixels are packed, so we compare raw bytes wide and convert the position
+// of the first mismatching byte back into a pixel count.
+size_t skip_run_length(const Vector3D* input, const Vector3D* reference,
+                       size_t max_length) {
+    const uint8_t* a = (const uint8_t*)input;
+    const uint8_t* b = (const uint8_t*)reference;
+    size_t bytes = max_length * sizeof(Vector3D);
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+        uint32_t equal = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (equal != 0xFFFFFFFFu) {
+            return (i + __builtin_ctz(~equal)) / sizeof(Vector3D);
+        }
     }
-    
-    return bytes_read;
+#endif
+#if defined(__SSE2__)
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        uint32_t equal = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+        if (equal != 0xFFFFu) {
+            return (i + __builtin_ctz(~equal)) / sizeof(Vector3D);
+        }
+    }
+#endif
+    // Scalar fallback, a word at a time and then byte by byte
+    while (i + sizeof(uint64_t) <= bytes && memcmp(a + i, b + i, sizeof(uint64_t)) == 0) {
+        i += sizeof(uint64_t);
+    }
+    while (i < bytes && a[i] == b[i]) {
+        i++;
+    }
+    return i / sizeof(Vector3D);
 }
 
-// Function to find most frequent values in an array for lookup tables
-int find_most_frequent(const Vector3D* data, size_t length,
-                        Vector3D* lut, size_t lut_size) {
-    // Simple frequency counting
-    typedef struct {
-        Vector3D value;
-        int count;
-    } FreqEntry;
+// Maximum number of entries in a lookup table block
+#define MAX_LUT_ENTRIES 4
 
-    FreqEntry freq[length];
-    size_t unique_count = 0;
+// Running color clusters of a lookup table candidate.
+// Pixels join the first cluster whose seed color is within the threshold,
+// otherwise they open a new cluster. A block is only useful for a LUT if all
+// of it fits into the table, so we stop counting as soon as one more cluster
+// would be needed. This keeps the table fixed size and the scan linear.
+typedef struct {
+    Vector3D value;
+    int count;
+} FreqEntry;
 
-    for (size_t i = 0; i < length; i++) {
-        freq[i].count = 0;
-    }
+typedef struct {
+    FreqEntry freq[MAX_LUT_ENTRIES];
+    size_t unique_count;
+    size_t capacity;
+    uint32_t threshold;
+    int covered;
+    bool overflow;
+} LutClusters;
+
+void lut_clusters_init(LutClusters* clusters, size_t capacity, uint32_t threshold) {
+    clusters->unique_count = 0;
+    clusters->threshold = threshold;
+    clusters->capacity = (capacity < MAX_LUT_ENTRIES) ? capacity : MAX_LUT_ENTRIES;
+    clusters->covered = 0;
+    clusters->overflow = false;
+}
 
-    // Count frequencies
-    for (size_t i = 0; i < length; i++) {
-        bool found = false;
-        for (size_t j = 0; j < unique_count; j++) {
-            if (vector_distance_sq(data[i], freq[j].value) < lut_threshold) {
-                freq[j].count++;
-                found = true;
-                break;
-            }
-        }
-        if (!found && unique_count < length) {
-            freq[unique_count].value = data[i];
-            freq[unique_count].count = 1;
-            unique_count++;
+void lut_clusters_add(LutClusters* clusters, Vector3D value) {
+    if (clusters->overflow) {
+        return;
+    }
+    size_t j = 0;
+    while (j < clusters->unique_count &&
+           vector_distance_sq(value, clusters->freq[j].value) >= clusters->threshold) {
+        j++;
+    }
+    if (j == clusters->unique_count) {
+        if (clusters->unique_count == clusters->capacity) {
+            clusters->overflow = true;  // Needs more colors than the LUT holds
+            return;
         }
+        clusters->freq[j].value = value;
+        clusters->freq[j].count = 0;
+        clusters->unique_count++;
     }
+    clusters->freq[j].count++;
+    clusters->covered++;
+}
 
-    // Sort by frequency
-    for (size_t i = 0; i < unique_count - 1; i++) {
-        for (size_t j = 0; j < unique_count - i - 1; j++) {
-            if (freq[j].count < freq[j + 1].count) {
-                FreqEntry temp = freq[j];
-                freq[j] = freq[j + 1];
-                freq[j + 1] = temp;
-            }
+// Function to order the clusters by frequency and copy them to the LUT.
+// Ties keep the order of first appearance. Returns the pixels covered.
+int lut_clusters_finish(LutClusters* clusters, Vector3D* lut) {
+    FreqEntry* freq = clusters->freq;
+    for (size_t i = 1; i < clusters->unique_count; i++) {
+        FreqEntry entry = freq[i];
+        size_t j = i;
+        while (j > 0 && freq[j - 1].count < entry.count) {
+            freq[j] = freq[j - 1];
+            j--;
         }
+        freq[j] = entry;
     }
 
-    // Copy top N values to LUT
-    int count = 0;
-    for (size_t i = 0; i < lut_size && i < unique_count; i++) {
+    memset(lut, 0, clusters->capacity * sizeof(Vector3D));
+    for (size_t i = 0; i < clusters->unique_count; i++) {
         lut[i] = freq[i].value;
-        count += freq[i].count;
     }
-    return count;
+    return clusters->covered;
+}
+
+// Function to find most frequent values in an array for lookup tables.
+// The returned coverage is below length if the block needs more than
+// lut_size colors.
+int find_most_frequent(const Vector3D* data, size_t length,
+                        Vector3D* lut, size_t lut_size, uint32_t threshold) {
+    LutClusters clusters;
+    lut_clusters_init(&clusters, lut_size, threshold);
+    for (size_t i = 0; i < length && !clusters.overflow; i++) {
+        lut_clusters_add(&clusters, data[i]);
+    }
+    return lut_clusters_finish(&clusters, lut);
+}
+
+// Straight line through the first and last point of a block, per channel
+typedef struct {
+    double first[3];
+    double slope[3];
+} LinearModel;
+
+void linear_model_init(LinearModel* model, const Vector3D points[], int count) {
+    const uint8_t* first = (const uint8_t*)&points[0];
+    const uint8_t* last = (const uint8_t*)&points[count - 1];
+    for (int dim = 0; dim < 3; dim++) {
+        model->first[dim] = first[dim];
+        model->slope[dim] = ((double)last[dim] - (double)first[dim]) / (count - 1);
+    }
+}
+
+// Function to measure how far point i is from the line, truncated like the
+// integer tolerance it is compared to
+int linear_model_error(const LinearModel* model, Vector3D point, int i) {
+    const uint8_t* values = (const uint8_t*)&point;
+    int error = 0;
+    for (int dim = 0; dim < 3; dim++) {
+        double expected = model->first[dim] + model->slope[dim] * i;
+        int deviation = abs((int)(values[dim] - expected));
+        if (deviation > error) {
+            error = deviation;
+        }
+    }
+    return error;
 }
 
 // Function to check if points fit a linear line within tolerance
 bool is_linear_fit(const Vector3D points[], int count, int tolerance) {
     if (count < 3) return false;
-    
-    // Check each dimension separately
-    for (int dim = 0; dim < 3; dim++) {
-        uint8_t* values = (uint8_t*)points;
-        double first = values[0 * sizeof(Vector3D) + dim];
-        double last = values[(count-1) * sizeof(Vector3D) + dim];
-        double slope = (last - first) / (count - 1);
-        
-        // Check if intermediate points fit the line
-        for (int i = 1; i < count-1; i++) {
-            double expected = first + slope * i;
-            double actual = values[i * sizeof(Vector3D) + dim];
-            if (abs(actual - expected) > tolerance){
-                return false;
-            }
+
+    LinearModel model;
+    linear_model_init(&model, points, count);
+
+    // Check if intermediate points fit the line
+    for (int i = 1; i < count-1; i++) {
+        if (linear_model_error(&model, points[i], i) > tolerance) {
+            return false;
         }
     }
     return true;
@@ -208,243 +333,404 @@ DiffRange get_diff_range(const Vector3D* input, const Vector3D* reference, size_
     return has_medium ? DIFF_MEDIUM : DIFF_SMALL;
 }
 
-// Function to encode linear blocks when input follows a linear pattern
-// but differs significantly from reference
-size_t encode_linear(const Vector3D* input, const Vector3D* reference,
-                 size_t input_size, uint8_t* output) {
-    size_t output_pos = 0;
-    size_t input_pos = 0;
-    
-    if (input_pos + linear_length > input_size) {
-        return 0;  // Not enough pixels for linear block
+// Function to accumulate the OR of XOR and the largest channel difference
+// of two byte ranges
+void accumulate_differences(const uint8_t* a, const uint8_t* b, size_t bytes,
+                            uint8_t* xor_or, uint8_t* max_delta) {
+    uint8_t bits = *xor_or;
+    uint8_t delta = *max_delta;
+    size_t i = 0;
+#if defined(__SSE2__)
+    if (bytes >= 16) {
+        __m128i bits_acc = _mm_setzero_si128();
+        __m128i delta_acc = _mm_setzero_si128();
+        for (; i + 16 <= bytes; i += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+            bits_acc = _mm_or_si128(bits_acc, _mm_xor_si128(va, vb));
+            delta_acc = _mm_max_epu8(delta_acc, _mm_or_si128(_mm_subs_epu8(va, vb),
+                                                             _mm_subs_epu8(vb, va)));
+        }
+        // Fold the lanes in halves down to the lowest byte
+        bits_acc = _mm_or_si128(bits_acc, _mm_srli_si128(bits_acc, 8));
+        bits_acc = _mm_or_si128(bits_acc, _mm_srli_si128(bits_acc, 4));
+        bits_acc = _mm_or_si128(bits_acc, _mm_srli_si128(bits_acc, 2));
+        bits_acc = _mm_or_si128(bits_acc, _mm_srli_si128(bits_acc, 1));
+        delta_acc = _mm_max_epu8(delta_acc, _mm_srli_si128(delta_acc, 8));
+        delta_acc = _mm_max_epu8(delta_acc, _mm_srli_si128(delta_acc, 4));
+        delta_acc = _mm_max_epu8(delta_acc, _mm_srli_si128(delta_acc, 2));
+        delta_acc = _mm_max_epu8(delta_acc, _mm_srli_si128(delta_acc, 1));
+        bits |= (uint8_t)_mm_cvtsi128_si32(bits_acc);
+        uint8_t lane_delta = (uint8_t)_mm_cvtsi128_si32(delta_acc);
+        if (lane_delta > delta) delta = lane_delta;
+    }
+#endif
+    for (; i < bytes; i++) {
+        bits |= a[i] ^ b[i];
+        uint8_t d = (a[i] > b[i]) ? a[i] - b[i] : b[i] - a[i];
+        if (d > delta) delta = d;
     }
+    *xor_or = bits;
+    *max_delta = delta;
+}
 
-    // First check if input data fits a linear pattern
-    if (!is_linear_fit(&input[input_pos], linear_length, linear_tolerance)) {
-        return 0;  // Input doesn't fit linear pattern
+// Bit pairs of the bitplane verbs, most significant first
+const uint8_t quantized_masks[] = {0xC0, 0x30, 0x0C, 0x03};
+const uint8_t quantized_shifts[] = {6, 4, 2, 0};
+const uint8_t quantized_verbs[] = {VERB_BIT7AND6, VERB_BIT5AND4, VERB_BIT3AND2, VERB_BIT1AND0};
+// Bits more significant than each bit pair, the decoder keeps them from the reference
+const uint8_t quantized_high_masks[] = {0x00, 0xC0, 0xF0, 0xFC};
+
+// Function to find the most significant bit pair set in a difference mask.
+// Returns 4 if there is no difference at all.
+int highest_mask_index(uint8_t difference) {
+    int mask_idx = 0;
+    while (mask_idx < 4 && !(difference & quantized_masks[mask_idx])) {
+        mask_idx++;
     }
-    
-    // Now check if the difference from reference exceeds linear_tolerance
-    bool significant_difference = false;
-    for (size_t i = 0; i < linear_length; i++) {
-        int dx = abs((int)input[input_pos + i].x - (int)reference[input_pos + i].x);
-        int dy = abs((int)input[input_pos + i].y - (int)reference[input_pos + i].y);
-        int dz = abs((int)input[input_pos + i].z - (int)reference[input_pos + i].z);
-        
-        if (dx > linear_tolerance || dy > linear_tolerance || dz > linear_tolerance) {
-            significant_difference = true;
-            break;
+    return mask_idx;
+}
+
+// Function to write a bitplane block of one bit pair of every channel
+size_t write_bitplane(const Vector3D* input, size_t block_length, int mask_idx,
+                      uint8_t* output) {
+    size_t output_pos = start_block(quantized_verbs[mask_idx], block_length, output);
+    uint8_t bit_shift = quantized_shifts[mask_idx];
+    size_t i = 0;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Four pixels per step: every 32-bit word of four channels folds into one byte
+    for (; i + 4 <= block_length; i += 4) {
+        uint32_t words[3];
+        memcpy(words, &input[i], sizeof(words));
+        for (int k = 0; k < 3; k++) {
+            uint32_t fields = (words[k] >> bit_shift) & 0x03030303u;
+            fields = (fields | (fields >> 6)) & 0x000F000Fu;
+            output[output_pos++] = (uint8_t)(fields | (fields >> 12));
         }
     }
-    
-    if (!significant_difference) {
-        return 0;  // Difference from reference is too small
+#endif
+    // Pack the remaining bits field by field
+    const uint8_t* channels = (const uint8_t*)&input[i];
+    size_t fields = (block_length - i) * 3;
+    for (size_t f = 0; f < fields; f += 4) {
+        uint8_t bit_buffer = 0;
+        for (size_t k = 0; k < 4 && f + k < fields; k++) {
+            bit_buffer |= ((channels[f + k] >> bit_shift) & 0x03) << (k * 2);
+        }
+        output[output_pos++] = bit_buffer;
     }
-    
-    // Write block header with verb and length
-    output_pos += start_block(VERB_LINEAR, linear_length, &output[output_pos]);
-    
+    return output_pos;
+}
+
+// Function to compute what the decoder makes of a bitplane block.
+// The decoder keeps the more significant bits of the reference, takes the
+// bit pair from the block and dithers the lower bits alternating per pixel,
+// so the result follows from the input without reading the block back.
+void reconstruct_bitplane(const Vector3D* input, const Vector3D* reference, size_t block_length,
+                          int mask_idx, size_t first_pixel, Vector3D* reconstructed) {
+    uint8_t mask = quantized_masks[mask_idx];
+    uint8_t high = quantized_high_masks[mask_idx];
+    uint8_t dithering_even = ~(high | mask) & 0xAA;
+    uint8_t dithering_odd = ~(high | mask) & 0x55;
+    uint8_t dithering_first = (first_pixel % 2 == 0) ? dithering_even : dithering_odd;
+    uint8_t dithering_second = (first_pixel % 2 == 0) ? dithering_odd : dithering_even;
+    size_t i = 0;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Four pixels per step in three 32-bit words, like the decoder
+    {
+        const uint32_t high_word = high * 0x01010101u;
+        const uint32_t mask_word = mask * 0x01010101u;
+        const uint32_t a = dithering_first, b = dithering_second;
+        const uint32_t dithering[3] = {
+            a | (a << 8) | (a << 16) | (b << 24),
+            b | (b << 8) | (a << 16) | (a << 24),
+            a | (b << 8) | (b << 16) | (b << 24)
+        };
+        for (; i + 4 <= block_length; i += 4) {
+            uint32_t in[3], ref[3];
+            memcpy(in, &input[i], sizeof(in));
+            memcpy(ref, &reference[i], sizeof(ref));
+            for (int k = 0; k < 3; k++) {
+                ref[k] = (ref[k] & high_word) | (in[k] & mask_word) | dithering[k];
+            }
+            memcpy(&reconstructed[i], ref, sizeof(ref));
+        }
+    }
+#endif
+    for (; i < block_length; i++) {
+        uint8_t dithering_mask = (i % 2 == 0) ? dithering_first : dithering_second;
+        Vector3D ref = reference[i];
+        reconstructed[i].x = (ref.x & high) | (input[i].x & mask) | dithering_mask;
+        reconstructed[i].y = (ref.y & high) | (input[i].y & mask) | dithering_mask;
+        reconstructed[i].z = (ref.z & high) | (input[i].z & mask) | dithering_mask;
+    }
+}
+
+// Function to write a linear block of its first and last pixel
+size_t write_linear(const Vector3D* input, size_t block_length, uint8_t* output) {
+    size_t output_pos = start_block(VERB_LINEAR, block_length, output);
+
     // Store only start and end points - we can interpolate between them
-    memcpy(&output[output_pos], &input[input_pos], sizeof(Vector3D));
+    memcpy(&output[output_pos], &input[0], sizeof(Vector3D));
     output_pos += sizeof(Vector3D);
-    memcpy(&output[output_pos], &input[input_pos + linear_length - 1], sizeof(Vector3D));
+    memcpy(&output[output_pos], &input[block_length - 1], sizeof(Vector3D));
     output_pos += sizeof(Vector3D);
-    
     return output_pos;
 }
 
-// Updated encode_lut function
-size_t encode_lut(const Vector3D* input, const Vector3D* reference,
-                 size_t input_size, uint8_t* output) {
-    size_t output_pos = 0;
-    size_t input_pos = 0;
-    
-    // Ensure lut_size fits in our length field
-    size_t block_length = (lut_size <= MAX_BLOCK_LENGTH) ? lut_size : MAX_BLOCK_LENGTH;
-    
-    if (input_pos + block_length <= input_size) {
-        // Check if differences are only in bits 3-0 (lower 4 bits)
-        bool only_low_bits_diff = true;
-        for (size_t i = 0; i < block_length; i++) {
-            uint8_t x_upper_diff = (input[input_pos + i].x ^ reference[input_pos + i].x) & 0xC0;
-            uint8_t y_upper_diff = (input[input_pos + i].y ^ reference[input_pos + i].y) & 0xC0;
-            uint8_t z_upper_diff = (input[input_pos + i].z ^ reference[input_pos + i].z) & 0xC0;
-            
-            if (x_upper_diff || y_upper_diff || z_upper_diff) {
-                only_low_bits_diff = false;
-                break;
-            }
-        }
-        
-        if (only_low_bits_diff) {
-            return output_pos; // Skip LUT encoding if only lower 6 bits differ
-        }
-        
-        // Create LUT with 4 most frequent values from input
-        Vector3D lut[4];
-        size_t input_coverage = find_most_frequent(&input[input_pos], block_length, lut, 4);
-        
-        if (input_coverage < block_length) {
-            return output_pos; // Not enough coverage with our LUT
-        }
+// Function to write a lookup table block with 2-bit indices of the nearest entry.
+// The chosen entries go to reconstructed unless it is NULL.
+size_t write_lut(const Vector3D* input, size_t block_length, const Vector3D* lut,
+                 uint8_t* output, Vector3D* reconstructed) {
+    size_t output_pos = start_block(VERB_LOOKUP, block_length, output);
 
-        // Write block header with verb and length
-        output_pos += start_block(VERB_LOOKUP, block_length, &output[output_pos]);
-        
-        // Store the LUT
-        memcpy(&output[output_pos], lut, sizeof(Vector3D) * 4);
-        output_pos += sizeof(Vector3D) * 4;
-        
-        // Encode each value as 2-bit index to nearest LUT entry
-        uint8_t index_buffer = 0;
-        int bit_pos = 0;
+    // Store the LUT
+    memcpy(&output[output_pos], lut, sizeof(Vector3D) * MAX_LUT_ENTRIES);
+    output_pos += sizeof(Vector3D) * MAX_LUT_ENTRIES;
 
-        for (size_t i = 0; i < block_length; i++) {
-            // Find closest LUT entry
+    // Encode each value as 2-bit index to nearest LUT entry
+    uint8_t index_buffer = 0;
+    int bit_pos = 0;
+
+    uint8_t best_index = 0;
+    for (size_t i = 0; i < block_length; i++) {
+        // Find closest LUT entry, runs of the same color reuse the last one
+        if (i == 0 || memcmp(&input[i], &input[i - 1], sizeof(Vector3D)) != 0) {
             uint32_t min_dist = UINT32_MAX;
-            uint8_t best_index = 0;
-    
-            for (uint8_t j = 0; j < 4; j++) {
-                uint32_t dist = vector_distance_sq(input[input_pos + i], lut[j]);
+            for (uint8_t j = 0; j < MAX_LUT_ENTRIES; j++) {
+                uint32_t dist = vector_distance_sq(input[i], lut[j]);
                 if (dist < min_dist) {
                     min_dist = dist;
                     best_index = j;
                 }
             }
-    
-            // Pack 2-bit indices
-            index_buffer |= (best_index << bit_pos);
-            bit_pos += 2;
-    
-            if (bit_pos == 8) {
-                output[output_pos++] = index_buffer;
-                index_buffer = 0;
-                bit_pos = 0;
-            }
         }
 
-        // Write final byte if needed
-        if (bit_pos > 0) {
+        if (reconstructed) {
+            reconstructed[i] = lut[best_index];
+        }
+
+        // Pack 2-bit indices
+        index_buffer |= (best_index << bit_pos);
+        bit_pos += 2;
+
+        if (bit_pos == 8) {
             output[output_pos++] = index_buffer;
+            index_buffer = 0;
+            bit_pos = 0;
         }
+    }
 
-        input_pos += block_length;
-        return output_pos;
+    // Write final byte if needed
+    if (bit_pos > 0) {
+        output[output_pos++] = index_buffer;
     }
-    
     return output_pos;
 }
 
-// Improved encode_quantized function with priority-based scanning
+// Function to encode linear blocks when input follows a linear pattern
+// but differs significantly from reference
+size_t encode_linear(const c21_context* context, const Vector3D* input, const Vector3D* reference,
+                 size_t input_size, uint8_t* output) {
+    size_t linear_length = context->linear_length;
+    if (linear_length > input_size) {
+        return 0;  // Not enough pixels for linear block
+    }
+
+    // First check if input data fits a linear pattern
+    if (!is_linear_fit(input, linear_length, context->linear_tolerance)) {
+        return 0;  // Input doesn't fit linear pattern
+    }
+
+    // Now check if the difference from reference exceeds the tolerance
+    uint8_t difference = 0, max_delta = 0;
+    accumulate_differences((const uint8_t*)input, (const uint8_t*)reference,
+                           linear_length * sizeof(Vector3D), &difference, &max_delta);
+    if (max_delta <= context->linear_tolerance) {
+        return 0;  // Difference from reference is too small
+    }
+
+    return write_linear(input, linear_length, output);
+}
+
+// Updated encode_lut function
+size_t encode_lut(const c21_context* context, const Vector3D* input, const Vector3D* reference,
+                 size_t input_size, uint8_t* output) {
+    // Ensure the LUT block fits in our length field
+    size_t lut_size = context->lut_size;
+    size_t block_length = (lut_size <= MAX_BLOCK_LENGTH) ? lut_size : MAX_BLOCK_LENGTH;
+
+    if (block_length > input_size) {
+        return 0;
+    }
+
+    // Skip LUT encoding if only lower 6 bits differ
+    uint8_t difference = 0, max_delta = 0;
+    accumulate_differences((const uint8_t*)input, (const uint8_t*)reference,
+                           block_length * sizeof(Vector3D), &difference, &max_delta);
+    if (!(difference & 0xC0)) {
+        return 0;
+    }
+
+    // Create LUT with 4 most frequent values from input
+    Vector3D lut[MAX_LUT_ENTRIES];
+    size_t input_coverage = find_most_frequent(input, block_length, lut, MAX_LUT_ENTRIES,
+                                               context->lut_threshold);
+
+    if (input_coverage < block_length) {
+        return 0; // Not enough coverage with our LUT
+    }
+    return write_lut(input, block_length, lut, output, NULL);
+}
+
+// Improved encode_quantized function with priority-based scanning.
+// The most significant differing bit pair decides the verb. Blocks whose
+// verb is outside of the requested mask range are not written.
 size_t encode_quantized(const Vector3D* input, const Vector3D* reference,
                        size_t input_size, uint8_t* output,
                        int start_mask_idx, int end_mask_idx) {
-    size_t output_pos = 0;
-    
-    // Check each bit pair position (7-6, 5-4, 3-2, 1-0)
-    const uint8_t bit_masks[] = {0xC0, 0x30, 0x0C, 0x03};  // Masks for bit pairs
-    const uint8_t bit_shifts[] = {6, 4, 2, 0};             // Shifts for each mask position
-    const uint8_t verb_codes[] = {VERB_BIT7AND6, VERB_BIT5AND4, VERB_BIT3AND2, VERB_BIT1AND0};
-    
     // Ensure block length fits in our length field
     size_t block_length = (input_size <= MAX_BLOCK_LENGTH) ? input_size : MAX_BLOCK_LENGTH;
-    
+
     // Validate indices
     if (start_mask_idx < 0) start_mask_idx = 0;
     if (end_mask_idx > 4) end_mask_idx = 4;
     if (start_mask_idx >= end_mask_idx) return 0;
-    
-    // Track if we found any differences at all
-    bool any_differences = false;
-    
-    // Iterate through all bit positions in order of significance (0 to 3)
-    for (int mask_idx = 0; mask_idx < 4; mask_idx++) {
-        uint8_t bit_mask = bit_masks[mask_idx];
-        uint8_t bit_shift = bit_shifts[mask_idx];
-        
-        // Check if there's at least one bit difference at this position
-        bool has_difference = false;
-        for (size_t i = 0; i < block_length && !has_difference; i++) {
-            uint8_t x_diff = (input[i].x & bit_mask) ^ (reference[i].x & bit_mask);
-            uint8_t y_diff = (input[i].y & bit_mask) ^ (reference[i].y & bit_mask);
-            uint8_t z_diff = (input[i].z & bit_mask) ^ (reference[i].z & bit_mask);
-            
-            if (x_diff || y_diff || z_diff) {
-                has_difference = true;
-                any_differences = true;
-            }
+
+    uint8_t difference = 0, max_delta = 0;
+    accumulate_differences((const uint8_t*)input, (const uint8_t*)reference,
+                           block_length * sizeof(Vector3D), &difference, &max_delta);
+    int mask_idx = highest_mask_index(difference);
+
+    // If we didn't find any differences, use a VERB_SKIP
+    if (mask_idx == 4) {
+        return start_block(VERB_SKIP, block_length, output);
+    }
+    // If this bit position is outside our specified range, just skip it
+    if (mask_idx < start_mask_idx || mask_idx >= end_mask_idx) {
+        return 0;
+    }
+    return write_bitplane(input, block_length, mask_idx, output);
+}
+
+// Summary of the pixels at an encoder position that all verb decisions use
+typedef struct {
+    size_t fine_length;       // Pixels of a quantized block
+    int fine_mask_idx;        // Most significant differing bit pair there, 4 if none
+    size_t linear_length;     // Pixels of a linear block, 0 if not enough left
+    uint8_t linear_max_delta; // Largest channel difference from reference there
+    int linear_error;         // Largest distance from the endpoint line there
+    size_t lut_length;        // Pixels of a LUT block, 0 if not enough left
+    uint8_t lut_difference;   // OR of input XOR reference there
+    size_t lut_colors;        // Color clusters there, MAX_LUT_ENTRIES + 1 if more
+    Vector3D lut[MAX_LUT_ENTRIES];
+} BlockSummary;
+
+// Function to analyze the pixels at an encoder position in a single pass.
+// Byte statistics are accumulated once over the largest block window with
+// snapshots at each block length. If the quantized verbs can represent the
+// fine block, the shape statistics for the linear and LUT verbs are not
+// needed and are not gathered.
+void analyze_block(const c21_context* context, const Vector3D* input, const Vector3D* reference,
+                   size_t input_size, BlockSummary* summary) {
+    size_t quantized_size = context->quantized_size;
+    size_t linear_length = context->linear_length;
+    size_t lut_length = (context->lut_size <= MAX_BLOCK_LENGTH) ? context->lut_size : MAX_BLOCK_LENGTH;
+    size_t fine_length = (input_size < quantized_size) ? input_size : quantized_size;
+    summary->fine_length = (fine_length < MAX_BLOCK_LENGTH) ? fine_length : MAX_BLOCK_LENGTH;
+    summary->linear_length = (linear_length <= input_size) ? linear_length : 0;
+    summary->lut_length = (lut_length <= input_size) ? lut_length : 0;
+
+    // Byte statistics of each window, walking the window ends in order
+    size_t ends[3] = {summary->fine_length, summary->linear_length, summary->lut_length};
+    uint8_t differences[3] = {0, 0, 0};
+    uint8_t max_deltas[3] = {0, 0, 0};
+    uint8_t difference = 0, max_delta = 0;
+    size_t done = 0;
+    for (;;) {
+        size_t next = SIZE_MAX;
+        for (int k = 0; k < 3; k++) {
+            if (ends[k] > done && ends[k] < next) next = ends[k];
         }
-        
-        if (has_difference) {
-            // If this bit position is outside our specified range, just skip it
-            if (mask_idx < start_mask_idx || mask_idx >= end_mask_idx) {
-                return output_pos; // Skip this block
-            }
-            
-            // Write block header with verb and length
-            output_pos += start_block(verb_codes[mask_idx], block_length, &output[output_pos]);
-            
-            // Pack the bits into a bit stream
-            uint8_t bit_buffer = 0;
-            int bit_pos = 0;
-            
-            for (size_t i = 0; i < block_length; i++) {
-                // Extract the bit pairs for each component
-                uint8_t x_bits = (input[i].x & bit_mask) >> bit_shift;
-                uint8_t y_bits = (input[i].y & bit_mask) >> bit_shift;
-                uint8_t z_bits = (input[i].z & bit_mask) >> bit_shift;
-                
-                // Pack bits into the bit buffer
-                bit_buffer |= (x_bits << bit_pos);
-                bit_pos += 2;
-                if (bit_pos >= 8) {
-                    output[output_pos++] = bit_buffer;
-                    bit_buffer = 0;
-                    bit_pos = 0;
-                }
-                
-                bit_buffer |= (y_bits << bit_pos);
-                bit_pos += 2;
-                if (bit_pos >= 8) {
-                    output[output_pos++] = bit_buffer;
-                    bit_buffer = 0;
-                    bit_pos = 0;
-                }
-                
-                bit_buffer |= (z_bits << bit_pos);
-                bit_pos += 2;
-                if (bit_pos >= 8) {
-                    output[output_pos++] = bit_buffer;
-                    bit_buffer = 0;
-                    bit_pos = 0;
-                }
+        if (next == SIZE_MAX) break;
+        accumulate_differences((const uint8_t*)&input[done], (const uint8_t*)&reference[done],
+                               (next - done) * sizeof(Vector3D), &difference, &max_delta);
+        for (int k = 0; k < 3; k++) {
+            if (ends[k] == next) {
+                differences[k] = difference;
+                max_deltas[k] = max_delta;
             }
-            
-            // Write any remaining bits in the buffer
-            if (bit_pos > 0) {
-                output[output_pos++] = bit_buffer;
-            }
-            
-            return output_pos;
+        }
+        done = next;
+        if (done >= summary->fine_length && highest_mask_index(differences[0]) != 0) {
+            break;  // Settled by the fine quantized block, skip the wider windows
         }
     }
-    
-    // If we get here and didn't find any differences in our range, use a VERB_SKIP
-    if (!any_differences) {
-        output_pos += start_block(VERB_SKIP, block_length, &output[output_pos]);
-        return output_pos;
+    summary->fine_mask_idx = highest_mask_index(differences[0]);
+    summary->linear_max_delta = max_deltas[1];
+    summary->lut_difference = differences[2];
+    summary->linear_error = INT32_MAX;
+    summary->lut_colors = MAX_LUT_ENTRIES + 1;
+
+    if (summary->fine_mask_idx != 0) {
+        return;
+    }
+
+    // Shape statistics, one pass over the pixels of both windows
+    LinearModel model;
+    bool linear = summary->linear_length >= 3;
+    if (linear) {
+        linear_model_init(&model, input, summary->linear_length);
+        summary->linear_error = 0;
+    }
+    LutClusters clusters;
+    lut_clusters_init(&clusters, MAX_LUT_ENTRIES, context->lut_threshold);
+    size_t window = (summary->linear_length > summary->lut_length) ?
+                    summary->linear_length : summary->lut_length;
+    bool lut = summary->lut_length > 0 && (summary->lut_difference & 0xC0);
+    for (size_t i = 0; i < window && (linear || lut); i++) {
+        // Statistics stop as soon as they rule their verb out
+        if (linear && i > 0 && i + 1 < summary->linear_length) {
+            int error = linear_model_error(&model, input[i], (int)i);
+            if (error > summary->linear_error) summary->linear_error = error;
+            linear = summary->linear_error <= context->linear_tolerance;
+        }
+        if (lut && i < summary->lut_length) {
+            lut_clusters_add(&clusters, input[i]);
+            lut = !clusters.overflow;
+        }
+    }
+    if (summary->lut_length > 0 && (summary->lut_difference & 0xC0) && !clusters.overflow) {
+        lut_clusters_finish(&clusters, summary->lut);
+        summary->lut_colors = clusters.unique_count;
     }
-    
-    // If we found differences but none in our range, don't write anything
-    return 0;
 }
 
-// Function to encode blocks
-size_t encode_block(const Vector3D* input, const Vector3D* reference, 
-                   size_t input_size, uint8_t* output, size_t output_size) {
+// Function to compute the largest block the tunables of a context let the
+// encoder write, a header of two bytes and the payload of the longest verb
+size_t block_size_bound(const c21_context* context) {
+    size_t fine_length = (context->quantized_size < MAX_BLOCK_LENGTH) ?
+                         context->quantized_size : MAX_BLOCK_LENGTH;
+    size_t lut_length = (context->lut_size < MAX_BLOCK_LENGTH) ? context->lut_size : MAX_BLOCK_LENGTH;
+    size_t bitplane = (fine_length * 3 + 3) / 4;
+    size_t linear = 2 * sizeof(Vector3D);
+    size_t lut = MAX_LUT_ENTRIES * sizeof(Vector3D) + (lut_length + 3) / 4;
+    size_t payload = (bitplane > linear) ? bitplane : linear;
+    return 2 + ((payload > lut) ? payload : lut);
+}
+
+// Function to encode blocks and to write the pixels the decoder will produce
+// from them to reconstructed. Reconstructed may be NULL, or the reference
+// itself to update it in place. Input starts at pixel first_pixel of its
+// line, the dithering of bitplane blocks alternates with that x.
+static size_t encode_blocks_at(const c21_context* context, const Vector3D* input,
+                               const Vector3D* reference, size_t input_size, size_t first_pixel,
+                               uint8_t* output, size_t output_size, Vector3D* reconstructed) {
     size_t output_pos = 0;
     size_t input_pos = 0;
-    size_t max_block_length = 100;
+    size_t max_block_length = block_size_bound(context);
     
     while (input_pos < input_size) {
         if (output_pos + max_block_length >= output_size) {
@@ -452,233 +738,253 @@ size_t encode_block(const Vector3D* input, const Vector3D* reference,
             break;
         }
         // Skip zero difference blocks like h.264, h.265
-        size_t zero_length = 0;
-        while (zero_length < MAX_BLOCK_LENGTH && input_pos + zero_length < input_size && 
-               memcmp(&input[input_pos + zero_length], 
-                      &reference[input_pos + zero_length],
-                      sizeof(Vector3D)) == 0) {
-            zero_length++;
+        size_t zero_length = input_size - input_pos;
+        if (zero_length > MAX_BLOCK_LENGTH) {
+            zero_length = MAX_BLOCK_LENGTH;
         }
+        zero_length = skip_run_length(&input[input_pos], &reference[input_pos], zero_length);
         
         if (zero_length > 0) {
             // Write block header with verb and length
             output_pos += start_block(VERB_SKIP, zero_length, &output[output_pos]);
+            if (reconstructed && reconstructed != reference) {
+                memcpy(&reconstructed[input_pos], &reference[input_pos], zero_length * sizeof(Vector3D));
+            }
             input_pos += zero_length;
             continue;
         }
 
-        {
-            size_t fine_length = input_size - input_pos;
-            if (fine_length > quantized_size) {
-                fine_length = quantized_size;
-            }
-            if (fine_length > MAX_BLOCK_LENGTH) {
-                fine_length = MAX_BLOCK_LENGTH;
-            }
+        BlockSummary summary;
+        analyze_block(context, &input[input_pos], &reference[input_pos], input_size - input_pos, &summary);
 
-            // Quantized encoding like JPEG-XS - now with start and end index parameters
-            size_t quantized_encoded = encode_quantized(&input[input_pos], &reference[input_pos],
-                                                        fine_length, &output[output_pos], 1, 4);
-            if (quantized_encoded > 0) {
-                output_pos += quantized_encoded;
-                input_pos += fine_length;
-                continue;
+        // Quantized encoding like JPEG-XS of the lower bit pairs
+        if (summary.fine_mask_idx == 4) {
+            output_pos += start_block(VERB_SKIP, summary.fine_length, &output[output_pos]);
+            if (reconstructed && reconstructed != reference) {
+                memcpy(&reconstructed[input_pos], &reference[input_pos],
+                       summary.fine_length * sizeof(Vector3D));
             }
+            input_pos += summary.fine_length;
+            continue;
         }
-        
+        if (summary.fine_mask_idx > 0) {
+            output_pos += write_bitplane(&input[input_pos], summary.fine_length,
+                                         summary.fine_mask_idx, &output[output_pos]);
+            if (reconstructed) {
+                reconstruct_bitplane(&input[input_pos], &reference[input_pos], summary.fine_length,
+                                     summary.fine_mask_idx, first_pixel + input_pos, &reconstructed[input_pos]);
+            }
+            input_pos += summary.fine_length;
+            continue;
+        }
+
         // Linear encoding for run-length and slopes like PNG
-        size_t linear_encoded = encode_linear(&input[input_pos], &reference[input_pos],
-                                        input_size - input_pos, &output[output_pos]);
-        if (linear_encoded > 0) {
-            output_pos += linear_encoded;
-            input_pos += linear_length;
+        if (summary.linear_length > 0 && summary.linear_error <= context->linear_tolerance &&
+            summary.linear_max_delta > context->linear_tolerance) {
+            output_pos += write_linear(&input[input_pos], summary.linear_length, &output[output_pos]);
+            if (reconstructed) {
+                interpolate_linear(input[input_pos], input[input_pos + summary.linear_length - 1],
+                                   summary.linear_length, &reconstructed[input_pos]);
+            }
+            input_pos += summary.linear_length;
             continue;
         }
 
         // Lookup table encoding like GIF
-        size_t lut_encoded = encode_lut(&input[input_pos], &reference[input_pos],
-                                        input_size - input_pos, &output[output_pos]);
-        if (lut_encoded > 0) {
-            output_pos += lut_encoded;
-            input_pos += (lut_size <= MAX_BLOCK_LENGTH) ? lut_size : MAX_BLOCK_LENGTH;
+        if (summary.lut_length > 0 && (summary.lut_difference & 0xC0) &&
+            summary.lut_colors <= MAX_LUT_ENTRIES) {
+            output_pos += write_lut(&input[input_pos], summary.lut_length, summary.lut,
+                                    &output[output_pos], reconstructed ? &reconstructed[input_pos] : NULL);
+            input_pos += summary.lut_length;
             continue;
         }
 
-        {
-            size_t fine_length = input_size - input_pos;
-            if (fine_length > quantized_size) {
-                fine_length = quantized_size;
-            }
-            if (fine_length > MAX_BLOCK_LENGTH) {
-                fine_length = MAX_BLOCK_LENGTH;
-            }
-
-            // Quantized encoding like JPEG-XS - now with start and end index parameters
-            size_t quantized_encoded = encode_quantized(&input[input_pos], &reference[input_pos],
-                                                        fine_length, &output[output_pos], 0, 1);
-            if (quantized_encoded > 0) {
-                output_pos += quantized_encoded;
-                input_pos += fine_length;
-                continue;
-            }
+        // Quantized encoding of the most significant bit pair
+        output_pos += write_bitplane(&input[input_pos], summary.fine_length, 0, &output[output_pos]);
+        if (reconstructed) {
+            reconstruct_bitplane(&input[input_pos], &reference[input_pos], summary.fine_length,
+                                 0, first_pixel + input_pos, &reconstructed[input_pos]);
         }
+        input_pos += summary.fine_length;
     }
     
     return output_pos;
 }
 
-// Function to decode blocks using bit masks similar to the encoder
-size_t decode_blocks(const uint8_t* input, size_t input_size, 
-                    Vector3D* output, const Vector3D* reference) {
-    size_t input_pos = 0;
+size_t encode_block_reconstruct(const c21_context* context, const Vector3D* input,
+                                const Vector3D* reference, size_t input_size,
+                                uint8_t* output, size_t output_size, Vector3D* reconstructed) {
+    return encode_blocks_at(context, input, reference, input_size, 0, output, output_size, reconstructed);
+}
+
+// Function to allocate a dirty span map
+int c21_dirty_map_init(c21_dirty_map* map, int height) {
+    map->height = height;
+    map->dirty_pixels = 0;
+    map->counts = calloc(height, sizeof(int));
+    map->spans = malloc((size_t)height * C21_MAX_LINE_SPANS * sizeof(c21_span));
+    if (!map->counts || !map->spans) {
+        c21_dirty_map_free(map);
+        return 0;
+    }
+    return 1;
+}
+
+void c21_dirty_map_free(c21_dirty_map* map) {
+    free(map->counts);
+    free(map->spans);
+    map->counts = NULL;
+    map->spans = NULL;
+    map->height = 0;
+}
+
+// Function to check whether a tile differs from the reference.
+// A whole tile is 48 bytes, three vectors or six words XORed together.
+static bool tile_differs(const uint8_t* a, const uint8_t* b, size_t bytes) {
+    if (bytes != C21_DIRTY_TILE * sizeof(Vector3D)) {
+        return memcmp(a, b, bytes) != 0;
+    }
+#if defined(__AVX2__)
+    __m256i wide = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)a),
+                                    _mm256_loadu_si256((const __m256i*)b));
+    __m128i tail = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + 32)),
+                                 _mm_loadu_si128((const __m128i*)(b + 32)));
+    __m128i any = _mm_or_si128(_mm_or_si128(_mm256_castsi256_si128(wide),
+                                            _mm256_extracti128_si256(wide, 1)), tail);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF;
+#elif defined(__SSE2__)
+    __m128i any = _mm_setzero_si128();
+    for (int i = 0; i < 48; i += 16) {
+        any = _mm_or_si128(any, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i)),
+                                              _mm_loadu_si128((const __m128i*)(b + i))));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF;
+#else
+    uint64_t any = 0;
+    for (int i = 0; i < 48; i += sizeof(uint64_t)) {
+        uint64_t wa, wb;
+        memcpy(&wa, a + i, sizeof(wa));
+        memcpy(&wb, b + i, sizeof(wb));
+        any |= wa ^ wb;
+    }
+    return any != 0;
+#endif
+}
+
+// Function to find the changed spans of a line tile by tile.
+// Neighbouring changed tiles join into one span. Spans start on a tile.
+int find_dirty_spans(const Vector3D* input, const Vector3D* reference, size_t length,
+                     c21_span* spans, int capacity) {
+    const uint8_t* a = (const uint8_t*)input;
+    const uint8_t* b = (const uint8_t*)reference;
+    int count = 0;
+
+    for (size_t start = 0; start < length; start += C21_DIRTY_TILE) {
+        size_t end = (length - start > C21_DIRTY_TILE) ? start + C21_DIRTY_TILE : length;
+        if (!tile_differs(a + start * sizeof(Vector3D), b + start * sizeof(Vector3D),
+                          (end - start) * sizeof(Vector3D))) {
+            continue;
+        }
+        if (count > 0 && (spans[count - 1].end == (int)start || count == capacity)) {
+            spans[count - 1].end = (int)end;
+        } else {
+            spans[count].start = (int)start;
+            spans[count].end = (int)end;
+            count++;
+        }
+    }
+    return count;
+}
+
+// Function to find the changed spans of every line of a frame
+void c21_find_dirty_frame(const c21_context* context, const Vector3D* frame,
+                          const Vector3D* reference, c21_dirty_map* map) {
+    map->dirty_pixels = 0;
+    for (int line = 0; line < context->height; line++) {
+        size_t start_pos = (size_t)line * context->stride;
+        c21_span* spans = &map->spans[(size_t)line * C21_MAX_LINE_SPANS];
+        map->counts[line] = find_dirty_spans(&frame[start_pos], &reference[start_pos],
+                                             context->width, spans, C21_MAX_LINE_SPANS);
+        for (int s = 0; s < map->counts[line]; s++) {
+            map->dirty_pixels += spans[s].end - spans[s].start;
+        }
+    }
+}
+
+// Function to write skip blocks for an unchanged run of any length
+static size_t write_skip(size_t length, uint8_t* output) {
     size_t output_pos = 0;
-    
-    // Same bit masks and shifts as used in encoding
-    const uint8_t bit_masks[] = {0xC0, 0x30, 0x0C, 0x03};  // Masks for bit pairs
-    const uint8_t bit_shifts[] = {6, 4, 2, 0};             // Shifts for each mask position
-    const uint8_t verb_codes[] = {VERB_BIT7AND6, VERB_BIT5AND4, VERB_BIT3AND2, VERB_BIT1AND0};
-    const uint8_t high_bit_masks[] = {0x00, 0xC0, 0xF0, 0xFC}; // Masks for bits more significant than current mask
-    
-    // Add dithering masks for lower bits with alternating patterns
-    const uint8_t dithering_masks_even[] = {
-        ~(high_bit_masks[0] | bit_masks[0]) & 0xAA,  // For VERB_BIT7AND6 (even positions)
-        ~(high_bit_masks[1] | bit_masks[1]) & 0xAA,  // For VERB_BIT5AND4 (even positions)
-        ~(high_bit_masks[2] | bit_masks[2]) & 0xAA,  // For VERB_BIT3AND2 (even positions)
-        ~(high_bit_masks[3] | bit_masks[3]) & 0xAA   // For VERB_BIT1AND0 (even positions)
-    };
-    
-    // Second set of dithering masks using 0x55 pattern for odd positions
-    const uint8_t dithering_masks_odd[] = {
-        ~(high_bit_masks[0] | bit_masks[0]) & 0x55,  // For VERB_BIT7AND6 (odd positions)
-        ~(high_bit_masks[1] | bit_masks[1]) & 0x55,  // For VERB_BIT5AND4 (odd positions)
-        ~(high_bit_masks[2] | bit_masks[2]) & 0x55,  // For VERB_BIT3AND2 (odd positions)
-        ~(high_bit_masks[3] | bit_masks[3]) & 0x55   // For VERB_BIT1AND0 (odd positions)
-    };
-    
-    while (input_pos < input_size) {
-        uint8_t block_type;
-        size_t length;
-        
-        // Read block header (verb and length)
-        input_pos += open_block(&input[input_pos], &block_type, &length);
-        
-        switch (block_type) {
-            case VERB_SKIP: {  // Skip block
-                // Copy directly from reference
-                memcpy(&output[output_pos], &reference[output_pos], 
-                       length * sizeof(Vector3D));
-                output_pos += length;
-                break;
-            }
-            
-            case VERB_LINEAR: {  // Linear block
-                Vector3D start, end;
-                memcpy(&start, &input[input_pos], sizeof(Vector3D));
-                input_pos += sizeof(Vector3D);
-                memcpy(&end, &input[input_pos], sizeof(Vector3D));
-                input_pos += sizeof(Vector3D);
-                
-                // Interpolate points
-                for (int i = 0; i < length; i++) {
-                    float t = ((float)i) / (float)(length - 1);
-                    output[output_pos + i].x = start.x + t * (end.x - start.x);
-                    output[output_pos + i].y = start.y + t * (end.y - start.y);
-                    output[output_pos + i].z = start.z + t * (end.z - start.z);
-                }
-                output_pos += length;
-                break;
-            }
-            
-            case VERB_LOOKUP: {  // LUT block
-                Vector3D lut[4];
-                memcpy(lut, &input[input_pos], sizeof(Vector3D) * 4);
-                input_pos += sizeof(Vector3D) * 4;
-    
-                uint8_t bit_buffer = 0;
-                int bits_remaining = 0;
-    
-                for (size_t i = 0; i < length; i++) {
-                    if (bits_remaining < 2) {
-                        bit_buffer = input[input_pos++];
-                        bits_remaining = 8;
-                    }
-        
-                    // Extract 2-bit index
-                    uint8_t index = bit_buffer & 0x03;
-                    bit_buffer >>= 2;
-                    bits_remaining -= 2;
+    while (length > 0) {
+        size_t block_length = (length > MAX_BLOCK_LENGTH) ? MAX_BLOCK_LENGTH : length;
+        output_pos += start_block(VERB_SKIP, block_length, &output[output_pos]);
+        length -= block_length;
+    }
+    return output_pos;
+}
 
-                    // Copy vector from LUT
-                    output[output_pos++] = lut[index];
-                }
-                break;
-            }
-            
-            // Handle all bit pair cases with a common approach
-            case VERB_BIT7AND6:
-            case VERB_BIT5AND4:
-            case VERB_BIT3AND2:
-            case VERB_BIT1AND0: {
-                // Find the corresponding mask and shift
-                int mask_idx;
-                for (mask_idx = 0; mask_idx < 4; mask_idx++) {
-                    if (verb_codes[mask_idx] == block_type) {
-                        break;
-                    }
-                }
-                
-                uint8_t bit_mask = bit_masks[mask_idx];
-                uint8_t bit_shift = bit_shifts[mask_idx];
-                uint8_t high_bits_mask = high_bit_masks[mask_idx];
-                
-                // Process each vector
-                uint8_t bit_buffer = 0;
-                int bits_remaining = 0;
-                
-                for (size_t i = 0; i < length; i++) {
-                    // Select the appropriate dithering mask based on position
-                    uint8_t dithering_mask = (output_pos % 2 == 0) ? 
-                        dithering_masks_even[mask_idx] : 
-                        dithering_masks_odd[mask_idx];
-                    
-                    // Process X component
-                    if (bits_remaining < 2) {
-                        bit_buffer = input[input_pos++];
-                        bits_remaining = 8;
-                    }
-                    uint8_t x_bits = (bit_buffer & 0x03) << bit_shift;
-                    bit_buffer >>= 2;
-                    bits_remaining -= 2;
-                    
-                    // Process Y component
-                    if (bits_remaining < 2) {
-                        bit_buffer = input[input_pos++];
-                        bits_remaining = 8;
-                    }
-                    uint8_t y_bits = (bit_buffer & 0x03) << bit_shift;
-                    bit_buffer >>= 2;
-                    bits_remaining -= 2;
-                    
-                    // Process Z component
-                    if (bits_remaining < 2) {
-                        bit_buffer = input[input_pos++];
-                        bits_remaining = 8;
-                    }
-                    uint8_t z_bits = (bit_buffer & 0x03) << bit_shift;
-                    bit_buffer >>= 2;
-                    bits_remaining -= 2;
-                    
-                    // Reconstruct vectors
-                    output[output_pos].x = (reference[output_pos].x & high_bits_mask) | x_bits | dithering_mask;
-                    output[output_pos].y = (reference[output_pos].y & high_bits_mask) | y_bits | dithering_mask;
-                    output[output_pos].z = (reference[output_pos].z & high_bits_mask) | z_bits | dithering_mask;
-                    output_pos++;
-                }
-                break;
-            }
+// Function to write row skip blocks for a run of unchanged lines.
+// Two bytes cover up to MAX_BLOCK_LENGTH lines, a whole frame in practice.
+size_t encode_row_skip(size_t rows, uint8_t* output) {
+    size_t output_pos = 0;
+    while (rows > 0) {
+        size_t block_rows = (rows > MAX_BLOCK_LENGTH) ? MAX_BLOCK_LENGTH : rows;
+        output_pos += start_block(VERB_ROWSKIP, block_rows, &output[output_pos]);
+        rows -= block_rows;
+    }
+    return output_pos;
+}
+
+// Function to encode the changed spans of a line window and skip the rest.
+// Every span dithers with its x in the line, like the decoder given the
+// position of the window.
+size_t encode_spans_reconstruct(const c21_context* context, const Vector3D* input,
+                                const Vector3D* reference, size_t first, size_t length,
+                                const c21_span* spans, int span_count,
+                                uint8_t* output, size_t output_size, Vector3D* reconstructed) {
+    size_t end = first + length;
+    size_t pos = first;
+    size_t output_pos = 0;
+
+    for (int s = 0; s < span_count && pos < end; s++) {
+        size_t span_start = (spans[s].start > (int)pos) ? (size_t)spans[s].start : pos;
+        size_t span_end = ((size_t)spans[s].end < end) ? (size_t)spans[s].end : end;
+        if (span_end <= pos || span_start >= end) {
+            continue;
+        }
+        if (span_start < pos) {
+            span_start = pos;
+        }
+        // Skip blocks take at most two bytes per MAX_BLOCK_LENGTH pixels
+        if (output_pos + 2 * ((span_start - pos) / MAX_BLOCK_LENGTH + 1) > output_size) {
+            printf("Overflow\n");
+            return output_pos;
+        }
+        output_pos += write_skip(span_start - pos, &output[output_pos]);
+        if (reconstructed && reconstructed != reference) {
+            memcpy(&reconstructed[pos], &reference[pos], (span_start - pos) * sizeof(Vector3D));
+        }
+        output_pos += encode_blocks_at(context, &input[span_start], &reference[span_start],
+                                       span_end - span_start, span_start, &output[output_pos],
+                                       output_size - output_pos,
+                                       reconstructed ? &reconstructed[span_start] : NULL);
+        pos = span_end;
+    }
+
+    if (pos < end) {
+        if (output_pos + 2 * ((end - pos) / MAX_BLOCK_LENGTH + 1) > output_size) {
+            printf("Overflow\n");
+            return output_pos;
+        }
+        output_pos += write_skip(end - pos, &output[output_pos]);
+        if (reconstructed && reconstructed != reference) {
+            memcpy(&reconstructed[pos], &reference[pos], (end - pos) * sizeof(Vector3D));
         }
     }
-    
     return output_pos;
 }
 
+// Function to encode blocks
+size_t encode_block(const c21_context* context, const Vector3D* input, const Vector3D* reference,
+                    size_t input_size, uint8_t* output, size_t output_size) {
+    return encode_block_reconstruct(context, input, reference, input_size, output, output_size, NULL);
+}
@@ -7,16 +7,138 @@
 
 // Disclaimer: Patent rights reserved regardless of the license above
 
+#ifndef CODEC21_H
+#define CODEC21_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Structure to represent a 3D byte vector, literally a red, green, blue pixel
 typedef struct {
     uint8_t x;
     uint8_t y;
     uint8_t z;
 } Vector3D;
 
-extern size_t decode_blocks(const uint8_t* input, size_t input_size, 
-                    Vector3D* output, const Vector3D* reference);
-size_t encode_block(const Vector3D* input, const Vector3D* reference, 
-    size_t input_size, uint8_t* output, size_t output_size);
+typedef enum {
+    VERB_SKIP =    0b000 << 5,  // 0x00
+    VERB_LINEAR =  0b001 << 5,  // 0x20
+    VERB_LOOKUP =  0b010 << 5,  // 0x40
+    VERB_BIT7AND6 = 0b011 << 5, // 0x60
+    VERB_BIT5AND4 = 0b100 << 5, // 0x80
+    VERB_BIT3AND2 = 0b101 << 5, // 0xA0
+    VERB_BIT1AND0 = 0b110 << 5, // 0xC0
+    VERB_ROWSKIP = 0b111 << 5,  // 0xE0, length counts whole unchanged rows, not used on the transport
+} VerbList;
+
+// Masks for extracting verb and length
+#define VERB_MASK 0xE0      // Bits 7-5
+#define LENGTH_FLAG 0x10    // Bit 4 - indicates if extended length is used
+#define SHORT_LENGTH_MASK 0x0F  // Bits 3-0 for short length
+#define EXT_LENGTH_BITS 8   // Number of bits in the extension byte
+#define MAX_SHORT_LENGTH 15  // Maximum length that can be encoded in 4 bits
+#define MAX_BLOCK_LENGTH 4095  // Maximum length that can be encoded in 12 bits (4+8)
+
+// Resolution used by the sample programs
+#define C21_DEFAULT_WIDTH 1920
+#define C21_DEFAULT_HEIGHT 1080
+
+// Resolution and encoder tunables of a stream.
+// Every stream has its own context, so one process can serve several
+// resolutions and tuning profiles at once.
+typedef struct {
+    int width;                // Pixels per line
+    int height;               // Lines per frame
+    int stride;               // Pixels from the start of a line to the next in frame buffers
+    size_t linear_length;     // Pixels of a linear block
+    size_t quantized_size;    // Pixels of a bitplane block
+    size_t lut_size;          // Pixels of a lookup table block
+    int linear_tolerance;     // Largest channel error a linear block may have
+    uint32_t lut_threshold;   // Squared distance that opens a new lookup table color
+} c21_context;
+
+// Sets the resolution and the default tunables, the stride is the width
+void c21_context_init(c21_context* context, int width, int height);
+// Reads and writes the tunables as key=value lines, written by the tuner.
+// Both return 0 on failure, a failed load leaves the context unchanged.
+int c21_context_load_profile(c21_context* context, const char* path);
+int c21_context_save_profile(const c21_context* context, const char* path);
+
+size_t start_block(uint8_t verb, size_t length, uint8_t* output);
+// Writes row skip blocks for a run of unchanged rows of a frame stream.
+// The block after a row skip continues at the same x, rows lines below.
+// Datagrams address lines themselves, their segments never contain one.
+size_t encode_row_skip(size_t rows, uint8_t* output);
+size_t open_block(const uint8_t* input, uint8_t* verb, size_t* length);
+// Returns the bytes of the block at input with its header, like open_block
+// it reads the verb and the length
+size_t block_extent(const uint8_t* input, uint8_t* verb, size_t* length);
+void interpolate_linear(Vector3D start, Vector3D end, size_t length, Vector3D* output);
+
+// Output may be the reference itself to decode in place
+size_t decode_blocks(const c21_context* context, const uint8_t* input, size_t input_size,
+                     Vector3D* output, const Vector3D* reference);
+size_t encode_block(const c21_context* context, const Vector3D* input, const Vector3D* reference,
+                    size_t input_size, uint8_t* output, size_t output_size);
+
+// Presentation surface provided by the caller, like a shared memory XImage
+// or the data of an Imlib2 image. Pixels are native 0xAARRGGBB words.
+typedef struct {
+    uint32_t* pixels;
+    int stride;               // Pixels from the start of a row to the next
+    uint8_t* damaged_rows;    // Set for every row written, cleared by the presenter, may be NULL
+} c21_surface;
+
+// Converts length pixels into the surface at row, x and marks the row damaged
+void c21_surface_write(c21_surface* surface, int row, int x, const Vector3D* pixels, size_t length);
+// Same as decode_blocks, also writing the pixels of every block that is not
+// a skip to the surface unless it is NULL. Position is the pixel of output
+// from the start of the frame, rows of the surface are lines of the context.
+// Dithering follows the x of position, decode_blocks starts it at x zero.
+size_t decode_blocks_surface(const c21_context* context, const uint8_t* input, size_t input_size,
+                             Vector3D* output, const Vector3D* reference,
+                             c21_surface* surface, size_t position);
+// Same as encode_block, also writing the pixels the decoder will produce to
+// reconstructed. Reconstructed may be the reference itself. Input starts at
+// x zero of a line as far as dithering is concerned.
+size_t encode_block_reconstruct(const c21_context* context, const Vector3D* input,
+                                const Vector3D* reference, size_t input_size,
+                                uint8_t* output, size_t output_size, Vector3D* reconstructed);
+
+// Pixels compared at once by the dirty span search, spans start on a tile
+#define C21_DIRTY_TILE 16
+// Spans kept per line, the last one grows to cover any further changes
+#define C21_MAX_LINE_SPANS 64
+
+// Pixels [start, end) of a line that differ from the reference
+typedef struct {
+    int start;
+    int end;
+} c21_span;
+
+// Changed spans of every line of a frame, found once before encoding
+typedef struct {
+    int height;
+    int* counts;           // Spans of every line, zero for an unchanged line
+    c21_span* spans;       // C21_MAX_LINE_SPANS entries per line
+    size_t dirty_pixels;   // Pixels covered by all the spans
+} c21_dirty_map;
+
+// Allocates a map for height lines, returns 0 on failure
+int c21_dirty_map_init(c21_dirty_map* map, int height);
+void c21_dirty_map_free(c21_dirty_map* map);
+// Finds the changed spans of length pixels, returns the number of spans
+int find_dirty_spans(const Vector3D* input, const Vector3D* reference, size_t length,
+                     c21_span* spans, int capacity);
+// Finds the changed spans of every line of a frame laid out by the context
+void c21_find_dirty_frame(const c21_context* context, const Vector3D* frame,
+                          const Vector3D* reference, c21_dirty_map* map);
+// Same as encode_block_reconstruct for the pixels [first, first + length) of
+// a line, only encoding the spans and writing skip blocks for the rest.
+// Input, reference and reconstructed point at the start of the line.
+size_t encode_spans_reconstruct(const c21_context* context, const Vector3D* input,
+                                const Vector3D* reference, size_t first, size_t length,
+                                const c21_span* spans, int span_count,
+                                uint8_t* output, size_t output_size, Vector3D* reconstructed);
 
-#define WIDTH 1920
-#define HEIGHT 1080
+#endif
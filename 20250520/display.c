@@ -9,6 +9,9 @@
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,7 +21,7 @@
 #include "display.h"
 
 // Regular laptop processors may be slow to display for testing,
-// so we divide.
+// so we divide. Shared memory images are shown at full size unscaled.
 #define WINDOW_WIDTH (1920/4)
 #define WINDOW_HEIGHT (1080/4)
 
@@ -28,8 +31,62 @@ static Visual *visual;
 static Colormap colormap;
 static Imlib_Image buffer_image = NULL;
 static DATA32 *image_data = NULL;
+static int frame_width = 0;
+static int frame_height = 0;
 
-int init_display(void) {
+// Decoders write changed pixels into the surface, presenting uploads the damaged rows.
+// It is a MIT-SHM XImage when the server has the extension and a 32-bit
+// 0xRRGGBB visual, the Imlib2 image data otherwise.
+static c21_surface surface;
+static XImage *shm_image = NULL;
+static XShmSegmentInfo shm_info;
+static GC gc;
+
+// Function to create a shared memory image of the frame size, returns 0 if unavailable
+static int init_shm(int screen) {
+    if (!XShmQueryExtension(display) || DefaultDepth(display, screen) < 24 ||
+        visual->red_mask != 0xFF0000 || visual->green_mask != 0xFF00 || visual->blue_mask != 0xFF) {
+        return 0;
+    }
+    shm_image = XShmCreateImage(display, visual, DefaultDepth(display, screen), ZPixmap, NULL,
+                                &shm_info, frame_width, frame_height);
+    if (!shm_image) {
+        return 0;
+    }
+    if (shm_image->bits_per_pixel != 32) {
+        XDestroyImage(shm_image);
+        shm_image = NULL;
+        return 0;
+    }
+    shm_info.shmid = shmget(IPC_PRIVATE, shm_image->bytes_per_line * shm_image->height, IPC_CREAT | 0600);
+    if (shm_info.shmid < 0) {
+        XDestroyImage(shm_image);
+        shm_image = NULL;
+        return 0;
+    }
+    shm_info.shmaddr = shm_image->data = shmat(shm_info.shmid, NULL, 0);
+    shm_info.readOnly = False;
+    if (shm_info.shmaddr == (char*)-1 || !XShmAttach(display, &shm_info)) {
+        if (shm_info.shmaddr != (char*)-1) {
+            shmdt(shm_info.shmaddr);
+        }
+        shmctl(shm_info.shmid, IPC_RMID, NULL);
+        XDestroyImage(shm_image);
+        shm_image = NULL;
+        return 0;
+    }
+    XSync(display, False);
+    // The segment goes away with the last process detaching it
+    shmctl(shm_info.shmid, IPC_RMID, NULL);
+
+    surface.pixels = (uint32_t*)shm_image->data;
+    surface.stride = shm_image->bytes_per_line / 4;
+    return 1;
+}
+
+int init_display(int width, int height) {
+    frame_width = width;
+    frame_height = height;
     display = XOpenDisplay(NULL);
     if (!display) {
         fprintf(stderr, "Cannot open display\n");
@@ -40,77 +97,134 @@ int init_display(void) {
     visual = DefaultVisual(display, screen);
     colormap = DefaultColormap(display, screen);
     
+    int shared = init_shm(screen);
+    int window_width = shared ? frame_width : WINDOW_WIDTH;
+    int window_height = shared ? frame_height : WINDOW_HEIGHT;
     window = XCreateSimpleWindow(display, RootWindow(display, screen),
-                               100, 100, WINDOW_WIDTH, WINDOW_HEIGHT, 1,
+                               100, 100, window_width, window_height, 1,
                                BlackPixel(display, screen),
                                BlackPixel(display, screen));
     
     XSelectInput(display, window, ExposureMask | KeyPressMask);
     XMapWindow(display, window);
     XFlush(display);
+    gc = XCreateGC(display, window, 0, NULL);
     
-    imlib_context_set_display(display);
-    imlib_context_set_visual(visual);
-    imlib_context_set_colormap(colormap);
-    imlib_context_set_drawable(window);
-    
-    // Create an Imlib2 image to work with
-    buffer_image = imlib_create_image(WIDTH, HEIGHT);
-    if (!buffer_image) {
-        fprintf(stderr, "Failed to create Imlib2 image\n");
-        return 0;
+    if (!shared) {
+        imlib_context_set_display(display);
+        imlib_context_set_visual(visual);
+        imlib_context_set_colormap(colormap);
+        imlib_context_set_drawable(window);
+        
+        // Create an Imlib2 image to work with
+        buffer_image = imlib_create_image(frame_width, frame_height);
+        if (!buffer_image) {
+            fprintf(stderr, "Failed to create Imlib2 image\n");
+            return 0;
+        }
+        
+        imlib_context_set_image(buffer_image);
+        imlib_image_set_has_alpha(1);
+        image_data = imlib_image_get_data();
+        if (!image_data) {
+            fprintf(stderr, "Failed to get image data\n");
+            imlib_free_image();
+            buffer_image = NULL;
+            return 0;
+        }
+        surface.pixels = image_data;
+        surface.stride = frame_width;
     }
     
-    imlib_context_set_image(buffer_image);
-    image_data = imlib_image_get_data();
-    if (!image_data) {
-        fprintf(stderr, "Failed to get image data\n");
-        imlib_free_image();
+    surface.damaged_rows = calloc(frame_height, 1);
+    if (!surface.damaged_rows) {
+        fprintf(stderr, "Failed to allocate the damaged rows\n");
         return 0;
     }
     
-    // Clear the image initially
-    memset(image_data, 0, WIDTH * HEIGHT * 4);
+    // Clear the image initially, black like the reference frames start
+    for (int y = 0; y < frame_height; y++) {
+        for (int x = 0; x < frame_width; x++) {
+            surface.pixels[(size_t)y * surface.stride + x] = 0xFF000000u;
+        }
+    }
     
-    printf("Display initialized successfully with window size %dx%d\n", 
-           WINDOW_WIDTH, WINDOW_HEIGHT);
+    printf("Display initialized successfully with window size %dx%d%s\n", 
+           window_width, window_height, shared ? " using shared memory" : "");
     return 1;
 }
 
-void display_frame(const Vector3D* buffer) {
-    if (!display || !buffer_image || !buffer || !image_data) return;
-    
+c21_surface* display_surface(void) {
+    return (display && surface.damaged_rows) ? &surface : NULL;
+}
+
+// Function to upload rows [first, last) of the surface
+static void present_rows(int first, int last) {
+    if (shm_image) {
+        XShmPutImage(display, window, gc, shm_image, 0, first, 0, first,
+                     frame_width, last - first, False);
+        return;
+    }
+    // Scaled rows cover whole window rows, so round the band out to them
+    int window_first = first * WINDOW_HEIGHT / frame_height;
+    int window_last = (last * WINDOW_HEIGHT + frame_height - 1) / frame_height;
+    first = window_first * frame_height / WINDOW_HEIGHT;
+    last = (window_last * frame_height + WINDOW_HEIGHT - 1) / WINDOW_HEIGHT;
+    if (last > frame_height) last = frame_height;
     imlib_context_set_image(buffer_image);
+    imlib_render_image_part_on_drawable_at_size(0, first, frame_width, last - first,
+                                                0, window_first, WINDOW_WIDTH,
+                                                window_last - window_first);
+}
+
+void display_damage(void) {
+    if (!display_surface()) return;
     
-    // Convert Vector3D buffer to Imlib2 image format (ARGB)
-    for (int y = 0; y < HEIGHT; y++) {
-        for (int x = 0; x < WIDTH; x++) {
-            const Vector3D* pixel = &buffer[y * WIDTH + x];
-            int idx = y * WIDTH + x;
-            
-            // ARGB format for Imlib2
-            image_data[idx] = (0xFF << 24) | // Alpha
-                             ((pixel->x & 0xFF) << 16) | // Red
-                             ((pixel->y & 0xFF) << 8) | // Green
-                             (pixel->z & 0xFF); // Blue
+    for (int y = 0; y < frame_height; y++) {
+        if (!surface.damaged_rows[y]) continue;
+        int first = y;
+        while (y < frame_height && surface.damaged_rows[y]) {
+            surface.damaged_rows[y++] = 0;
         }
+        present_rows(first, y);
     }
     
-    imlib_image_set_has_alpha(1);
+    // The server reads shared memory later, decoders must not write it before
+    if (shm_image) {
+        XSync(display, False);
+    } else {
+        XFlush(display);
+    }
+}
+
+void display_frame(const Vector3D* buffer) {
+    if (!display_surface() || !buffer) return;
     
-    // Render the image scaled to the window size
-    imlib_render_image_on_drawable_at_size(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT);
-    XFlush(display);
+    for (int y = 0; y < frame_height; y++) {
+        c21_surface_write(&surface, y, 0, &buffer[y * frame_width], frame_width);
+    }
+    display_damage();
 }
 
 void cleanup_display(void) {
     if (buffer_image) {
         imlib_context_set_image(buffer_image);
         imlib_free_image();
+        buffer_image = NULL;
     }
     
+    if (shm_image) {
+        XShmDetach(display, &shm_info);
+        XDestroyImage(shm_image);
+        shmdt(shm_info.shmaddr);
+        shm_image = NULL;
+    }
+    free(surface.damaged_rows);
+    surface.damaged_rows = NULL;
+    
     if (display) {
+        XFreeGC(display, gc);
         XCloseDisplay(display);
         display = NULL;
     }
-}
\ No newline at end of file
+}
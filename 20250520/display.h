@@ -11,9 +11,15 @@
 #define DISPLAY_H
 
 #include <stdint.h>
+#include "codec21.h"
 
-int init_display(void);
+int init_display(int width, int height);
+// Converts and shows a whole frame
 void display_frame(const Vector3D* buffer);
+// Surface to decode changed pixels into, NULL without a display
+c21_surface* display_surface(void);
+// Shows the rows of the surface written since the previous call
+void display_damage(void);
 void cleanup_display(void);
 
 extern volatile int kanban;
@@ -0,0 +1,243 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+// Forward error correction of the UDP sender and receiver.
+// A lost datagram left its lines stale until the refresh strip of the sender
+// came around again, up to a hundred frames later. One parity datagram per
+// group lets the receiver rebuild a single loss of the group within the
+// frame. The receiver learns the groups from the parity datagrams, so it
+// needs no setting of its own.
+
+#include <stdlib.h>
+#include <string.h>
+#include "fec.h"
+#include "transport.h"
+
+// Function to write a big endian 16-bit field
+static void put_u16(uint8_t* output, uint32_t value) {
+    output[0] = (uint8_t)(value >> 8);
+    output[1] = (uint8_t)value;
+}
+
+static uint32_t get_u16(const uint8_t* input) {
+    return ((uint32_t)input[0] << 8) | input[1];
+}
+
+// Function to XOR size bytes of input into output
+static void xor_bytes(uint8_t* output, const uint8_t* input, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        output[i] ^= input[i];
+    }
+}
+
+int c21_fec_encoder_init(c21_fec_encoder* encoder, int group_size, int interleave, size_t mtu,
+                         void (*send)(const uint8_t* packet, size_t size, void* user), void* user) {
+    memset(encoder, 0, sizeof(*encoder));
+    if (group_size < 1 || group_size > C21_MAX_PACKET_SEGMENTS || interleave < 1 ||
+        group_size * interleave > C21_FEC_CACHE || mtu > 0xFFFF) {
+        return 0;
+    }
+    encoder->parity = malloc((C21_FEC_HEADER_SIZE + mtu) * interleave);
+    encoder->members = calloc(interleave, sizeof(int));
+    encoder->longest = calloc(interleave, sizeof(size_t));
+    if (!encoder->parity || !encoder->members || !encoder->longest) {
+        c21_fec_encoder_free(encoder);
+        return 0;
+    }
+    encoder->group_size = group_size;
+    encoder->interleave = interleave;
+    encoder->mtu = mtu;
+    encoder->send = send;
+    encoder->user = user;
+    return 1;
+}
+
+void c21_fec_encoder_free(c21_fec_encoder* encoder) {
+    free(encoder->parity);
+    free(encoder->members);
+    free(encoder->longest);
+    encoder->parity = NULL;
+    encoder->members = NULL;
+    encoder->longest = NULL;
+}
+
+// Function to send the parity of a lane and start its next group
+static void send_parity(c21_fec_encoder* encoder, int lane) {
+    uint8_t* parity = &encoder->parity[lane * (C21_FEC_HEADER_SIZE + encoder->mtu)];
+    parity[3] = (uint8_t)encoder->members[lane];
+    encoder->send(parity, C21_FEC_HEADER_SIZE + encoder->longest[lane], encoder->user);
+    encoder->members[lane] = 0;
+    encoder->parity_sent++;
+}
+
+// Function to send the parity of every group still open, the lane of the
+// last datagram last, so the receiver knows when no more parity follows
+static void flush_lanes(c21_fec_encoder* encoder, int last_lane) {
+    for (int k = 1; k <= encoder->interleave; k++) {
+        int lane = (last_lane + k) % encoder->interleave;
+        if (encoder->members[lane] > 0) {
+            send_parity(encoder, lane);
+        }
+    }
+}
+
+void c21_fec_send(c21_fec_encoder* encoder, const uint8_t* packet, size_t size) {
+    encoder->send(packet, size, encoder->user);
+
+    c21_packet_header header;
+    if (size > encoder->mtu || !c21_packet_parse_header(packet, size, &header) ||
+        (header.flags & C21_FLAG_PARITY)) {
+        return;
+    }
+    // A frame that ended without its last datagram
+    if (header.frame != encoder->frame) {
+        flush_lanes(encoder, encoder->interleave - 1);
+        encoder->frame = header.frame;
+    }
+
+    int lane = (int)(header.packet % (uint32_t)encoder->interleave);
+    uint8_t* parity = &encoder->parity[lane * (C21_FEC_HEADER_SIZE + encoder->mtu)];
+    if (encoder->members[lane] == 0) {
+        c21_packet_begin(parity, header.frame, header.packet, C21_FLAG_PARITY);
+        put_u16(&parity[12], (uint32_t)encoder->interleave);
+        put_u16(&parity[14], 0);
+        memset(&parity[C21_FEC_HEADER_SIZE], 0, encoder->mtu);
+        encoder->longest[lane] = 0;
+    }
+    xor_bytes(&parity[C21_FEC_HEADER_SIZE], packet, size);
+    put_u16(&parity[14], get_u16(&parity[14]) ^ (uint32_t)size);
+    if (size > encoder->longest[lane]) {
+        encoder->longest[lane] = size;
+    }
+
+    if (++encoder->members[lane] == encoder->group_size) {
+        send_parity(encoder, lane);
+    }
+    if (header.flags & C21_FLAG_END_OF_FRAME) {
+        flush_lanes(encoder, lane);
+    }
+}
+
+void c21_fec_decoder_init(c21_fec_decoder* decoder) {
+    memset(decoder, 0, sizeof(*decoder));
+}
+
+void c21_fec_decoder_free(c21_fec_decoder* decoder) {
+    for (int i = 0; i < C21_FEC_CACHE; i++) {
+        free(decoder->entries[i].data);
+    }
+    memset(decoder, 0, sizeof(*decoder));
+}
+
+// Function to find a datagram kept of a frame, NULL if it is not there
+static c21_fec_entry* find_entry(c21_fec_decoder* decoder, uint32_t frame, uint32_t packet) {
+    c21_fec_entry* entry = &decoder->entries[packet % C21_FEC_CACHE];
+    if (entry->valid && entry->frame == frame && entry->packet == packet) {
+        return entry;
+    }
+    return NULL;
+}
+
+int c21_fec_remember(c21_fec_decoder* decoder, const uint8_t* packet, size_t size) {
+    c21_packet_header header;
+    if (!c21_packet_parse_header(packet, size, &header)) {
+        return 1;
+    }
+    // The parity covers the datagram as sent, segmentation offload pads all
+    // but the last datagram of a batch to the mtu on the way
+    size = c21_packet_length(packet, size);
+    if (size == 0) {
+        return 1;
+    }
+    if (find_entry(decoder, header.frame, header.packet)) {
+        return 0;
+    }
+    c21_fec_entry* entry = &decoder->entries[header.packet % C21_FEC_CACHE];
+    // Slots grow to the largest datagram once and are reused after that
+    if (size > entry->capacity) {
+        uint8_t* data = realloc(entry->data, size);
+        if (!data) {
+            entry->valid = 0;
+            return 1;
+        }
+        entry->data = data;
+        entry->capacity = size;
+    }
+    memcpy(entry->data, packet, size);
+    entry->size = size;
+    entry->frame = header.frame;
+    entry->packet = header.packet;
+    entry->valid = 1;
+    return 1;
+}
+
+int c21_fec_parity_members(const uint8_t* parity, size_t size, uint32_t* first, uint32_t* stride) {
+    c21_packet_header header;
+    if (size < C21_FEC_HEADER_SIZE || !c21_packet_parse_header(parity, size, &header) ||
+        !(header.flags & C21_FLAG_PARITY)) {
+        return 0;
+    }
+    *first = header.packet;
+    *stride = get_u16(&parity[12]);
+    if (*stride == 0 || header.segment_count * *stride > C21_FEC_CACHE) {
+        return 0;
+    }
+    return header.segment_count;
+}
+
+size_t c21_fec_recover(c21_fec_decoder* decoder, uint8_t* parity, size_t size, uint8_t** rebuilt) {
+    c21_packet_header header;
+    uint32_t first, stride;
+    uint32_t members = (uint32_t)c21_fec_parity_members(parity, size, &first, &stride);
+    if (members == 0 || !c21_packet_parse_header(parity, size, &header)) {
+        return 0;
+    }
+
+    uint32_t lost = 0;
+    int lost_count = 0;
+    for (uint32_t m = 0; m < members; m++) {
+        uint32_t packet = first + m * stride;
+        if (!find_entry(decoder, header.frame, packet)) {
+            lost = packet;
+            lost_count++;
+        }
+    }
+    if (lost_count != 1) {
+        if (lost_count > 1) {
+            decoder->unrecoverable++;
+        }
+        return 0;
+    }
+
+    // The members that arrived cancel out of the parity, the lost one is left
+    uint8_t* payload = &parity[C21_FEC_HEADER_SIZE];
+    size_t payload_size = size - C21_FEC_HEADER_SIZE;
+    size_t lost_size = get_u16(&parity[14]);
+    for (uint32_t m = 0; m < members; m++) {
+        uint32_t packet = first + m * stride;
+        if (packet == lost) {
+            continue;
+        }
+        c21_fec_entry* entry = find_entry(decoder, header.frame, packet);
+        if (entry->size > payload_size) {
+            return 0;
+        }
+        xor_bytes(payload, entry->data, entry->size);
+        lost_size ^= entry->size;
+    }
+    c21_packet_header lost_header;
+    if (lost_size > payload_size || !c21_packet_parse_header(payload, lost_size, &lost_header) ||
+        lost_header.frame != header.frame || lost_header.packet != lost ||
+        (lost_header.flags & C21_FLAG_PARITY)) {
+        return 0;
+    }
+    decoder->recovered++;
+    *rebuilt = payload;
+    return lost_size;
+}
@@ -0,0 +1,92 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+#ifndef FEC_H
+#define FEC_H
+
+// XOR parity of groups of datagrams, so the receiver rebuilds a lost one
+// without asking for it again.
+//
+// Parity datagram layout, fields big endian:
+//   the datagram header of transport.h with C21_FLAG_PARITY, the member
+//   count in place of the segment count and the first member as packet,
+//   then stride u16, the XOR of the member sizes u16, and the XOR of the
+//   members, each padded with zeros to the longest one.
+// Members are every stride-th datagram from the first one. Interleaving the
+// groups keeps a burst of consecutive losses to one datagram per group.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Bytes a parity datagram adds to the longest member, data datagrams are
+// this much shorter than the mtu when parity is sent
+#define C21_FEC_HEADER_SIZE 16
+// Groups interleaved when only the group size is given
+#define C21_FEC_DEFAULT_INTERLEAVE 4
+// Latest datagrams the receiver keeps, every group has to fit
+#define C21_FEC_CACHE 256
+
+// Sends a parity datagram after every group_size datagrams of a lane.
+// Datagram n of a frame belongs to lane n % interleave.
+typedef struct {
+    int group_size;
+    int interleave;
+    size_t mtu;                 // Largest datagram protected
+    uint8_t* parity;            // Parity being built of every lane, C21_FEC_HEADER_SIZE + mtu bytes each
+    int* members;               // Datagrams in the parity of every lane
+    size_t* longest;
+    uint32_t frame;
+    void (*send)(const uint8_t* packet, size_t size, void* user);
+    void* user;
+    size_t parity_sent;
+} c21_fec_encoder;
+
+// Prepares parity of group_size datagrams of up to mtu bytes, passing every
+// datagram and parity to send. Returns 0 for a group that does not fit the
+// receiver cache or if memory runs out.
+int c21_fec_encoder_init(c21_fec_encoder* encoder, int group_size, int interleave, size_t mtu,
+                         void (*send)(const uint8_t* packet, size_t size, void* user), void* user);
+void c21_fec_encoder_free(c21_fec_encoder* encoder);
+// Sends a datagram and adds it to the parity of its lane. Parity goes out
+// once a group is complete and for every open group at the end of the frame.
+void c21_fec_send(c21_fec_encoder* encoder, const uint8_t* packet, size_t size);
+
+// A datagram kept for the parity after it
+typedef struct {
+    uint32_t frame;
+    uint32_t packet;
+    int valid;
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} c21_fec_entry;
+
+// Keeps copies of the latest datagrams, slots are reused by packet number
+typedef struct {
+    c21_fec_entry entries[C21_FEC_CACHE];
+    size_t recovered;           // Datagrams rebuilt from parity
+    size_t unrecoverable;       // Groups that lost more than one datagram
+} c21_fec_decoder;
+
+void c21_fec_decoder_init(c21_fec_decoder* decoder);
+void c21_fec_decoder_free(c21_fec_decoder* decoder);
+// Keeps a data datagram for recovery, without padding after its segments.
+// Returns 0 if it arrived or was rebuilt before, it must not be decoded
+// twice then.
+int c21_fec_remember(c21_fec_decoder* decoder, const uint8_t* packet, size_t size);
+// Reads which datagrams a parity datagram covers, returns their count or 0
+// if it is not a parity datagram
+int c21_fec_parity_members(const uint8_t* parity, size_t size, uint32_t* first, uint32_t* stride);
+// Rebuilds the datagram a parity datagram of size bytes stands in for if its
+// group lost only that one. The datagram is rebuilt in place of the parity,
+// *rebuilt points to it. Returns its size, or 0 if nothing was rebuilt.
+// The rebuilt datagram goes through c21_fec_remember like one received.
+size_t c21_fec_recover(c21_fec_decoder* decoder, uint8_t* parity, size_t size, uint8_t** rebuilt);
+
+#endif
@@ -0,0 +1,175 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+// Selective retransmission of the UDP sender and receiver.
+// The receiver sees a gap in the datagram numbers of a frame and asks for
+// that range right away, and for what is still missing once the frame ends.
+// On a local network the datagrams are back within a round trip, where the
+// refresh strip of the sender would take up to a hundred frames. Nothing
+// is sent while nothing is lost, so it costs less than parity then.
+
+#include <stdlib.h>
+#include <string.h>
+#include "nack.h"
+#include "transport.h"
+
+// Function to write a big endian 16-bit field
+static void put_u16(uint8_t* output, uint32_t value) {
+    output[0] = (uint8_t)(value >> 8);
+    output[1] = (uint8_t)value;
+}
+
+// Function to write a big endian 32-bit field
+static void put_u32(uint8_t* output, uint32_t value) {
+    put_u16(output, value >> 16);
+    put_u16(output + 2, value & 0xFFFF);
+}
+
+static uint32_t get_u16(const uint8_t* input) {
+    return ((uint32_t)input[0] << 8) | input[1];
+}
+
+static uint32_t get_u32(const uint8_t* input) {
+    return (get_u16(input) << 16) | get_u16(input + 2);
+}
+
+size_t c21_nack_write(uint8_t* packet, size_t capacity, uint32_t frame, const c21_nack_range* ranges, int count) {
+    if (count < 1 || count > C21_NACK_MAX_RANGES ||
+        capacity < C21_PACKET_HEADER_SIZE + (size_t)count * C21_NACK_RANGE_SIZE) {
+        return 0;
+    }
+    size_t size = c21_packet_begin(packet, frame, 0, C21_FLAG_NACK);
+    packet[3] = (uint8_t)count;
+    for (int r = 0; r < count; r++) {
+        put_u32(&packet[size], ranges[r].first);
+        put_u16(&packet[size + 4], ranges[r].count > 0xFFFF ? 0xFFFF : ranges[r].count);
+        size += C21_NACK_RANGE_SIZE;
+    }
+    return size;
+}
+
+int c21_nack_parse(const uint8_t* packet, size_t size, uint32_t* frame, c21_nack_range* ranges, int capacity) {
+    c21_packet_header header;
+    if (!c21_packet_parse_header(packet, size, &header) || !(header.flags & C21_FLAG_NACK) ||
+        header.segment_count > capacity ||
+        size < C21_PACKET_HEADER_SIZE + (size_t)header.segment_count * C21_NACK_RANGE_SIZE) {
+        return -1;
+    }
+    *frame = header.frame;
+    for (int r = 0; r < header.segment_count; r++) {
+        const uint8_t* range = &packet[C21_PACKET_HEADER_SIZE + r * C21_NACK_RANGE_SIZE];
+        ranges[r].first = get_u32(range);
+        ranges[r].count = get_u16(range + 4);
+    }
+    return header.segment_count;
+}
+
+void c21_nack_begin_frame(c21_nack_tracker* tracker, uint32_t frame) {
+    memset(tracker, 0, sizeof(*tracker));
+    tracker->frame = frame;
+}
+
+int c21_nack_mark(c21_nack_tracker* tracker, uint32_t packet, c21_nack_range* range) {
+    if (packet >= C21_NACK_MAX_PACKETS) {
+        return 0;
+    }
+    tracker->received[packet / 64] |= 1ull << (packet % 64);
+    if (packet < tracker->next) {
+        return 0;
+    }
+    int skipped = packet > tracker->next;
+    if (skipped) {
+        range->first = tracker->next;
+        range->count = packet - tracker->next;
+        tracker->requested += range->count;
+    }
+    tracker->next = packet + 1;
+    return skipped;
+}
+
+int c21_nack_missing(c21_nack_tracker* tracker, uint32_t packet_count, c21_nack_range* ranges, int capacity) {
+    if (packet_count > C21_NACK_MAX_PACKETS) {
+        packet_count = C21_NACK_MAX_PACKETS;
+    }
+    int count = 0;
+    for (uint32_t packet = 0; packet < packet_count && count < capacity; packet++) {
+        if (tracker->received[packet / 64] & (1ull << (packet % 64))) {
+            continue;
+        }
+        if (count > 0 && ranges[count - 1].first + ranges[count - 1].count == packet) {
+            ranges[count - 1].count++;
+        } else {
+            ranges[count].first = packet;
+            ranges[count++].count = 1;
+        }
+        tracker->requested++;
+    }
+    return count;
+}
+
+int c21_retransmit_init(c21_retransmit_ring* ring, int capacity, size_t mtu) {
+    memset(ring, 0, sizeof(*ring));
+    ring->slots = malloc(mtu * capacity);
+    ring->sizes = calloc(capacity, sizeof(size_t));
+    if (!ring->slots || !ring->sizes) {
+        c21_retransmit_free(ring);
+        return 0;
+    }
+    ring->mtu = mtu;
+    ring->capacity = capacity;
+    return 1;
+}
+
+void c21_retransmit_free(c21_retransmit_ring* ring) {
+    free(ring->slots);
+    free(ring->sizes);
+    ring->slots = NULL;
+    ring->sizes = NULL;
+}
+
+void c21_retransmit_store(c21_retransmit_ring* ring, const uint8_t* packet, size_t size) {
+    c21_packet_header header;
+    if (size > ring->mtu || !c21_packet_parse_header(packet, size, &header) ||
+        (header.flags & (C21_FLAG_PARITY | C21_FLAG_NACK))) {
+        return;
+    }
+    memcpy(&ring->slots[ring->next * ring->mtu], packet, size);
+    ring->sizes[ring->next] = size;
+    ring->next = (ring->next + 1) % ring->capacity;
+}
+
+int c21_retransmit(c21_retransmit_ring* ring, uint32_t frame, const c21_nack_range* ranges, int count,
+                   void (*send)(const uint8_t* packet, size_t size, void* user), void* user) {
+    size_t requested = 0;
+    for (int r = 0; r < count; r++) {
+        requested += ranges[r].count;
+    }
+    // Every slot is looked at once, a NACK is rare and the ring is short
+    int sent = 0;
+    for (int slot = 0; slot < ring->capacity; slot++) {
+        const uint8_t* packet = &ring->slots[slot * ring->mtu];
+        c21_packet_header header;
+        if (ring->sizes[slot] == 0 || !c21_packet_parse_header(packet, ring->sizes[slot], &header) ||
+            header.frame != frame) {
+            continue;
+        }
+        for (int r = 0; r < count; r++) {
+            if (header.packet - ranges[r].first < ranges[r].count) {
+                send(packet, ring->sizes[slot], user);
+                sent++;
+                break;
+            }
+        }
+    }
+    ring->retransmitted += sent;
+    if (requested > (size_t)sent) {
+        ring->expired += requested - sent;
+    }
+    return sent;
+}
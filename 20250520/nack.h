@@ -0,0 +1,81 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+#ifndef NACK_H
+#define NACK_H
+
+// Negative acknowledgements, the receiver asks for the datagrams it missed
+// and the sender sends them again from the datagrams it sent last.
+//
+// NACK datagram layout, fields big endian:
+//   the datagram header of transport.h with C21_FLAG_NACK, the range count
+//   in place of the segment count and zero as packet, then per range the
+//   first datagram u32 and the number of datagrams u16.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define C21_NACK_RANGE_SIZE 6
+// Ranges a NACK datagram carries at most
+#define C21_NACK_MAX_RANGES 64
+// Datagrams of a frame the receiver keeps track of, later ones are not asked for
+#define C21_NACK_MAX_PACKETS 4096
+// Datagrams the sender keeps for sending again
+#define C21_RETRANSMIT_DATAGRAMS 1024
+
+// Datagrams first to first + count - 1 of a frame
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} c21_nack_range;
+
+// Writes a NACK datagram asking for ranges of frame into capacity bytes,
+// returns its size or 0 if it does not fit
+size_t c21_nack_write(uint8_t* packet, size_t capacity, uint32_t frame, const c21_nack_range* ranges, int count);
+// Reads a NACK datagram, returns the number of ranges or -1 if it is not one
+int c21_nack_parse(const uint8_t* packet, size_t size, uint32_t* frame, c21_nack_range* ranges, int capacity);
+
+// Datagrams of the current frame that arrived
+typedef struct {
+    uint32_t frame;
+    uint32_t next;                 // One past the highest datagram that arrived
+    uint64_t received[C21_NACK_MAX_PACKETS / 64];
+    size_t requested;              // Datagrams of the frame asked for
+} c21_nack_tracker;
+
+void c21_nack_begin_frame(c21_nack_tracker* tracker, uint32_t frame);
+// Marks a datagram as arrived. Returns 1 and the range skipped if it came
+// after a gap in the sequence numbers, 0 otherwise.
+int c21_nack_mark(c21_nack_tracker* tracker, uint32_t packet, c21_nack_range* range);
+// Lists the datagrams below packet_count still missing, returns the number of ranges
+int c21_nack_missing(c21_nack_tracker* tracker, uint32_t packet_count, c21_nack_range* ranges, int capacity);
+
+// Copies of the latest datagrams sent, the oldest is overwritten.
+// Not thread safe, a sender answering NACKs on another thread locks it.
+typedef struct {
+    uint8_t* slots;                // capacity datagrams of mtu bytes
+    size_t* sizes;                 // Zero for an empty slot
+    size_t mtu;
+    int capacity;
+    int next;                      // Slot the next datagram goes to
+    size_t retransmitted;
+    size_t expired;                // Datagrams asked for after they were overwritten
+} c21_retransmit_ring;
+
+// Returns 0 if memory runs out
+int c21_retransmit_init(c21_retransmit_ring* ring, int capacity, size_t mtu);
+void c21_retransmit_free(c21_retransmit_ring* ring);
+// Keeps a copy of a data datagram, parity is rebuilt rather than sent again
+void c21_retransmit_store(c21_retransmit_ring* ring, const uint8_t* packet, size_t size);
+// Sends the datagrams of the ranges of frame that are still kept,
+// returns how many were sent
+int c21_retransmit(c21_retransmit_ring* ring, uint32_t frame, const c21_nack_range* ranges, int count,
+                   void (*send)(const uint8_t* packet, size_t size, void* user), void* user);
+
+#endif
@@ -0,0 +1,683 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+// Persistent encoder workers for whole frames.
+// Each frame is cut into batches of lines. Every worker starts with an equal
+// contiguous range of batches and takes them from the front one by one.
+// A worker that runs dry steals from the front of the other ranges, so busy
+// bands of the screen get shared instead of leaving the other workers idle.
+// Statistics are kept per worker and merged once the frame is done.
+// Before the workers start, the calling thread compares the whole frame to
+// the reference tile by tile. Workers then encode only the changed spans and
+// write skip blocks for the rest, so unchanged lines cost next to nothing.
+// Frames in another pixel format are converted line by line into a buffer of
+// the worker, which then finds the changed spans of that line itself.
+//
+// Decoder workers each own a lock-free ring. The receiving thread hands every
+// segment to the worker owning its band of lines, so workers never write the
+// same pixels and segments of a line are decoded in the order they arrived.
+// The rings hold a few segments per receive buffer, so a burst of slow
+// decodes is absorbed without the receiving thread waiting. Only a worker
+// that stays behind holds it back, at a full ring or when every buffer is
+// queued. The socket buffer takes the overload then, and what it drops
+// shows as missing datagrams that parity and NACKs recover. A segment
+// queued is never dropped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include "pool.h"
+
+typedef struct {
+    _Alignas(64) atomic_int next;  // Next batch to take from this range
+    int end;                       // One past the last batch of this range
+    c21_pool* pool;
+    int index;
+    // Statistics of the current frame, written by this worker only. They
+    // start a cache line of their own, stealing workers write next above.
+    _Alignas(64) size_t bytes_compressed;
+    size_t compressible_size;
+    double encode_time_us;
+    int batches_stolen;
+    size_t dirty_pixels;
+    // Converted line of a source frame
+    Vector3D* line_buffer;
+    int line_capacity;
+} PoolWorker;
+
+struct c21_pool {
+    int num_threads;
+    pthread_t* threads;
+    PoolWorker* workers;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned long generation;  // Incremented for every frame
+    int active;                // Workers still busy with the current frame
+    bool stopping;
+
+    // The frame being encoded, either Vector3D pixels or a source
+    const Vector3D* frame;
+    const c21_source* source;
+    const Vector3D* reference;
+    Vector3D* reconstructed;
+    const c21_context* context;
+    c21_line* lines;
+    c21_dirty_map dirty;  // Changed spans of the frame, NULL spans if unavailable
+    c21_surface* surface; // Receives the reconstructed changed spans, may be NULL
+};
+
+static double elapsed_us(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_nsec - start.tv_nsec) / 1000.0;
+}
+
+// Function to write the reconstructed spans of a line to the surface, the
+// whole line without spans. Spans were encoded from an even pixel on.
+static void present_line(c21_surface* surface, int line, const Vector3D* reconstructed, int width,
+                         const c21_span* spans, int count) {
+    if (!spans) {
+        c21_surface_write(surface, line, 0, reconstructed, width);
+        return;
+    }
+    for (int s = 0; s < count; s++) {
+        int start = spans[s].start & ~1;
+        int end = spans[s].end < width ? spans[s].end : width;
+        c21_surface_write(surface, line, start, &reconstructed[start], end - start);
+    }
+}
+
+static void encode_batch(c21_pool* pool, PoolWorker* worker, int batch) {
+    int first = batch * C21_POOL_BATCH_LINES;
+    int last = first + C21_POOL_BATCH_LINES;
+    if (last > pool->context->height) last = pool->context->height;
+
+    for (int line = first; line < last; line++) {
+        size_t start_pos = (size_t)line * pool->context->stride;
+        c21_line* out = &pool->lines[line];
+
+        // Time the worker ran, a preempted worker does not count the wait
+        struct timespec encode_start, encode_end;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &encode_start);
+        Vector3D* reconstructed = pool->reconstructed ? &pool->reconstructed[start_pos] : NULL;
+        c21_span line_spans[C21_MAX_LINE_SPANS];
+        const c21_span* spans = NULL;
+        int count = 0;
+        if (pool->source) {
+            const Vector3D* input = c21_source_line(pool->source, line, 0, pool->context->width,
+                                                    worker->line_buffer);
+            count = find_dirty_spans(input, &pool->reference[start_pos], pool->context->width,
+                                     line_spans, C21_MAX_LINE_SPANS);
+            spans = line_spans;
+            for (int s = 0; s < count; s++) {
+                worker->dirty_pixels += spans[s].end - spans[s].start;
+            }
+            out->size = encode_spans_reconstruct(pool->context, input, &pool->reference[start_pos],
+                                                 0, pool->context->width, spans, count,
+                                                 out->data, out->capacity, reconstructed);
+        } else if (pool->dirty.spans) {
+            spans = &pool->dirty.spans[(size_t)line * C21_MAX_LINE_SPANS];
+            count = pool->dirty.counts[line];
+            out->size = encode_spans_reconstruct(pool->context, &pool->frame[start_pos],
+                                                 &pool->reference[start_pos], 0, pool->context->width,
+                                                 spans, count, out->data, out->capacity,
+                                                 reconstructed);
+        } else {
+            out->size = encode_block_reconstruct(pool->context, &pool->frame[start_pos],
+                                                 &pool->reference[start_pos],
+                                                 pool->context->width, out->data, out->capacity,
+                                                 reconstructed);
+        }
+        if (pool->surface && reconstructed) {
+            present_line(pool->surface, line, reconstructed, pool->context->width, spans, count);
+        }
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &encode_end);
+
+        worker->encode_time_us += elapsed_us(encode_start, encode_end);
+        worker->bytes_compressed += out->size;
+        worker->compressible_size += pool->context->width * sizeof(Vector3D);
+    }
+}
+
+// Takes the next batch of a range, -1 if the range is used up
+static int take_batch(PoolWorker* range) {
+    if (atomic_load_explicit(&range->next, memory_order_relaxed) >= range->end) {
+        return -1;
+    }
+    int batch = atomic_fetch_add_explicit(&range->next, 1, memory_order_relaxed);
+    return (batch < range->end) ? batch : -1;
+}
+
+static void run_frame(c21_pool* pool, PoolWorker* worker) {
+    int batch;
+    while ((batch = take_batch(worker)) >= 0) {
+        encode_batch(pool, worker, batch);
+    }
+    // Own range is done, help the others starting with the next neighbour
+    for (int k = 1; k < pool->num_threads; k++) {
+        PoolWorker* victim = &pool->workers[(worker->index + k) % pool->num_threads];
+        while ((batch = take_batch(victim)) >= 0) {
+            encode_batch(pool, worker, batch);
+            worker->batches_stolen++;
+        }
+    }
+}
+
+static void* pool_worker(void* arg) {
+    PoolWorker* worker = (PoolWorker*)arg;
+    c21_pool* pool = worker->pool;
+    unsigned long seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->stopping && pool->generation == seen) {
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        }
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->mutex);
+            return NULL;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+
+        run_frame(pool, worker);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->active == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+c21_pool* c21_pool_create(int num_threads) {
+    if (num_threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (cores > 0) ? (int)cores : 1;
+    }
+
+    c21_pool* pool = calloc(1, sizeof(c21_pool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->threads = calloc(num_threads, sizeof(pthread_t));
+    if (!pool->threads ||
+        posix_memalign((void**)&pool->workers, 64, num_threads * sizeof(PoolWorker)) != 0) {
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    memset(pool->workers, 0, num_threads * sizeof(PoolWorker));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (int t = 0; t < num_threads; t++) {
+        pool->workers[t].pool = pool;
+        pool->workers[t].index = t;
+        if (pthread_create(&pool->threads[t], NULL, pool_worker, &pool->workers[t]) != 0) {
+            fprintf(stderr, "Failed to create encode thread %d\n", t);
+            break;
+        }
+        pool->num_threads++;
+    }
+    if (pool->num_threads == 0) {
+        c21_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void c21_pool_destroy(c21_pool* pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int t = 0; t < pool->num_threads; t++) {
+        pthread_join(pool->threads[t], NULL);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    c21_dirty_map_free(&pool->dirty);
+    for (int t = 0; t < pool->num_threads; t++) {
+        free(pool->workers[t].line_buffer);
+    }
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
+
+int c21_pool_size(const c21_pool* pool) {
+    return pool->num_threads;
+}
+
+void c21_pool_set_surface(c21_pool* pool, c21_surface* surface) {
+    pool->surface = surface;
+}
+
+// Function to run the workers over a frame given either as Vector3D pixels
+// or as a source
+static void encode_parallel(c21_pool* pool, const c21_context* context, const Vector3D* frame,
+                            const c21_source* source, const Vector3D* reference,
+                            Vector3D* reconstructed, c21_line* lines, c21_encode_stats* stats) {
+    int batches = (context->height + C21_POOL_BATCH_LINES - 1) / C21_POOL_BATCH_LINES;
+
+    pool->frame = frame;
+    pool->source = source;
+    pool->reference = reference;
+    pool->reconstructed = reconstructed;
+    pool->context = context;
+    pool->lines = lines;
+
+    size_t heap_calls = 0;
+    if (source) {
+        // Every worker converts its lines into a buffer of the frame width
+        for (int t = 0; t < pool->num_threads; t++) {
+            PoolWorker* worker = &pool->workers[t];
+            if (worker->line_capacity < context->width) {
+                heap_calls += worker->line_buffer ? 2 : 1;
+                free(worker->line_buffer);
+                worker->line_buffer = malloc(context->width * sizeof(Vector3D));
+                worker->line_capacity = worker->line_buffer ? context->width : 0;
+                if (!worker->line_buffer) {
+                    fprintf(stderr, "Failed to allocate a line buffer, frame not encoded\n");
+                    if (stats) {
+                        memset(stats, 0, sizeof(*stats));
+                    }
+                    return;
+                }
+            }
+        }
+    } else {
+        // Find the changed spans once for all workers, the map follows the height
+        if (pool->dirty.height != context->height) {
+            heap_calls += pool->dirty.spans ? 4 : 2;  // Two frees and two allocations
+            c21_dirty_map_free(&pool->dirty);
+            if (!c21_dirty_map_init(&pool->dirty, context->height)) {
+                fprintf(stderr, "Failed to allocate the dirty span map, encoding whole lines\n");
+            }
+        }
+        if (pool->dirty.spans) {
+            c21_find_dirty_frame(context, frame, reference, &pool->dirty);
+        }
+    }
+
+    // Equal contiguous ranges to start with, stealing evens them out
+    for (int t = 0; t < pool->num_threads; t++) {
+        PoolWorker* worker = &pool->workers[t];
+        atomic_store_explicit(&worker->next, (int)((long)batches * t / pool->num_threads),
+                              memory_order_relaxed);
+        worker->end = (int)((long)batches * (t + 1) / pool->num_threads);
+        worker->bytes_compressed = 0;
+        worker->compressible_size = 0;
+        worker->encode_time_us = 0.0;
+        worker->batches_stolen = 0;
+        worker->dirty_pixels = 0;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->active = pool->num_threads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    while (pool->active > 0) {
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        for (int t = 0; t < pool->num_threads; t++) {
+            stats->bytes_compressed += pool->workers[t].bytes_compressed;
+            stats->compressible_size += pool->workers[t].compressible_size;
+            stats->encode_time_us += pool->workers[t].encode_time_us;
+            stats->batches_stolen += pool->workers[t].batches_stolen;
+            stats->dirty_pixels += pool->workers[t].dirty_pixels;
+        }
+        if (!source) {
+            stats->dirty_pixels = pool->dirty.spans ? pool->dirty.dirty_pixels
+                                                    : (size_t)context->width * context->height;
+        }
+        stats->heap_calls = heap_calls;
+    }
+}
+
+void c21_encode_frame_parallel(c21_pool* pool, const c21_context* context, const Vector3D* frame,
+                               const Vector3D* reference, Vector3D* reconstructed, c21_line* lines,
+                               c21_encode_stats* stats) {
+    encode_parallel(pool, context, frame, NULL, reference, reconstructed, lines, stats);
+}
+
+void c21_encode_source_parallel(c21_pool* pool, const c21_context* context, const c21_source* source,
+                                const Vector3D* reference, Vector3D* reconstructed, c21_line* lines,
+                                c21_encode_stats* stats) {
+    encode_parallel(pool, context, NULL, source, reference, reconstructed, lines, stats);
+}
+
+// Segment waiting for a decoder worker
+typedef struct {
+    int line;
+    int x;
+    uint8_t* buffer;       // Receive buffer the segment is in
+    const uint8_t* data;
+    size_t size;
+} DecodeJob;
+
+// The ring of a worker has one producer, the receiving thread, and one
+// consumer, the worker. Each side owns its index and only reads the other,
+// so queueing a segment takes no lock. The producer takes the mutex only to
+// wake a worker that went to sleep on an empty ring.
+typedef struct {
+    _Alignas(64) atomic_uint tail;  // Next slot the receiving thread fills
+    size_t queued;                  // Counters of the receiving thread
+    size_t overruns;
+    atomic_bool waiting;            // The receiving thread waits for room in the ring
+    size_t occupancy_sum;
+    unsigned occupancy_peak;
+    _Alignas(64) atomic_uint head;  // Next slot the worker decodes
+    atomic_bool sleeping;
+    atomic_bool stopping;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    pthread_cond_t room;
+    DecodeJob* jobs;
+    unsigned mask;                  // Ring size minus one, the size is a power of two
+    c21_decode_pool* pool;
+    size_t pixels_decoded;
+} DecodeWorker;
+
+struct c21_decode_pool {
+    int num_threads;
+    pthread_t* threads;
+    DecodeWorker* workers;
+
+    Vector3D* output;
+    const Vector3D* reference;
+    const c21_context* context;
+    c21_surface* surface;
+
+    // Receive buffers not holding a queued segment
+    uint8_t* buffers;
+    size_t buffer_size;
+    int buffer_count;
+    uint8_t** free_buffers;
+    int free_count;
+    size_t buffer_waits;
+    atomic_int* holds;     // Holders of every buffer, the receiving thread and queued segments
+    pthread_mutex_t free_mutex;
+    pthread_cond_t buffer_freed;
+
+    // Segments submitted and not yet decoded
+    atomic_int pending;
+    pthread_mutex_t pending_mutex;
+    pthread_cond_t drained;
+};
+
+static void* decode_worker(void* arg) {
+    DecodeWorker* worker = (DecodeWorker*)arg;
+    c21_decode_pool* pool = worker->pool;
+
+    for (;;) {
+        unsigned head = atomic_load_explicit(&worker->head, memory_order_relaxed);
+        if (head == atomic_load_explicit(&worker->tail, memory_order_acquire)) {
+            // Sleep until the receiving thread queues a segment. It checks the
+            // flag after publishing the segment, and the worker checks the ring
+            // after raising the flag, so one of them sees the other.
+            pthread_mutex_lock(&worker->mutex);
+            atomic_store(&worker->sleeping, true);
+            while (atomic_load(&worker->tail) == head && !atomic_load(&worker->stopping)) {
+                pthread_cond_wait(&worker->ready, &worker->mutex);
+            }
+            atomic_store(&worker->sleeping, false);
+            bool stopped = atomic_load(&worker->tail) == head;
+            pthread_mutex_unlock(&worker->mutex);
+            if (stopped) {
+                return NULL;
+            }
+            continue;
+        }
+        DecodeJob job = worker->jobs[head & worker->mask];
+        atomic_store(&worker->head, head + 1);
+        // Same handshake as sleeping, the other way around
+        if (atomic_load(&worker->waiting)) {
+            pthread_mutex_lock(&worker->mutex);
+            pthread_cond_signal(&worker->room);
+            pthread_mutex_unlock(&worker->mutex);
+        }
+
+        size_t start_pos = (size_t)job.line * pool->context->stride + job.x;
+        worker->pixels_decoded += decode_blocks_surface(pool->context, job.data, job.size,
+                                                        &pool->output[start_pos], &pool->reference[start_pos],
+                                                        pool->surface, start_pos);
+
+        c21_decode_pool_release(pool, job.buffer);
+        if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+            pthread_mutex_lock(&pool->pending_mutex);
+            pthread_cond_broadcast(&pool->drained);
+            pthread_mutex_unlock(&pool->pending_mutex);
+        }
+    }
+}
+
+c21_decode_pool* c21_decode_pool_create(int num_threads, const c21_context* context,
+                                        Vector3D* output, const Vector3D* reference,
+                                        size_t buffer_size, int buffer_count) {
+    if (num_threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (cores > 0) ? (int)cores : 1;
+    }
+
+    c21_decode_pool* pool = calloc(1, sizeof(c21_decode_pool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->output = output;
+    pool->reference = reference;
+    pool->context = context;
+    pool->buffer_size = buffer_size;
+    pool->buffer_count = buffer_count;
+    pool->buffers = malloc(buffer_size * buffer_count);
+    pool->free_buffers = malloc(buffer_count * sizeof(uint8_t*));
+    pool->holds = calloc(buffer_count, sizeof(atomic_int));
+    pool->threads = calloc(num_threads, sizeof(pthread_t));
+    if (!pool->buffers || !pool->free_buffers || !pool->holds || !pool->threads ||
+        posix_memalign((void**)&pool->workers, 64, num_threads * sizeof(DecodeWorker)) != 0) {
+        free(pool->buffers);
+        free(pool->free_buffers);
+        free(pool->holds);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    memset(pool->workers, 0, num_threads * sizeof(DecodeWorker));
+    for (int b = 0; b < buffer_count; b++) {
+        pool->free_buffers[b] = &pool->buffers[b * buffer_size];
+    }
+    pool->free_count = buffer_count;
+    pthread_mutex_init(&pool->free_mutex, NULL);
+    pthread_cond_init(&pool->buffer_freed, NULL);
+    pthread_mutex_init(&pool->pending_mutex, NULL);
+    pthread_cond_init(&pool->drained, NULL);
+
+    // A datagram may carry several segments, so a ring holds a few per buffer
+    unsigned ring_size = 1;
+    while (ring_size < (unsigned)buffer_count * C21_DECODE_RING_SEGMENTS) {
+        ring_size <<= 1;
+    }
+    for (int t = 0; t < num_threads; t++) {
+        DecodeWorker* worker = &pool->workers[t];
+        worker->pool = pool;
+        worker->jobs = malloc(ring_size * sizeof(DecodeJob));
+        worker->mask = ring_size - 1;
+        pthread_mutex_init(&worker->mutex, NULL);
+        pthread_cond_init(&worker->ready, NULL);
+        pthread_cond_init(&worker->room, NULL);
+        if (!worker->jobs ||
+            pthread_create(&pool->threads[t], NULL, decode_worker, worker) != 0) {
+            fprintf(stderr, "Failed to create decode thread %d\n", t);
+            free(worker->jobs);
+            pthread_mutex_destroy(&worker->mutex);
+            pthread_cond_destroy(&worker->ready);
+            pthread_cond_destroy(&worker->room);
+            break;
+        }
+        pool->num_threads++;
+    }
+    if (pool->num_threads == 0) {
+        c21_decode_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void c21_decode_pool_destroy(c21_decode_pool* pool) {
+    if (!pool) {
+        return;
+    }
+    c21_decode_pool_barrier(pool);
+    for (int t = 0; t < pool->num_threads; t++) {
+        DecodeWorker* worker = &pool->workers[t];
+        pthread_mutex_lock(&worker->mutex);
+        atomic_store(&worker->stopping, true);
+        pthread_cond_signal(&worker->ready);
+        pthread_mutex_unlock(&worker->mutex);
+    }
+    for (int t = 0; t < pool->num_threads; t++) {
+        DecodeWorker* worker = &pool->workers[t];
+        pthread_join(pool->threads[t], NULL);
+        pthread_mutex_destroy(&worker->mutex);
+        pthread_cond_destroy(&worker->ready);
+        pthread_cond_destroy(&worker->room);
+        free(worker->jobs);
+    }
+    pthread_mutex_destroy(&pool->free_mutex);
+    pthread_cond_destroy(&pool->buffer_freed);
+    pthread_mutex_destroy(&pool->pending_mutex);
+    pthread_cond_destroy(&pool->drained);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool->free_buffers);
+    free(pool->holds);
+    free(pool->buffers);
+    free(pool);
+}
+
+uint8_t* c21_decode_pool_buffer(c21_decode_pool* pool) {
+    pthread_mutex_lock(&pool->free_mutex);
+    if (pool->free_count == 0) {
+        pool->buffer_waits++;
+    }
+    while (pool->free_count == 0) {
+        pthread_cond_wait(&pool->buffer_freed, &pool->free_mutex);
+    }
+    uint8_t* buffer = pool->free_buffers[--pool->free_count];
+    atomic_store(&pool->holds[(buffer - pool->buffers) / pool->buffer_size], 1);
+    pthread_mutex_unlock(&pool->free_mutex);
+    return buffer;
+}
+
+size_t c21_decode_pool_buffer_size(const c21_decode_pool* pool) {
+    return pool->buffer_size;
+}
+
+void c21_decode_pool_set_surface(c21_decode_pool* pool, c21_surface* surface) {
+    pool->surface = surface;
+}
+
+void c21_decode_pool_release(c21_decode_pool* pool, uint8_t* buffer) {
+    // Only the last holder touches the free list
+    if (atomic_fetch_sub(&pool->holds[(buffer - pool->buffers) / pool->buffer_size], 1) == 1) {
+        pthread_mutex_lock(&pool->free_mutex);
+        pool->free_buffers[pool->free_count++] = buffer;
+        pthread_cond_signal(&pool->buffer_freed);
+        pthread_mutex_unlock(&pool->free_mutex);
+    }
+}
+
+void c21_decode_pool_submit(c21_decode_pool* pool, int line, int x, uint8_t* buffer,
+                            const uint8_t* data, size_t size) {
+    // Bands of lines stay on one worker
+    DecodeWorker* worker = &pool->workers[(line / C21_POOL_BATCH_LINES) % pool->num_threads];
+    unsigned tail = atomic_load_explicit(&worker->tail, memory_order_relaxed);
+    unsigned occupancy = tail - atomic_load_explicit(&worker->head, memory_order_acquire);
+    // A full ring holds the receiving thread back like a full buffer list.
+    // Dropping the segment would lose a datagram counted as received.
+    if (occupancy > worker->mask) {
+        worker->overruns++;
+        pthread_mutex_lock(&worker->mutex);
+        atomic_store(&worker->waiting, true);
+        while (tail - atomic_load(&worker->head) > worker->mask) {
+            pthread_cond_wait(&worker->room, &worker->mutex);
+        }
+        atomic_store(&worker->waiting, false);
+        pthread_mutex_unlock(&worker->mutex);
+        occupancy = tail - atomic_load_explicit(&worker->head, memory_order_acquire);
+    }
+    worker->queued++;
+    worker->occupancy_sum += occupancy;
+    if (occupancy > worker->occupancy_peak) {
+        worker->occupancy_peak = occupancy;
+    }
+
+    atomic_fetch_add_explicit(&pool->holds[(buffer - pool->buffers) / pool->buffer_size], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add(&pool->pending, 1);
+    worker->jobs[tail & worker->mask] = (DecodeJob){line, x, buffer, data, size};
+    atomic_store(&worker->tail, tail + 1);
+    if (atomic_load(&worker->sleeping)) {
+        pthread_mutex_lock(&worker->mutex);
+        pthread_cond_signal(&worker->ready);
+        pthread_mutex_unlock(&worker->mutex);
+    }
+}
+
+size_t c21_decode_pool_barrier(c21_decode_pool* pool) {
+    pthread_mutex_lock(&pool->pending_mutex);
+    while (atomic_load(&pool->pending) > 0) {
+        pthread_cond_wait(&pool->drained, &pool->pending_mutex);
+    }
+    pthread_mutex_unlock(&pool->pending_mutex);
+
+    size_t pixels = 0;
+    for (int t = 0; t < pool->num_threads; t++) {
+        pixels += pool->workers[t].pixels_decoded;
+        pool->workers[t].pixels_decoded = 0;
+    }
+    return pixels;
+}
+
+void c21_decode_pool_ring_stats(c21_decode_pool* pool, c21_decode_ring_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    size_t occupancy_sum = 0;
+    for (int t = 0; t < pool->num_threads; t++) {
+        DecodeWorker* worker = &pool->workers[t];
+        stats->segments += worker->queued;
+        stats->overruns += worker->overruns;
+        occupancy_sum += worker->occupancy_sum;
+        if (worker->occupancy_peak > stats->occupancy_peak) {
+            stats->occupancy_peak = worker->occupancy_peak;
+        }
+        worker->queued = worker->overruns = worker->occupancy_sum = 0;
+        worker->occupancy_peak = 0;
+    }
+    stats->occupancy_mean = stats->segments ? (double)occupancy_sum / stats->segments : 0.0;
+    pthread_mutex_lock(&pool->free_mutex);
+    stats->buffer_waits = pool->buffer_waits;
+    pool->buffer_waits = 0;
+    pthread_mutex_unlock(&pool->free_mutex);
+}
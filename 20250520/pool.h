@@ -0,0 +1,108 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "codec21.h"
+#include "source.h"
+
+// Lines handed out to a worker at once
+#define C21_POOL_BATCH_LINES 8
+
+typedef struct c21_pool c21_pool;
+
+// Compressed output of one line, the caller provides the buffer
+typedef struct {
+    uint8_t* data;
+    size_t capacity;
+    size_t size;
+} c21_line;
+
+// Statistics of one frame, merged from the workers after the frame
+typedef struct {
+    size_t bytes_compressed;
+    size_t compressible_size;
+    double encode_time_us;   // Processor time summed over the workers
+    int batches_stolen;      // Batches taken from another worker's range
+    size_t dirty_pixels;     // Pixels in the changed spans that were encoded
+    size_t heap_calls;       // Allocator calls of the frame, none once the resolution settles
+} c21_encode_stats;
+
+// Starts num_threads persistent workers, or one per online core if zero
+c21_pool* c21_pool_create(int num_threads);
+void c21_pool_destroy(c21_pool* pool);
+int c21_pool_size(const c21_pool* pool);
+// Has the workers write the changed pixels they reconstruct to surface as
+// well, NULL to stop. Takes effect with the next frame.
+void c21_pool_set_surface(c21_pool* pool, c21_surface* surface);
+
+// Encodes every line of frame against reference into lines[line], writing
+// what the decoder will produce to reconstructed unless it is NULL.
+// Frame buffers are laid out by the context resolution and stride.
+// Reconstructed may be the reference to update it in place.
+// Returns when all lines are done. Stats may be NULL.
+void c21_encode_frame_parallel(c21_pool* pool, const c21_context* context, const Vector3D* frame,
+                               const Vector3D* reference, Vector3D* reconstructed, c21_line* lines,
+                               c21_encode_stats* stats);
+
+// Same as c21_encode_frame_parallel for a frame in the pixel format of its
+// producer, read line by line without a converted copy of the frame
+void c21_encode_source_parallel(c21_pool* pool, const c21_context* context, const c21_source* source,
+                                const Vector3D* reference, Vector3D* reconstructed, c21_line* lines,
+                                c21_encode_stats* stats);
+
+// Decoder workers for received segments.
+// Segments are dispatched by band of lines, so one worker owns every line of
+// a band and writes a region of the frame no other worker touches.
+typedef struct c21_decode_pool c21_decode_pool;
+
+// Segments a worker ring holds per receive buffer, rounded up to a power of two
+#define C21_DECODE_RING_SEGMENTS 4
+
+// Traffic of the rings between the receiving thread and the decoder workers
+typedef struct {
+    size_t segments;          // Segments queued
+    size_t overruns;          // Segments that waited because the ring of their worker was full
+    size_t buffer_waits;      // Times the receiving thread waited for a free buffer
+    unsigned occupancy_peak;  // Most segments waiting in one ring
+    double occupancy_mean;    // Segments waiting in the ring each segment joined
+} c21_decode_ring_stats;
+
+// Starts num_threads decoder workers (one per online core if zero) decoding
+// into output against reference, both laid out by the context. Output may be
+// the reference to decode in place. The context must outlive the pool.
+// Received datagrams live in buffer_count buffers of buffer_size bytes each.
+c21_decode_pool* c21_decode_pool_create(int num_threads, const c21_context* context,
+                                        Vector3D* output, const Vector3D* reference,
+                                        size_t buffer_size, int buffer_count);
+void c21_decode_pool_destroy(c21_decode_pool* pool);
+
+// Takes a free receive buffer, waiting for the workers if all are queued.
+// The calling thread holds it until it releases it.
+uint8_t* c21_decode_pool_buffer(c21_decode_pool* pool);
+size_t c21_decode_pool_buffer_size(const c21_decode_pool* pool);
+// Has the workers write every decoded block that is not a skip to surface as
+// well, NULL to stop. Set it while no segments are queued.
+void c21_decode_pool_set_surface(c21_decode_pool* pool, c21_surface* surface);
+// Drops the hold of the calling thread on a buffer. It goes back to the free
+// list once every segment submitted from it is decoded as well.
+void c21_decode_pool_release(c21_decode_pool* pool, uint8_t* buffer);
+// Queues the size bytes at data, a segment inside buffer, for the pixels
+// starting at line, x. A buffer may carry several segments. Only one thread
+// submits. Waits for the worker if its ring is full, a segment is never dropped.
+void c21_decode_pool_submit(c21_decode_pool* pool, int line, int x, uint8_t* buffer,
+                            const uint8_t* data, size_t size);
+// Waits until every submitted segment is decoded, returns the pixels decoded
+// since the previous barrier
+size_t c21_decode_pool_barrier(c21_decode_pool* pool);
+// Collects the ring counters since the previous call, on the submitting thread
+void c21_decode_pool_ring_stats(c21_decode_pool* pool, c21_decode_ring_stats* stats);
+
+#endif
@@ -8,7 +8,8 @@
 // Disclaimer: Patent rights reserved regardless of the license above
 
 /*
-gcc -o receiver.out receiver.c codec21.c display.c -lX11 -lImlib2 && ./receiver.out
+gcc -o receiver.out receiver.c codec21.c decoder.c pool.c source.c transport.c fec.c nack.c udp.c display.c -lX11 -lXext -lImlib2 -lpthread && ./receiver.out
+gcc -DC21_WITH_IO_URING -o receiver.out receiver.c codec21.c decoder.c pool.c source.c transport.c fec.c nack.c udp.c uring.c display.c -lX11 -lXext -lImlib2 -lpthread && ./receiver.out
 */
 
 #include <stdio.h>
@@ -20,25 +21,190 @@ gcc -o receiver.out receiver.c codec21.c display.c -lX11 -lImlib2 && ./receiver.
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "codec21.h"
+#include "pool.h"
 #include "display.h"
+#include "transport.h"
+#include "fec.h"
+#include "nack.h"
+#include "udp.h"
+#if defined(C21_WITH_IO_URING)
+#include "uring.h"
+#endif
 
 #define UDP_PORT 14721
 #define MAX_PACKET_SIZE 65536  // Maximum UDP packet size
+#define RECEIVE_BUFFERS 64     // Packets queued for the decoder threads at most
 
 int running = 1;
+c21_context context;  // Resolution of the stream
+int offload = 1;      // UDP_GRO where the kernel has it, C21_OFFLOAD=0 in the environment turns it off
+int nack = 1;         // Asking for lost datagrams again, C21_NACK=0 turns it off
 
+// Frame being received, datagrams of any order update it
 typedef struct {
+    c21_decode_pool* decode_pool;
+    uint32_t frame;          // Sequence number of the frame being decoded
+    int started;             // Whether any frame arrived yet
+    int presented;           // Whether the end of the current frame was handled
+    int packets_received;
     int segments_received;
-    int total_segments;
-    Vector3D* reference_frame;
-    Vector3D* reference_frame_copy;
+    int segments_dropped;
+    int ended;               // Whether the last datagram arrived, packet_count counts the frame then
+    int packet_count;
+    int packets_recovered;   // Datagrams rebuilt from parity
+    int rebuilding;          // Whether the datagram being decoded was rebuilt
+    int parity_seen;         // Whether the sender sends parity
+    c21_fec_decoder fec;     // Latest datagrams, for the parity that follows them
+    c21_nack_tracker nack;   // Datagrams of the frame that arrived
+    int feedback_socket;     // Socket NACKs go out on, -1 if they are off
+    int sender_known;        // Whether a datagram arrived, NACKs wait for it
+    struct sockaddr_in sender_address;  // Where the datagrams come from, NACKs go back there
+    c21_segment segments[C21_MAX_PACKET_SEGMENTS];
 } FrameState;
 
+// Function to ask the sender for datagrams of the current frame again
+void send_nack(FrameState* state, const c21_nack_range* ranges, int count) {
+    if (state->feedback_socket < 0 || !state->sender_known) {
+        return;
+    }
+    uint8_t packet[C21_PACKET_HEADER_SIZE + C21_NACK_MAX_RANGES * C21_NACK_RANGE_SIZE];
+    size_t size = c21_nack_write(packet, sizeof(packet), state->frame, ranges, count);
+    if (size > 0 && sendto(state->feedback_socket, packet, size, 0, (struct sockaddr*)&state->sender_address,
+                           sizeof(state->sender_address)) < 0) {
+        perror("NACK send failed");
+    }
+}
+
+// Function to show the frame once the decoders are done with it
+void present_frame(FrameState* state) {
+    // Whatever parity could not rebuild is asked for again, it decodes late
+    // and shows with the next frame
+    int packets_lost = state->packet_count - state->packets_received;
+    if (packets_lost > 0) {
+        c21_nack_range ranges[C21_NACK_MAX_RANGES];
+        int count = c21_nack_missing(&state->nack, (uint32_t)state->packet_count, ranges, C21_NACK_MAX_RANGES);
+        if (count > 0) {
+            send_nack(state, ranges, count);
+        }
+    }
+    
+    // Late datagrams of this frame still decode, they show with the next one
+    size_t pixels_decoded = c21_decode_pool_barrier(state->decode_pool);
+    printf("Frame %u received: %d segments, %zu pixels decoded, %d datagrams missing, %d rebuilt, "
+           "%zu asked again, %d segments dropped\n", state->frame, state->segments_received, pixels_decoded,
+           packets_lost > 0 ? packets_lost : 0, state->packets_recovered, state->nack.requested,
+           state->segments_dropped);
+    c21_decode_ring_stats ring;
+    c21_decode_pool_ring_stats(state->decode_pool, &ring);
+    printf("  Decoder rings: %.1f segments waiting on average, %u at most, %zu overruns, %zu buffer waits\n",
+           ring.occupancy_mean, ring.occupancy_peak, ring.overruns, ring.buffer_waits);
+    display_damage();
+    state->presented = 1;
+}
+
+// Function to decode the segments of one datagram held in buffer that came
+// from source. Parity datagrams are rebuilt in place, so the packet may change.
+void receive_datagram(FrameState* state, uint8_t* buffer, uint8_t* packet, size_t packet_size,
+                      const struct sockaddr_in* source) {
+    c21_packet_header header;
+    if (!c21_packet_parse_header(packet, packet_size, &header)) {
+        printf("Malformed datagram of %zu bytes, dropping\n", packet_size);
+        return;
+    }
+    
+    // Segments of an older frame would overwrite newer pixels
+    if (state->started && c21_frame_after(state->frame, header.frame)) {
+        printf("Datagram of frame %u arrived after frame %u, dropping\n", header.frame, state->frame);
+        return;
+    }
+    
+    // A group that lost a single datagram gets it back from its parity
+    if (header.flags & C21_FLAG_PARITY) {
+        state->parity_seen = 1;
+        uint32_t first, stride;
+        int members = c21_fec_parity_members(packet, packet_size, &first, &stride);
+        uint8_t* rebuilt;
+        size_t rebuilt_size = c21_fec_recover(&state->fec, packet, packet_size, &rebuilt);
+        if (rebuilt_size > 0) {
+            state->rebuilding = 1;
+            receive_datagram(state, buffer, rebuilt, rebuilt_size, source);
+            state->rebuilding = 0;
+        }
+        // The parity of the last datagram comes last, nothing more can be rebuilt
+        if (members > 0 && header.frame == state->frame && state->ended && !state->presented &&
+            first + (uint32_t)(members - 1) * stride + 1 >= (uint32_t)state->packet_count) {
+            present_frame(state);
+        }
+        return;
+    }
+    // The original of a rebuilt datagram may still arrive late
+    if (!c21_fec_remember(&state->fec, packet, packet_size)) {
+        return;
+    }
+    int segment_count = c21_packet_parse(packet, packet_size, &header, state->segments,
+                                         C21_MAX_PACKET_SEGMENTS);
+    if (segment_count < 0) {
+        printf("Malformed datagram of %zu bytes, dropping\n", packet_size);
+        return;
+    }
+    // The latest sender of valid datagrams gets the NACKs, it may move
+    state->sender_address = *source;
+    state->sender_known = 1;
+    
+    // A newer frame shows what arrived of the previous one if its end was lost
+    if (!state->started || header.frame != state->frame) {
+        if (state->started && !state->presented) {
+            c21_decode_pool_barrier(state->decode_pool);
+            printf("Frame %u ended without its last datagram, %d datagrams received, displaying\n",
+                   state->frame, state->packets_received);
+            display_damage();
+        }
+        state->frame = header.frame;
+        state->started = 1;
+        state->presented = 0;
+        state->packets_received = state->segments_received = state->segments_dropped = 0;
+        state->packets_recovered = 0;
+        state->ended = state->packet_count = 0;
+        c21_nack_begin_frame(&state->nack, header.frame);
+    }
+    state->packets_received++;
+    if (state->rebuilding) {
+        state->packets_recovered++;
+    }
+    // A gap in the datagram numbers is asked for right away, unless parity
+    // following the gap may rebuild it
+    c21_nack_range gap;
+    if (c21_nack_mark(&state->nack, header.packet, &gap) && !state->parity_seen) {
+        send_nack(state, &gap, 1);
+    }
+    
+    // Decode every segment on the thread that owns its line
+    for (int s = 0; s < segment_count; s++) {
+        const c21_segment* segment = &state->segments[s];
+        if (segment->line >= context.height || !c21_segment_fits(segment, context.width)) {
+            state->segments_dropped++;
+            continue;
+        }
+        c21_decode_pool_submit(state->decode_pool, segment->line, segment->x, buffer,
+                               segment->data, segment->size);
+        state->segments_received++;
+    }
+    
+    if (header.flags & C21_FLAG_END_OF_FRAME) {
+        state->ended = 1;
+        state->packet_count = (int)header.packet + 1;
+    }
+    // Datagrams still missing at the end may come back with the parity after it
+    if (state->ended && !state->presented &&
+        (!state->parity_seen || state->packets_received >= state->packet_count)) {
+        present_frame(state);
+    }
+}
+
 void *receive_and_process(void *arg) {
+    (void)arg;
     int sockfd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    uint8_t buffer[MAX_PACKET_SIZE];
+    struct sockaddr_in server_addr;
     
     // Create UDP socket
     if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
@@ -62,127 +228,131 @@ void *receive_and_process(void *arg) {
     
     printf("UDP receiver listening on port %d\n", UDP_PORT);
     
-    // Allocate memory for reference frame and its copy
-    Vector3D* reference_frame = calloc(WIDTH * HEIGHT, sizeof(Vector3D));
-    Vector3D* reference_frame_copy = malloc(WIDTH * HEIGHT * sizeof(Vector3D));
+    // Allocate memory for the reference frame, segments decode into it in place
+    Vector3D* reference_frame = calloc(context.stride * context.height, sizeof(Vector3D));
+    
+    if (!reference_frame) {
+        fprintf(stderr, "Failed to allocate memory for reference frame\n");
+        close(sockfd);
+        running = 0;
+        return NULL;
+    }
     
-    if (!reference_frame || !reference_frame_copy) {
-        fprintf(stderr, "Failed to allocate memory for reference frames\n");
+    // Decoder threads own bands of lines, the socket thread only dispatches
+    c21_decode_pool* decode_pool = c21_decode_pool_create(0, &context, reference_frame, reference_frame,
+                                                          MAX_PACKET_SIZE, RECEIVE_BUFFERS);
+    if (!decode_pool) {
+        fprintf(stderr, "Failed to create decode threads\n");
         free(reference_frame);
-        free(reference_frame_copy);
         close(sockfd);
         running = 0;
         return NULL;
     }
+    // Decoded blocks also go straight to the display, which uploads the changed rows
+    c21_decode_pool_set_surface(decode_pool, display_surface());
     
-    int segments_per_frame = WIDTH * HEIGHT / (WIDTH/4);  // Total segments in a frame
-    int segments_received = 0;
-    size_t total_bytes_decompressed = 0;
+    FrameState state;
+    memset(&state, 0, sizeof(state));
+    state.decode_pool = decode_pool;
+    c21_fec_decoder_init(&state.fec);
+    state.feedback_socket = nack ? sockfd : -1;
     
-    printf("Ready to receive. Each frame consists of %d segments\n", segments_per_frame);
+    // Batches of datagrams land in decode pool buffers, the socket thread keeps
+    // a buffer for every slot of a batch and takes a new one for each slot used
+    c21_udp_receiver receiver;
+#if defined(C21_WITH_IO_URING)
+    // A multishot receive fills buffers registered with the kernel, datagrams
+    // arrive one per buffer so receive offload stays off
+    c21_uring_receiver uring_receiver;
+    int use_uring = c21_uring_receiver_init(&uring_receiver, sockfd, decode_pool);
+    if (use_uring) {
+        printf("Receiving with io_uring\n");
+    } else {
+        fprintf(stderr, "io_uring unavailable, receiving with recvmmsg\n");
+    }
+    c21_udp_receiver_init(&receiver, sockfd, offload && !use_uring);
+#else
+    c21_udp_receiver_init(&receiver, sockfd, offload);
+#endif
+    uint8_t* buffers[C21_RECEIVE_BATCH] = {0};
+    uint8_t* packets[C21_RECEIVE_BATCH];  // Where the datagrams start in the buffers
+    struct sockaddr_in sources[C21_RECEIVE_BATCH];
+    size_t sizes[C21_RECEIVE_BATCH];
+    size_t datagram_sizes[C21_RECEIVE_BATCH];
     
-    int waiting_for_terminator = 1;  // Start by waiting for a terminator
+    printf("Ready to receive%s. Datagrams decode in any order, lost ones only leave their pixels unchanged\n",
+           receiver.offload ? " with receive offload" : "");
     
     while (running) {
-        // Receive a UDP packet
-        int packet_size = recvfrom(sockfd, buffer, MAX_PACKET_SIZE, 0,
-                                  (struct sockaddr*)&client_addr, &client_len);
-        
-        if (packet_size <= 0) {
-            continue;  // Skip empty packets
-        }
-        
-        // Check if this is a terminator packet
-        if (packet_size == 1 && buffer[0] == '\t') {
-            if (!waiting_for_terminator) {
-                // We've reached the end of a frame
-                printf("Frame terminator received (%zu bytes decompressed)\n", total_bytes_decompressed);
-                
-                // Only display the frame if we've received the expected amount of data
-                if (total_bytes_decompressed >= WIDTH * HEIGHT * 3) {
-                    printf("Complete frame received, displaying\n");
-                    // Display the fully decoded frame
-                    display_frame(reference_frame);
-                } else {
-                    printf("Incomplete frame received, discarding (%zu bytes of %d expected)\n", 
-                           total_bytes_decompressed, WIDTH * HEIGHT * 3);
+        int received;
+#if defined(C21_WITH_IO_URING)
+        if (use_uring) {
+            received = c21_uring_receive(&uring_receiver, buffers, packets, sizes, sources, C21_RECEIVE_BATCH);
+            for (int i = 0; i < received; i++) {
+                datagram_sizes[i] = sizes[i];
+            }
+        } else
+#endif
+        {
+            for (int i = 0; i < C21_RECEIVE_BATCH; i++) {
+                if (!buffers[i]) {
+                    buffers[i] = c21_decode_pool_buffer(decode_pool);
                 }
-                
-                // Reset for next frame and wait for next terminator
-                segments_received = 0;
-                waiting_for_terminator = 1;
-            } else {
-                // We received a terminator when already waiting - this means we can start receiving a new frame
-                waiting_for_terminator = 0;
-                
-                // Reset for new frame
-                memcpy(reference_frame_copy, reference_frame, WIDTH * HEIGHT * sizeof(Vector3D));
-                total_bytes_decompressed = 0;
-                segments_received = 0;
             }
-            continue;  // Skip to next packet
-        }
-        
-        // Check if this is a line ending marker
-        if (packet_size == 1 && buffer[0] == '\v') {
-            // Calculate if we're at the end of a line (after 4 chunks)
-            int expected_segment_at_line_end = (segments_received % 4 == 0);
-            
-            if (!expected_segment_at_line_end) {
-                printf("Line ending marker received out of sequence, resetting to wait for new frame\n");
-                // Reset and wait for a new frame
-                segments_received = 0;
-                waiting_for_terminator = 1;
-            } else {
-                printf("Line ending marker received correctly\n");
+            received = c21_udp_receive(&receiver, buffers, MAX_PACKET_SIZE, C21_RECEIVE_BATCH,
+                                       sizes, datagram_sizes, sources);
+            for (int i = 0; i < received; i++) {
+                packets[i] = buffers[i];
             }
-            continue;  // Skip to next packet
         }
-        
-        // If we're waiting for a terminator, ignore all other packets
-        if (waiting_for_terminator) {
+        if (received < 0) {
+            perror("UDP receive failed");
             continue;
         }
         
-        // If this is the first segment of a new frame, make a copy of the reference frame
-        if (segments_received == 0) {
-            memcpy(reference_frame_copy, reference_frame, WIDTH * HEIGHT * sizeof(Vector3D));
-            total_bytes_decompressed = 0;
+        for (int i = 0; i < received; i++) {
+            // Coalesced datagrams share the buffer, it stays held until every segment is decoded
+            for (size_t pos = 0; pos < sizes[i]; pos += datagram_sizes[i]) {
+                size_t size = sizes[i] - pos < datagram_sizes[i] ? sizes[i] - pos : datagram_sizes[i];
+                receive_datagram(&state, buffers[i], &packets[i][pos], size, &sources[i]);
+            }
+            c21_decode_pool_release(decode_pool, buffers[i]);
+            buffers[i] = NULL;
         }
-        
-        // Calculate which segment this is (for debugging)
-        int segment_number = segments_received % segments_per_frame;
-        int line = segment_number / 4;
-        int chunk = segment_number % 4;
-        
-        // Calculate position in the frame
-        int segment_width = WIDTH / 4;
-        int start_pos = line * WIDTH + chunk * segment_width;
-        int current_segment_width = (chunk < 3) ? segment_width : WIDTH - (3 * segment_width);
-        
-        // Decode this segment
-        size_t chunk_decompressed_size = decode_blocks(
-            buffer,
-            packet_size,
-            &reference_frame[start_pos],
-            &reference_frame_copy[start_pos]
-        );
-        
-        total_bytes_decompressed += chunk_decompressed_size * sizeof(Vector3D);
-        segments_received++;
     }
+    for (int i = 0; i < C21_RECEIVE_BATCH; i++) {
+        if (buffers[i]) {
+            c21_decode_pool_release(decode_pool, buffers[i]);
+        }
+    }
+#if defined(C21_WITH_IO_URING)
+    if (use_uring) {
+        c21_uring_receiver_free(&uring_receiver);
+    }
+#endif
     
     // Clean up
+    c21_decode_pool_destroy(decode_pool);
+    c21_fec_decoder_free(&state.fec);
     free(reference_frame);
-    free(reference_frame_copy);
     close(sockfd);
     
     return NULL;
 }
 
 int main() {
+    c21_context_init(&context, C21_DEFAULT_WIDTH, C21_DEFAULT_HEIGHT);
+    const char* offload_setting = getenv("C21_OFFLOAD");
+    if (offload_setting && strcmp(offload_setting, "0") == 0) {
+        offload = 0;
+    }
+    const char* nack_setting = getenv("C21_NACK");
+    if (nack_setting && strcmp(nack_setting, "0") == 0) {
+        nack = 0;
+    }
+    
     // Initialize display
-    if (init_display() == 0) {
+    if (init_display(context.width, context.height) == 0) {
         fprintf(stderr, "Failed to initialize display\n");
         return 1;
     }
@@ -8,7 +8,8 @@
 // Disclaimer: Patent rights reserved regardless of the license above
 
 /*
-gcc -o sender.out sender.c codec21.c -lImlib2 && ./sender.out
+gcc -o sender.out sender.c codec21.c decoder.c arena.c source.c transport.c fec.c nack.c udp.c pool.c -lImlib2 -lpthread && ./sender.out
+gcc -DC21_WITH_IO_URING -o sender.out sender.c codec21.c decoder.c arena.c source.c transport.c fec.c nack.c udp.c uring.c pool.c -lImlib2 -lpthread && ./sender.out
 */
 
 #include <stdio.h>
@@ -19,13 +20,24 @@ gcc -o sender.out sender.c codec21.c -lImlib2 && ./sender.out
 #include <Imlib2.h>
 #include <pthread.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "codec21.h"
+#include "arena.h"
+#include "source.h"
+#include "transport.h"
+#include "udp.h"
+#include "fec.h"
+#include "nack.h"
+#if defined(C21_WITH_IO_URING)
+#include "uring.h"
+#endif
 
 // Increasing it to verify lossless compression quality.
 #define TEST_DELAY 1
 #define UDP_PORT 14721
+#define SEND_BAND_LINES 8  // Lines encoded before their datagrams are submitted with io_uring
 
 typedef struct {
     char *name;
@@ -36,44 +48,132 @@ int running = 1;
 int sockfd;
 struct sockaddr_in server_addr;
 int y_frame_block_index = 0; // Rotating piece index between 0 and 99
+uint32_t frame_number = 0;   // Sequence number of the frame in the datagrams
+size_t mtu = C21_DEFAULT_MTU; // Largest datagram, C21_MTU in the environment overrides it
+int offload = 1;              // UDP_SEGMENT where the kernel has it, C21_OFFLOAD=0 turns it off
+c21_udp_sender udp_sender;    // Datagrams of a frame go out in batches
+c21_fec_encoder fec;          // Parity of groups of datagrams, C21_FEC=N[,interleave] turns it on
+int use_fec = 0;
+int use_nack = 1;             // Sending lost datagrams again, C21_NACK=0 turns it off
+int answering_nacks = 0;      // Whether NACKs come back on sockfd, the receiver answers the datagram source
+c21_retransmit_ring retransmit_ring;  // Latest datagrams, shared with the feedback thread
+pthread_mutex_t retransmit_mutex = PTHREAD_MUTEX_INITIALIZER;
+#if defined(C21_WITH_IO_URING)
+c21_uring_sender uring_sender; // Datagrams of a band go out as linked sends
+int use_uring = 0;             // Whether the kernel took the io_uring setup
+#endif
+c21_context context;         // Resolution and tunables of the stream
 
 int compare(const void *a, const void *b) {
     long long diff = ((ImageFile*)a)->number - ((ImageFile*)b)->number;
     return (diff > 0) - (diff < 0);
 }
 
-// Function to convert Imlib_Image to Vector3D array
-Vector3D* image_to_vector3d(Imlib_Image img, int *size) {
-    int width, height;
+// Function to describe the pixels of an Imlib_Image as an encoder source.
+// Imlib2 keeps native 0xAARRGGBB words, the encoder reads them in place.
+int image_source(Imlib_Image img, c21_source* source) {
     imlib_context_set_image(img);
-    width = imlib_image_get_width();
-    height = imlib_image_get_height();
-    *size = width * height;
-    
-    Vector3D* data = malloc(*size * sizeof(Vector3D));
-    if (!data) {
-        fprintf(stderr, "Memory allocation failed\n");
-        return NULL;
+    if (imlib_image_get_width() != context.width || imlib_image_get_height() != context.height) {
+        return 0;
     }
-    
-    DATA32* pixels = imlib_image_get_data();
-    for (int i = 0; i < *size; i++) {
-        data[i].x = (pixels[i] >> 16) & 0xFF; // Red
-        data[i].y = (pixels[i] >> 8) & 0xFF;  // Green
-        data[i].z = pixels[i] & 0xFF;         // Blue
+    source->base = (const uint8_t*)imlib_image_get_data_for_reading_only();
+    source->stride = (size_t)imlib_image_get_width() * sizeof(DATA32);
+    source->format = C21_FORMAT_ARGB32;
+    return source->base != NULL;
+}
+
+// Function to queue a datagram of the packetizer for the next batch
+void send_packet(const uint8_t* packet, size_t size, void* user) {
+    if (answering_nacks) {
+        pthread_mutex_lock(&retransmit_mutex);
+        c21_retransmit_store(&retransmit_ring, packet, size);
+        pthread_mutex_unlock(&retransmit_mutex);
     }
-    
-    return data;
+#if defined(C21_WITH_IO_URING)
+    if (use_uring) {
+        c21_uring_send(&uring_sender, packet, size);
+        return;
+    }
+#endif
+    c21_udp_send((c21_udp_sender*)user, packet, size);
+}
+
+// Function to send a datagram of the packetizer along with its parity
+void send_protected_packet(const uint8_t* packet, size_t size, void* user) {
+    c21_fec_send((c21_fec_encoder*)user, packet, size);
+}
+
+// Function to send the datagrams queued so far
+void flush_datagrams(void) {
+#if defined(C21_WITH_IO_URING)
+    if (use_uring) {
+        c21_uring_flush(&uring_sender);
+        return;
+    }
+#endif
+    c21_udp_flush(&udp_sender);
+}
+
+// Function to count the system calls that sent datagrams
+size_t send_syscalls(void) {
+#if defined(C21_WITH_IO_URING)
+    if (use_uring) {
+        return uring_sender.ring.syscalls;
+    }
+#endif
+    return udp_sender.syscalls;
 }
 
-// Function to send data over UDP
-void send_udp(uint8_t* data, size_t size) {
-    if (sendto(sockfd, data, size, 0, 
-              (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+// Function to send a datagram asked for again, right away from the feedback thread
+void send_again(const uint8_t* packet, size_t size, void* user) {
+    (void)user;
+    if (sendto(sockfd, packet, size, 0, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("UDP send failed");
     }
 }
 
+// Function to answer the NACKs of the receiver with the datagrams still kept
+void *answer_nacks(void *arg) {
+    (void)arg;
+    uint8_t packet[C21_PACKET_HEADER_SIZE + C21_NACK_MAX_RANGES * C21_NACK_RANGE_SIZE];
+    while (running) {
+        // Times out now and then to see whether the program is stopping
+        ssize_t size = recv(sockfd, packet, sizeof(packet), 0);
+        uint32_t frame;
+        c21_nack_range ranges[C21_NACK_MAX_RANGES];
+        int count = size > 0 ? c21_nack_parse(packet, (size_t)size, &frame, ranges, C21_NACK_MAX_RANGES) : -1;
+        if (count <= 0) {
+            continue;
+        }
+        pthread_mutex_lock(&retransmit_mutex);
+        size_t expired = retransmit_ring.expired;
+        int sent = c21_retransmit(&retransmit_ring, frame, ranges, count, send_again, NULL);
+        expired = retransmit_ring.expired - expired;
+        pthread_mutex_unlock(&retransmit_mutex);
+        printf("Sent %d datagrams of frame %u again, %zu no longer kept\n", sent, frame, expired);
+    }
+    return NULL;
+}
+
+// Function to listen for NACKs on the data socket, returns 0 on failure.
+// The receiver sends them to the address the datagrams came from.
+int start_feedback(pthread_t* thread) {
+    struct timeval timeout = {0, 100000};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (!c21_retransmit_init(&retransmit_ring, C21_RETRANSMIT_DATAGRAMS, mtu)) {
+        fprintf(stderr, "Failed to allocate the retransmit ring\n");
+        return 0;
+    }
+    answering_nacks = 1;
+    if (pthread_create(thread, NULL, answer_nacks, NULL) != 0) {
+        perror("Failed to create feedback thread");
+        answering_nacks = 0;
+        c21_retransmit_free(&retransmit_ring);
+        return 0;
+    }
+    return 1;
+}
+
 // Add this function before process_images
 void y_reset_frame_piece(Vector3D* frame, int width, int height, int piece_index) {
     // Calculate piece boundaries - divide height into 100 equal pieces
@@ -94,6 +194,7 @@ void y_reset_frame_piece(Vector3D* frame, int width, int height, int piece_index
 }
 
 void *process_images(void *arg) {
+    (void)arg;
     DIR *dir;
     struct dirent *entry;
     ImageFile *files = NULL;
@@ -134,15 +235,24 @@ void *process_images(void *arg) {
     qsort(files, file_count, sizeof(ImageFile), compare);
     
     // Allocate memory for reference frame
-    Vector3D* reference_frame = calloc(WIDTH * HEIGHT, sizeof(Vector3D));
+    Vector3D* reference_frame = calloc(context.stride * context.height, sizeof(Vector3D));
     if (!reference_frame) {
         fprintf(stderr, "Failed to allocate memory for reference frame\n");
         return NULL;
     }
     
+    // The compressed chunk and the converted and reconstructed lines live until the next frame.
+    // The arena settles at its largest size, then the loop makes no heap calls.
+    c21_arena frame_arena;
+    if (!c21_arena_init(&frame_arena, context.width * sizeof(Vector3D) * 4 + mtu + C21_ARENA_ALIGN * 4)) {
+        fprintf(stderr, "Failed to allocate the frame arena\n");
+        free(reference_frame);
+        return NULL;
+    }
+    
     // Initialize all 100 pieces of the reference frame
     for (int i = 0; i < 100; i++) {
-        y_reset_frame_piece(reference_frame, WIDTH, HEIGHT, i);
+        y_reset_frame_piece(reference_frame, context.stride, context.height, i);
     }
     
     printf("Starting continuous processing loop. Press Ctrl+C to quit...\n");
@@ -158,12 +268,11 @@ void *process_images(void *arg) {
                 continue;
             }
             
-            int image_size;
-            Vector3D* image_data = image_to_vector3d(img, &image_size);
-            imlib_free_image(); // Free the image after converting to Vector3D
-            
-            if (!image_data) {
-                printf("Failed to convert image %s to vector data, skipping\n", files[i].name);
+            // The encoder reads the pixels of the image, it is freed after its frames
+            c21_source image_data;
+            if (!image_source(img, &image_data)) {
+                printf("Image %s is not %dx%d, skipping\n", files[i].name, context.width, context.height);
+                imlib_free_image();
                 continue;
             }
             
@@ -171,87 +280,106 @@ void *process_images(void *arg) {
             for (int frame = 0; frame < TEST_DELAY && running; frame++) {
                 printf("Processing %s (frame %d of %d)\n", files[i].name, frame + 1, TEST_DELAY);
                 
-                int width = WIDTH;
-                int height = HEIGHT;
+                int width = context.width;
+                int height = context.height;
                 
-                uint8_t* temp_buffer = malloc(width * sizeof(Vector3D) * 2 + 1); // +1 for separator
-                Vector3D* reference_frame_copy = malloc(WIDTH * HEIGHT * sizeof(Vector3D));
+                size_t heap_calls = frame_arena.heap_calls;
+                c21_arena_reset(&frame_arena);
+                uint8_t* blocks = c21_arena_alloc(&frame_arena, width * sizeof(Vector3D) * 2);
+                Vector3D* line_buffer = c21_arena_alloc(&frame_arena, width * sizeof(Vector3D));
+                Vector3D* reconstructed_line = c21_arena_alloc(&frame_arena, width * sizeof(Vector3D));
+                uint8_t* packet = c21_arena_alloc(&frame_arena, mtu);
                 
-                if (temp_buffer && reference_frame_copy) {
+                if (blocks && line_buffer && reconstructed_line && packet) {
                     size_t total_bytes_compressed = 0;
-                    size_t total_bytes_decompressed = 0;
                     size_t total_compressible_size = 0;
                     
-                    // Make a copy of the reference frame at the start of frame processing
-                    memcpy(reference_frame_copy, reference_frame, WIDTH * HEIGHT * sizeof(Vector3D));
-                    
-                    // Clear the current piece in the reference frame copy
-                    y_reset_frame_piece(reference_frame_copy, width, height, y_frame_block_index);
+                    // Clear the current piece in the reference frame, it is encoded in place
+                    y_reset_frame_piece(reference_frame, context.stride, height, y_frame_block_index);
                     
                     // Update the piece index for next frame
                     y_frame_block_index = (y_frame_block_index + 1) % 100;
                     
+                    // Consecutive lines share datagrams, so the packet rate follows the compressed bytes
+                    c21_packetizer packetizer;
+                    if (use_fec) {
+                        // Parity is as long as the longest datagram plus its header
+                        c21_packetizer_init(&packetizer, packet, mtu - C21_FEC_HEADER_SIZE,
+                                            send_protected_packet, &fec);
+                    } else {
+                        c21_packetizer_init(&packetizer, packet, mtu, send_packet, &udp_sender);
+                    }
+                    size_t parity_sent = fec.parity_sent;
+                    c21_packetizer_begin_frame(&packetizer, frame_number++);
+                    size_t send_calls = send_syscalls();
                     for (int line = 0; line < height; line++) {
-                        int segment_width = width / 4; // Width of each segment
+                        total_compressible_size += width * sizeof(Vector3D);
+#if defined(C21_WITH_IO_URING)
+                        // A finished band leaves while the next one is encoded
+                        if (use_uring && line % SEND_BAND_LINES == 0) {
+                            c21_uring_flush(&uring_sender);
+                        }
+#endif
+                        
+                        // Convert the line once and find its changed spans
+                        c21_span spans[C21_MAX_LINE_SPANS];
+                        const Vector3D* input = c21_source_line(&image_data, line, 0, width, line_buffer);
+                        int span_count = find_dirty_spans(input, &reference_frame[line * context.stride],
+                                                          width, spans, C21_MAX_LINE_SPANS);
+                        
+                        // Datagrams say which line they are for, unchanged lines are not sent
+                        if (span_count == 0) {
+                            continue;
+                        }
+                        
+                        // The segment runs from the first to the last change.
+                        // The reference frame gets what the receiver will decode once
+                        // the line is in the datagrams, a line not sent stays as it was.
+                        Vector3D* reference_line = &reference_frame[line * context.stride];
+                        int first = spans[0].start;
+                        int end = spans[span_count - 1].end;
+                        size_t compressed_size = encode_spans_reconstruct(
+                            &context,
+                            input,
+                            reference_line,
+                            first,
+                            end - first,
+                            spans,
+                            span_count,
+                            blocks,
+                            width * sizeof(Vector3D) * 2,
+                            reconstructed_line
+                        );
+                        total_bytes_compressed += compressed_size;
                         
-                        for (int chunk = 0; chunk < 4; chunk++) {
-                            // Calculate the starting position for this chunk
-                            int start_pos = line * width + chunk * segment_width;
-                            int current_segment_width = (chunk < 3) ? segment_width : width - (3 * segment_width);
-                            
-                            // Track the compressible size in bytes
-                            total_compressible_size += current_segment_width * sizeof(Vector3D);
-                            
-                            size_t chunk_compressed_size = encode_block(
-                                &image_data[start_pos],
-                                &reference_frame_copy[start_pos],
-                                current_segment_width,
-                                temp_buffer,
-                                current_segment_width * sizeof(Vector3D) * 2
-                            );
-                            
-                            total_bytes_compressed += chunk_compressed_size;
-                            
-                            // Send the compressed block over UDP
-                            send_udp(temp_buffer, chunk_compressed_size);
-                            
-                            size_t chunk_decompressed_size = decode_blocks(
-                                temp_buffer,
-                                chunk_compressed_size,
-                                &reference_frame[start_pos],
-                                &reference_frame_copy[start_pos]
-                            );
-                            
-                            total_bytes_decompressed += chunk_decompressed_size * sizeof(Vector3D);
-                            
-                            // If this is the last chunk of the line, send a line ending marker
-                            if (chunk == 3) {
-                                uint8_t line_marker = '\v';  // Vertical tab as line ending marker
-                                send_udp(&line_marker, 1);
-                            }
+                        if (!c21_packetizer_add(&packetizer, line, first, blocks, compressed_size)) {
+                            fprintf(stderr, "Line %d has a block larger than a datagram of %zu bytes, not sent\n",
+                                    line, mtu);
+                            continue;
                         }
+                        memcpy(&reference_line[first], &reconstructed_line[first], (end - first) * sizeof(Vector3D));
                     }
                     
-                    // Send a terminating tab character to signal end of frame
-                    uint8_t terminator = '\t';
-                    send_udp(&terminator, 1);
+                    // The last datagram of the frame counts the ones before it
+                    c21_packetizer_end_frame(&packetizer);
+                    flush_datagrams();
                     
                     double compression_ratio = (double)total_compressible_size / (double)total_bytes_compressed;
                     printf("Frame statistics:\n");
                     printf("  Compressed size: %zu bytes\n", total_bytes_compressed);
-                    printf("  Decompressed size: %zu bytes\n", total_bytes_decompressed);
                     printf("  Compressible size: %zu bytes\n", total_compressible_size);
                     printf("  Compression ratio: %.2f:1\n", compression_ratio);
-                    if (total_compressible_size != total_bytes_decompressed) {
-                        exit(1);
+                    printf("  Datagrams: %u of up to %zu bytes, %zu parity\n", packetizer.packet_number, mtu,
+                           fec.parity_sent - parity_sent);
+                    const char* send_method = udp_sender.offload ? " with segmentation offload" : "";
+#if defined(C21_WITH_IO_URING)
+                    if (use_uring) {
+                        send_method = " with io_uring";
                     }
-                    
-                    // Free temporary buffers
-                    free(reference_frame_copy);
-                    free(temp_buffer);
+#endif
+                    printf("  Send calls: %zu%s\n", send_syscalls() - send_calls, send_method);
+                    printf("  Heap calls: %zu\n", frame_arena.heap_calls - heap_calls);
                 } else {
-                    if (temp_buffer) free(temp_buffer);
-                    if (reference_frame_copy) free(reference_frame_copy);
                     fprintf(stderr, "Failed to allocate buffers for encoding\n");
                 }
                 
@@ -259,8 +387,9 @@ void *process_images(void *arg) {
                 usleep(30000); // 30ms delay between frames of the same image
             }
             
-            // Free the image data after all frames are processed
-            free(image_data);
+            // Free the image after all its frames are encoded
+            imlib_context_set_image(img);
+            imlib_free_image();
             
             if (i < file_count - 1) {
                 // Add delay between different images
@@ -278,6 +407,7 @@ void *process_images(void *arg) {
     }
     
     // Clean up
+    c21_arena_free(&frame_arena);
     free(reference_frame);
     for (int i = 0; i < file_count; i++) {
         free(files[i].name);
@@ -287,7 +417,39 @@ void *process_images(void *arg) {
     return NULL;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    c21_context_init(&context, C21_DEFAULT_WIDTH, C21_DEFAULT_HEIGHT);
+    
+    // Optional encoder profile written by the tuner
+    if (argc > 1 && !c21_context_load_profile(&context, argv[1])) {
+        fprintf(stderr, "Failed to load profile %s\n", argv[1]);
+        return 1;
+    }
+    
+    const char* mtu_setting = getenv("C21_MTU");
+    if (mtu_setting) {
+        mtu = (size_t)strtoul(mtu_setting, NULL, 10);
+        if (mtu < C21_PACKET_HEADER_SIZE + C21_SEGMENT_HEADER_SIZE + 64 || mtu > 65507) {
+            fprintf(stderr, "C21_MTU must be between %d and 65507 bytes\n",
+                    C21_PACKET_HEADER_SIZE + C21_SEGMENT_HEADER_SIZE + 64);
+            return 1;
+        }
+    }
+    
+    const char* fec_setting = getenv("C21_FEC");
+    if (fec_setting) {
+        int group_size = 0, interleave = C21_FEC_DEFAULT_INTERLEAVE;
+        if (sscanf(fec_setting, "%d,%d", &group_size, &interleave) < 1 ||
+            !c21_fec_encoder_init(&fec, group_size, interleave, mtu - C21_FEC_HEADER_SIZE, send_packet,
+                                  &udp_sender)) {
+            fprintf(stderr, "C21_FEC must be a group size and an interleave of at most %d datagrams\n",
+                    C21_FEC_CACHE);
+            return 1;
+        }
+        use_fec = 1;
+        printf("Sending a parity datagram every %d datagrams, %d groups interleaved\n", group_size, interleave);
+    }
+    
     // Create UDP socket
     if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("Socket creation failed");
@@ -299,13 +461,44 @@ int main() {
     server_addr.sin_port = htons(UDP_PORT);
     server_addr.sin_addr.s_addr = inet_addr("127.0.0.1"); // Sending to localhost
     
+    const char* offload_setting = getenv("C21_OFFLOAD");
+    if (offload_setting && strcmp(offload_setting, "0") == 0) {
+        offload = 0;
+    }
+    if (!c21_udp_sender_init(&udp_sender, sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr),
+                             mtu, offload)) {
+        fprintf(stderr, "Failed to allocate the send batch\n");
+        close(sockfd);
+        return 1;
+    }
+#if defined(C21_WITH_IO_URING)
+    // The sends of the ring carry no address, the socket has one
+    if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == 0 &&
+        c21_uring_sender_init(&uring_sender, sockfd, mtu)) {
+        use_uring = 1;
+        printf("Sending with io_uring\n");
+    } else {
+        fprintf(stderr, "io_uring unavailable, sending with sendmmsg\n");
+    }
+#endif
+    
     printf("UDP sender initialized, sending to port %d\n", UDP_PORT);
     
+    const char* nack_setting = getenv("C21_NACK");
+    if (nack_setting && strcmp(nack_setting, "0") == 0) {
+        use_nack = 0;
+    }
+    pthread_t feedback_thread;
+    if (use_nack && start_feedback(&feedback_thread)) {
+        printf("Answering NACKs with the last %d datagrams\n", C21_RETRANSMIT_DATAGRAMS);
+    }
+    
     // Create thread for processing images
     pthread_t processing_thread;
     if (pthread_create(&processing_thread, NULL, process_images, NULL) != 0) {
         perror("Failed to create processing thread");
         running = 0;
+        c21_udp_sender_free(&udp_sender);
         close(sockfd);
         return 1;
     }
@@ -316,6 +509,18 @@ int main() {
     pthread_join(processing_thread, NULL);
     
     // Close socket
+    if (answering_nacks) {
+        running = 0;
+        pthread_join(feedback_thread, NULL);
+        c21_retransmit_free(&retransmit_ring);
+    }
+#if defined(C21_WITH_IO_URING)
+    if (use_uring) {
+        c21_uring_sender_free(&uring_sender);
+    }
+#endif
+    c21_udp_sender_free(&udp_sender);
+    c21_fec_encoder_free(&fec);
     close(sockfd);
     printf("Socket closed, program terminating\n");
     
@@ -0,0 +1,90 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+// Encoder input in the pixel format of the producer.
+// The encoder compares and packs Vector3D pixels, so a source line is
+// converted right before it is encoded into a line buffer that stays in the
+// cache. This replaces converting whole frames into a second frame buffer.
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+#include "source.h"
+
+// Function to convert B, G, R, X bytes to R, G, B pixels
+static void convert_bgrx32(const uint8_t* input, size_t length, Vector3D* output) {
+    size_t i = 0;
+#if defined(__SSSE3__)
+    // Four pixels per step, the last four bytes of each store are overwritten
+    // by the next one, so the loop stops while a whole store still fits
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    for (; i + 6 <= length; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)&input[i * 4]);
+        _mm_storeu_si128((__m128i*)&output[i], _mm_shuffle_epi8(pixels, shuffle));
+    }
+#endif
+    for (; i < length; i++) {
+        output[i].x = input[i * 4 + 2];
+        output[i].y = input[i * 4 + 1];
+        output[i].z = input[i * 4];
+    }
+}
+
+// Function to convert native 0xAARRGGBB words to R, G, B pixels
+static void convert_argb32(const uint8_t* input, size_t length, Vector3D* output) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Little endian words are B, G, R, A bytes in memory
+    convert_bgrx32(input, length, output);
+#else
+    for (size_t i = 0; i < length; i++) {
+        uint32_t pixel;
+        memcpy(&pixel, &input[i * 4], sizeof(pixel));
+        output[i].x = (pixel >> 16) & 0xFF;
+        output[i].y = (pixel >> 8) & 0xFF;
+        output[i].z = pixel & 0xFF;
+    }
+#endif
+}
+
+// Function to expand native 5-6-5 words, the top bits repeat into the low bits
+// so white stays white
+static void convert_rgb565(const uint8_t* input, size_t length, Vector3D* output) {
+    for (size_t i = 0; i < length; i++) {
+        uint16_t pixel;
+        memcpy(&pixel, &input[i * 2], sizeof(pixel));
+        uint8_t red = (pixel >> 11) & 0x1F;
+        uint8_t green = (pixel >> 5) & 0x3F;
+        uint8_t blue = pixel & 0x1F;
+        output[i].x = (uint8_t)((red << 3) | (red >> 2));
+        output[i].y = (uint8_t)((green << 2) | (green >> 4));
+        output[i].z = (uint8_t)((blue << 3) | (blue >> 2));
+    }
+}
+
+// Function to read a span of a source line as Vector3D pixels
+const Vector3D* c21_source_line(const c21_source* source, int line, size_t first, size_t length,
+                                Vector3D* buffer) {
+    const uint8_t* row = source->base + (size_t)line * source->stride;
+    switch (source->format) {
+        case C21_FORMAT_RGB24:
+            return (const Vector3D*)(row + first * 3);
+        case C21_FORMAT_ARGB32:
+            convert_argb32(row + first * 4, length, buffer);
+            return buffer;
+        case C21_FORMAT_BGRX32:
+            convert_bgrx32(row + first * 4, length, buffer);
+            return buffer;
+        case C21_FORMAT_RGB565:
+            convert_rgb565(row + first * 2, length, buffer);
+            return buffer;
+    }
+    return NULL;
+}
@@ -0,0 +1,35 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include "codec21.h"
+
+// Pixel layouts of encoder input read straight from capture and image buffers
+typedef enum {
+    C21_FORMAT_RGB24,   // Bytes R, G, B, the Vector3D layout itself
+    C21_FORMAT_ARGB32,  // Native 32-bit words 0xAARRGGBB, as Imlib2, Cairo and X11 hand them out
+    C21_FORMAT_BGRX32,  // Bytes B, G, R, X in memory on any byte order
+    C21_FORMAT_RGB565,  // Native 16-bit words, red in the top 5 bits
+} c21_pixel_format;
+
+// A frame in the layout of its producer
+typedef struct {
+    const uint8_t* base;       // First pixel of the first line
+    size_t stride;             // Bytes from the start of a line to the next
+    c21_pixel_format format;
+} c21_source;
+
+// Returns the pixels [first, first + length) of a source line as Vector3D.
+// They are converted into buffer, RGB24 lines are returned in place.
+const Vector3D* c21_source_line(const c21_source* source, int line, size_t first, size_t length,
+                                Vector3D* buffer);
+
+#endif
@@ -8,7 +8,7 @@
 // Disclaimer: Patent rights reserved regardless of the license above
 
 /*
-gcc -o a.out standalone.c codec21.c display.c -lX11 -lImlib2 && ./a.out
+gcc -o a.out standalone.c codec21.c decoder.c pool.c arena.c source.c display.c -lX11 -lXext -lImlib2 -lpthread && ./a.out
 */
 
 #include <stdio.h>
@@ -23,6 +23,8 @@ gcc -o a.out standalone.c codec21.c display.c -lX11 -lImlib2 && ./a.out
 #include <stdarg.h>
 #include <errno.h>  // Add this line for errno
 #include "codec21.h"
+#include "pool.h"
+#include "arena.h"
 #include "display.h"
 
 // Increasing it to verify lossless compression quality.
@@ -82,120 +84,33 @@ typedef struct {
 } ImageFile;
 
 int running = 1;
+c21_context context;  // Resolution and tunables of the stream
 
 // Add this global variable to track when the last frame was displayed
 struct timeval last_display_time;
 
-// Add a structure to store compressed data for each line
-typedef struct {
-    uint8_t* data;    // Compressed data for this line
-    size_t size;      // Size of the compressed data
-    int line_number;  // Original line number for reference
-} CompressedLine;
-
-// Thread worker structure for encoding
-typedef struct {
-    Vector3D* image_data;
-    Vector3D* reference_frame_copy;
-    int width;
-    int height;
-    int start_line;
-    int end_line;
-    CompressedLine* compressed_lines;
-    size_t* total_bytes_compressed;
-    size_t* total_compressible_size;
-    double* frame_encode_time_us;
-    pthread_mutex_t* stats_mutex;  // For thread-safe updates to shared counters
-} EncodeThreadArgs;
-
 // Helper function to calculate elapsed time in microseconds between two timevals
 long long time_diff_us(struct timeval start, struct timeval end) {
     return ((end.tv_sec - start.tv_sec) * 1000000LL) + 
            (end.tv_usec - start.tv_usec);
 }
 
-// Thread worker function for encoding lines
-void* encode_thread_worker(void* arg) {
-    EncodeThreadArgs* args = (EncodeThreadArgs*)arg;
-    size_t thread_bytes_compressed = 0;
-    size_t thread_compressible_size = 0;
-    double thread_encode_time_us = 0.0;
-    
-    for (int line = args->start_line; line < args->end_line; line++) {
-        // Calculate the starting position for this line
-        int start_pos = line * args->width;
-        
-        // Track the compressible size in bytes
-        thread_compressible_size += args->width * sizeof(Vector3D);
-        
-        // Allocate buffer for this line's compressed data
-        uint8_t* temp_buffer = malloc(args->width * sizeof(Vector3D) * 2 + 1);
-        if (!temp_buffer) {
-            log_message(LOG_ERROR, "Failed to allocate buffer for line %d\n", line);
-            continue;
-        }
-        
-        // Compress this line
-        struct timeval encode_start, encode_end;
-        gettimeofday(&encode_start, NULL);
-        
-        size_t line_compressed_size = encode_block(
-            &args->image_data[start_pos],
-            &args->reference_frame_copy[start_pos],
-            args->width,
-            temp_buffer,
-            args->width * sizeof(Vector3D) * 2
-        );
-        
-        gettimeofday(&encode_end, NULL);
-        long long encode_elapsed_us = time_diff_us(encode_start, encode_end);
-        thread_encode_time_us += encode_elapsed_us;
-        
-        // Store the compressed data for later decoding
-        args->compressed_lines[line].data = temp_buffer;
-        args->compressed_lines[line].size = line_compressed_size;
-        args->compressed_lines[line].line_number = line;
-        
-        thread_bytes_compressed += line_compressed_size;
-    }
-    
-    // Update shared statistics with mutex protection
-    pthread_mutex_lock(args->stats_mutex);
-    *args->total_bytes_compressed += thread_bytes_compressed;
-    *args->total_compressible_size += thread_compressible_size;
-    *args->frame_encode_time_us += thread_encode_time_us;
-    pthread_mutex_unlock(args->stats_mutex);
-    
-    return NULL;
-}
-
 int compare(const void *a, const void *b) {
     long long diff = ((ImageFile*)a)->number - ((ImageFile*)b)->number;
     return (diff > 0) - (diff < 0);
 }
 
-// Function to convert Imlib_Image to Vector3D array
-Vector3D* image_to_vector3d(Imlib_Image img, int *size) {
-    int width, height;
+// Function to describe the pixels of an Imlib_Image as an encoder source.
+// Imlib2 keeps native 0xAARRGGBB words, the encoder reads them in place.
+int image_source(Imlib_Image img, c21_source* source) {
     imlib_context_set_image(img);
-    width = imlib_image_get_width();
-    height = imlib_image_get_height();
-    *size = width * height;
-    
-    Vector3D* data = malloc(*size * sizeof(Vector3D));
-    if (!data) {
-        log_message(LOG_ERROR, "Memory allocation failed\n");
-        return NULL;
-    }
-    
-    DATA32* pixels = imlib_image_get_data();
-    for (int i = 0; i < *size; i++) {
-        data[i].x = (pixels[i] >> 16) & 0xFF; // Red
-        data[i].y = (pixels[i] >> 8) & 0xFF;  // Green
-        data[i].z = pixels[i] & 0xFF;         // Blue
+    if (imlib_image_get_width() != context.width || imlib_image_get_height() != context.height) {
+        return 0;
     }
-    
-    return data;
+    source->base = (const uint8_t*)imlib_image_get_data_for_reading_only();
+    source->stride = (size_t)imlib_image_get_width() * sizeof(DATA32);
+    source->format = C21_FORMAT_ARGB32;
+    return source->base != NULL;
 }
 
 // Helper function to calculate elapsed time in milliseconds between two timevals
@@ -249,12 +164,33 @@ void *process_images(void *arg) {
     qsort(files, file_count, sizeof(ImageFile), compare);
     
     // Allocate memory for reference frame
-    Vector3D* reference_frame = calloc(WIDTH * HEIGHT, sizeof(Vector3D));
+    Vector3D* reference_frame = calloc(context.stride * context.height, sizeof(Vector3D));
     if (!reference_frame) {
         log_message(LOG_ERROR, "Failed to allocate memory for reference frame\n");
         return NULL;
     }
     
+    // Start the encoder workers once, one per core
+    c21_pool* encode_pool = c21_pool_create(0);
+    if (!encode_pool) {
+        log_message(LOG_ERROR, "Failed to create encoder pool\n");
+        free(reference_frame);
+        return NULL;
+    }
+    // Workers write the changed pixels they reconstruct to the display as well
+    c21_pool_set_surface(encode_pool, display_surface());
+    
+    // Line buffers live until the next frame. The arena settles at its largest
+    // size, then the loop makes no heap calls.
+    c21_arena frame_arena;
+    size_t line_capacity = context.width * sizeof(Vector3D) * 2;
+    if (!c21_arena_init(&frame_arena, context.height * (sizeof(c21_line) + line_capacity + C21_ARENA_ALIGN))) {
+        log_message(LOG_ERROR, "Failed to allocate the frame arena\n");
+        c21_pool_destroy(encode_pool);
+        free(reference_frame);
+        return NULL;
+    }
+    
     log_message(LOG_INFO, "Starting continuous processing loop. Press Ctrl+C to quit...\n");
 
     while (running) {
@@ -267,141 +203,79 @@ void *process_images(void *arg) {
                 continue;
             }
             
-            int image_size;
-            Vector3D* image_data = image_to_vector3d(img, &image_size);
-            imlib_free_image(); // Free the image after converting to Vector3D
-            
-            if (!image_data) {
-                log_message(LOG_WARNING, "Failed to convert image %s to vector data, skipping\n", files[i].name);
+            // The encoder reads the pixels of the image, it is freed after its frames
+            c21_source image_data;
+            if (!image_source(img, &image_data)) {
+                log_message(LOG_WARNING, "Image %s is not %dx%d, skipping\n", files[i].name,
+                            context.width, context.height);
+                imlib_free_image();
                 continue;
             }
             
             // Process the same image for 8 frames
             for (int frame = 0; frame < TEST_DELAY && running; frame++) {
                 
-                int width = WIDTH;
-                int height = HEIGHT;
+                int width = context.width;
+                int height = context.height;
                 
-                // Allocate array to store compressed data for each line
-                CompressedLine* compressed_lines = malloc(height * sizeof(CompressedLine));
-                Vector3D* reference_frame_copy = malloc(WIDTH * HEIGHT * sizeof(Vector3D));
+                // Take the compressed line buffers of this frame from the arena
+                size_t heap_calls = frame_arena.heap_calls;
+                c21_arena_reset(&frame_arena);
+                c21_line* compressed_lines = c21_arena_calloc(&frame_arena, height, sizeof(c21_line));
                 
-                if (compressed_lines && reference_frame_copy) {
+                if (compressed_lines) {
                     size_t total_bytes_compressed = 0;
-                    size_t total_bytes_decompressed = 0;
                     size_t total_compressible_size = 0;
                     
                     // Reset timing statistics for this frame
                     double frame_encode_time_us = 0.0;
-                    double frame_decode_time_us = 0.0;
-                    
-                    // Make a copy of the reference frame at the start of frame processing
-                    memcpy(reference_frame_copy, reference_frame, WIDTH * HEIGHT * sizeof(Vector3D));
                     
-                    // ENCODING PHASE: Encode all lines using threads
-                    struct timeval encode_start_total, encode_end_total;
-                    gettimeofday(&encode_start_total, NULL);
-                    
-                    // Create mutex for thread-safe updates to shared statistics
-                    pthread_mutex_t stats_mutex;
-                    pthread_mutex_init(&stats_mutex, NULL);
-                    
-                    // Prepare thread arguments and threads
-                    const int num_threads = 20;
-                    pthread_t encode_threads[num_threads];
-                    EncodeThreadArgs thread_args[num_threads];
-                    int lines_per_thread = height / num_threads;
-                    
-                    for (int t = 0; t < num_threads; t++) {
-                        thread_args[t].image_data = image_data;
-                        thread_args[t].reference_frame_copy = reference_frame_copy;
-                        thread_args[t].width = width;
-                        thread_args[t].height = height;
-                        thread_args[t].start_line = t * lines_per_thread;
-                        thread_args[t].end_line = (t == num_threads - 1) ? height : (t + 1) * lines_per_thread;
-                        thread_args[t].compressed_lines = compressed_lines;
-                        thread_args[t].total_bytes_compressed = &total_bytes_compressed;
-                        thread_args[t].total_compressible_size = &total_compressible_size;
-                        thread_args[t].frame_encode_time_us = &frame_encode_time_us;
-                        thread_args[t].stats_mutex = &stats_mutex;
-                        
-                        if (pthread_create(&encode_threads[t], NULL, encode_thread_worker, &thread_args[t]) != 0) {
-                            log_message(LOG_ERROR, "Failed to create encode thread %d\n", t);
-                            // Fall back to single-threaded encoding for this section
-                            encode_thread_worker(&thread_args[t]);
+                    // Allocate buffer for each line's compressed data
+                    for (int line = 0; line < height; line++) {
+                        compressed_lines[line].capacity = line_capacity;
+                        compressed_lines[line].data = c21_arena_alloc(&frame_arena, line_capacity + 1);
+                        if (!compressed_lines[line].data) {
+                            log_message(LOG_ERROR, "Failed to allocate buffer for line %d\n", line);
+                            compressed_lines[line].capacity = 0;
                         }
                     }
                     
-                    // Wait for all encoding threads to complete
-                    for (int t = 0; t < num_threads; t++) {
-                        pthread_join(encode_threads[t], NULL);
-                    }
+                    // Encode all lines on the worker pool, the workers also write
+                    // what the decoder makes of them into the reference frame in place
+                    struct timeval encode_start_total, encode_end_total;
+                    gettimeofday(&encode_start_total, NULL);
                     
-                    // Clean up mutex
-                    pthread_mutex_destroy(&stats_mutex);
+                    c21_encode_stats encode_stats;
+                    c21_encode_source_parallel(encode_pool, &context, &image_data, reference_frame,
+                                               reference_frame, compressed_lines, &encode_stats);
+                    total_bytes_compressed = encode_stats.bytes_compressed;
+                    total_compressible_size = encode_stats.compressible_size;
+                    frame_encode_time_us = encode_stats.encode_time_us;
                     
                     gettimeofday(&encode_end_total, NULL);
                     long long encode_wall_time_total_us = time_diff_us(encode_start_total, encode_end_total);
                     
-                    log_message(LOG_INFO, "  Parallel encoding with %d threads completed\n", num_threads);
-                    
-                    // DECODING PHASE: Decode all lines in order
-                    struct timeval decode_start_total, decode_end_total;
-                    gettimeofday(&decode_start_total, NULL);
-                    
-                    for (int line = 0; line < height; line++) {
-                        // Skip lines that failed compression
-                        if (!compressed_lines[line].data) continue;
-                        
-                        int start_pos = line * width;
-                        
-                        // Decode this line
-                        struct timeval decode_start, decode_end;
-                        gettimeofday(&decode_start, NULL);
-                        
-                        size_t line_decompressed_size = decode_blocks(
-                            compressed_lines[line].data,
-                            compressed_lines[line].size,
-                            &reference_frame[start_pos],
-                            &reference_frame_copy[start_pos]
-                        );
-                        
-                        gettimeofday(&decode_end, NULL);
-                        long long decode_elapsed_us = time_diff_us(decode_start, decode_end);
-                        frame_decode_time_us += decode_elapsed_us;
-                        
-                        total_bytes_decompressed += line_decompressed_size * sizeof(Vector3D);
-                    }
-                    
-                    gettimeofday(&decode_end_total, NULL);
-                    long long decode_total_us = time_diff_us(decode_start_total, decode_end_total);
-                    
-                    // Free all compressed line buffers
-                    for (int line = 0; line < height; line++) {
-                        if (compressed_lines[line].data) {
-                            free(compressed_lines[line].data);
-                        }
-                    }
+                    log_message(LOG_INFO, "  Parallel encoding with %d threads completed, %d batches stolen\n",
+                                c21_pool_size(encode_pool), encode_stats.batches_stolen);
+                    log_message(LOG_INFO, "  Changed pixels: %zu of %d\n",
+                                encode_stats.dirty_pixels, width * height);
                     
                     // Print statistics
                     double compression_ratio = (double)total_compressible_size / (double)total_bytes_compressed;
                     log_message(LOG_INFO, "Frame statistics:\n");
                     log_message(LOG_INFO, "  Compressed size: %zu bytes\n", total_bytes_compressed);
-                    log_message(LOG_INFO, "  Decompressed size: %zu bytes\n", total_bytes_decompressed);
                     log_message(LOG_INFO, "  Compressible size: %zu bytes\n", total_compressible_size);
                     log_message(LOG_INFO, "  Compression ratio: %.2f:1\n", compression_ratio);
+                    log_message(LOG_INFO, "  Heap calls: %zu\n",
+                                frame_arena.heap_calls - heap_calls +
+                                encode_stats.heap_calls);
                     
-                    if (total_compressible_size != total_bytes_decompressed) {
-                        log_message(LOG_ERROR, "ERROR: Size mismatch! Compression is not lossless!\n");
-                        exit(1);
-                    }
-                    
-                    // Timing for display_frame
+                    // Timing for display_damage
                     struct timeval display_start, display_end;
                     gettimeofday(&display_start, NULL);
                     
-                    // Display the frame after it's been fully decoded
-                    display_frame(reference_frame);
+                    // Show the rows the frame changed after it's been fully decoded
+                    display_damage();
                     
                     gettimeofday(&display_end, NULL);
                     long long display_elapsed_us = time_diff_us(display_start, display_end);
@@ -410,22 +284,15 @@ void *process_images(void *arg) {
                     log_message(LOG_INFO, "Timing statistics:\n");
                     log_message(LOG_INFO, "  Encode processor time total: %.2f µs\n", frame_encode_time_us);
                     log_message(LOG_INFO, "  Encode wall time total: %.2f µs\n", (double)encode_wall_time_total_us);
-                    log_message(LOG_INFO, "  Decode total: %.2f µs\n", (double)decode_total_us);
                     log_message(LOG_INFO, "  Display time: %.2f µs\n", (double)display_elapsed_us);
                     log_message(LOG_INFO, "  Total processing time: %.2f µs\n", 
-                           (double)(encode_wall_time_total_us + decode_total_us + display_elapsed_us));
+                           (double)(encode_wall_time_total_us + display_elapsed_us));
                     
                     // Record the time immediately after displaying this frame
                     struct timeval current_time;
                     gettimeofday(&current_time, NULL);
                     last_display_time = current_time;
-                    
-                    // Free allocated resources
-                    free(compressed_lines);
-                    free(reference_frame_copy);
                 } else {
-                    if (compressed_lines) free(compressed_lines);
-                    if (reference_frame_copy) free(reference_frame_copy);
                     log_message(LOG_ERROR, "Failed to allocate buffers for encoding\n");
                 }
                 
@@ -435,8 +302,9 @@ void *process_images(void *arg) {
                 }
             }
             
-            // Free the image data after all frames are processed
-            free(image_data);
+            // Free the image after all its frames are encoded
+            imlib_context_set_image(img);
+            imlib_free_image();
             
             if (i < file_count - 1) {
                 // Calculate time since last frame was displayed
@@ -472,6 +340,8 @@ void *process_images(void *arg) {
     }
     
     // Clean up
+    c21_arena_free(&frame_arena);
+    c21_pool_destroy(encode_pool);
     free(reference_frame);
     for (int i = 0; i < file_count; i++) {
         free(files[i].name);
@@ -481,9 +351,17 @@ void *process_images(void *arg) {
     return NULL;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    c21_context_init(&context, C21_DEFAULT_WIDTH, C21_DEFAULT_HEIGHT);
+    
+    // Optional encoder profile written by the tuner
+    if (argc > 1 && !c21_context_load_profile(&context, argv[1])) {
+        log_message(LOG_ERROR, "Failed to load profile %s\n", argv[1]);
+        return 1;
+    }
+    
     // Initialize display
-    if (init_display() == 0) {
+    if (init_display(context.width, context.height) == 0) {
         log_message(LOG_ERROR, "Failed to initialize display\n");
         return 1;
     }
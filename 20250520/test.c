@@ -5,6 +5,9 @@
 #include <float.h>
 #include <stdio.h>
 #include "codec21.h"
+#include "transport.h"
+#include "fec.h"
+#include "nack.h"
 
 // This document is Licensed under Creative Commons CC0.
 // To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
@@ -16,7 +19,9 @@
 // Disclaimer: Patent rights reserved regardless of the license above
 
 /*
-gcc -o a.out test.c codec21.c; ./a.out 
+gcc -o a.out test.c codec21.c decoder.c transport.c fec.c nack.c; ./a.out 
+gcc -mssse3 -o a.out test.c codec21.c decoder.c transport.c fec.c nack.c; ./a.out
+gcc -mavx2 -o a.out test.c codec21.c decoder.c transport.c fec.c nack.c; ./a.out
 */
 
 void calculate_errors(const size_t num, Vector3D* input, Vector3D* decompressed) {
@@ -137,10 +142,16 @@ int tests() {
     // Sample size for testing
     const size_t NUM_VECTORS = 1024;
     
+    // Every test is a single line of the sample size
+    c21_context context;
+    c21_context_init(&context, NUM_VECTORS, 1);
+
     // Allocate input, reference, and output buffers
     Vector3D* input = malloc(NUM_VECTORS * sizeof(Vector3D));
     Vector3D* reference = malloc(NUM_VECTORS * sizeof(Vector3D));
     Vector3D* decompressed = malloc(NUM_VECTORS * sizeof(Vector3D));
+    Vector3D* reconstructed = malloc(NUM_VECTORS * sizeof(Vector3D));
+    Vector3D* in_place = malloc(NUM_VECTORS * sizeof(Vector3D));
     
     // Maximum compressed size (worst case)
     const size_t uncompressed_size = NUM_VECTORS * sizeof(Vector3D) * 1;
@@ -163,11 +174,30 @@ int tests() {
         for (size_t i=0; i < 6; i++) {
 
             size_t compressed_size = 0;
-            compressed_size += encode_block(input, reference, NUM_VECTORS, compressed + compressed_size, max_compressed_size - compressed_size);
+            compressed_size += encode_block_reconstruct(&context, input, reference, NUM_VECTORS, compressed + compressed_size, max_compressed_size - compressed_size, reconstructed);
         
-            size_t decompressed_vectors = decode_blocks(compressed, compressed_size, 
+            size_t decompressed_vectors = decode_blocks(&context, compressed, compressed_size, 
                                                       decompressed, reference);
 
+            // The encoder must predict the decoder exactly
+            if (memcmp(reconstructed, decompressed, uncompressed_size) != 0) {
+                printf("Reconstructed frame differs from the decoded frame\n");
+            }
+
+            // Decoding over the reference itself must give the same frame
+            memcpy(in_place, reference, uncompressed_size);
+            decode_blocks(&context, compressed, compressed_size, in_place, in_place);
+            if (memcmp(in_place, decompressed, uncompressed_size) != 0) {
+                printf("In place decoded frame differs from the decoded frame\n");
+            }
+
+            // So must encoding with the reference updated in place
+            memcpy(in_place, reference, uncompressed_size);
+            encode_block_reconstruct(&context, input, in_place, NUM_VECTORS, compressed, max_compressed_size, in_place);
+            if (memcmp(in_place, decompressed, uncompressed_size) != 0) {
+                printf("In place reconstructed frame differs from the decoded frame\n");
+            }
+
             memcpy(reference, decompressed, uncompressed_size);
 
             printf("\nProgressive frame: %d\nCompression ratio: %.6f/%.6f = %.6f%%\n",
@@ -183,12 +213,571 @@ int tests() {
     free(input);
     free(reference);
     free(decompressed);
+    free(reconstructed);
+    free(in_place);
     free(compressed);
     
     return 0;
 }
 
+// Unchanged rows between changed ones, in a frame wider than its lines
+int row_skip_test() {
+    const int width = 100, height = 12, stride = 128;
+    c21_context context;
+    c21_context_init(&context, width, height);
+    context.stride = stride;
+
+    Vector3D* input = calloc(stride * height, sizeof(Vector3D));
+    Vector3D* reference = calloc(stride * height, sizeof(Vector3D));
+    Vector3D* decompressed = calloc(stride * height, sizeof(Vector3D));
+    uint8_t* compressed = malloc(stride * height * sizeof(Vector3D) * 2);
+    unit_test_5(reference, stride * height);
+    memcpy(input, reference, stride * height * sizeof(Vector3D));
+    unit_test_5(&input[2 * stride], width);
+    unit_test_5(&input[11 * stride], width);
+
+    // Line 2 and line 11 changed, each stream starts with a row skip to its line
+    size_t compressed_size = encode_row_skip(2, compressed);
+    compressed_size += encode_block(&context, &input[2 * stride], &reference[2 * stride], width,
+                                    compressed + compressed_size, stride * sizeof(Vector3D) * 2);
+    size_t decoded_size = decode_blocks(&context, compressed, compressed_size, decompressed, reference);
+    compressed_size = encode_row_skip(8, compressed);
+    compressed_size += encode_block(&context, &input[11 * stride], &reference[11 * stride], width,
+                                    compressed + compressed_size, stride * sizeof(Vector3D) * 2);
+    decoded_size += decode_blocks(&context, compressed, compressed_size,
+                                  &decompressed[3 * stride], &reference[3 * stride]);
+
+    if (decoded_size != (size_t)width * height) {
+        printf("Row skip decoded %zu pixels of %d\n", decoded_size, width * height);
+    }
+    for (int line = 0; line < height; line++) {
+        if (line != 2 && line != 11 &&
+            memcmp(&decompressed[line * stride], &reference[line * stride], width * sizeof(Vector3D)) != 0) {
+            printf("Row skip changed line %d\n", line);
+        }
+    }
+    // The changed lines are lossy, decoding them directly must give the same pixels
+    Vector3D line_decoded[100];
+    for (int line = 2; line < height; line += 9) {
+        compressed_size = encode_block(&context, &input[line * stride], &reference[line * stride], width,
+                                       compressed, stride * sizeof(Vector3D) * 2);
+        decode_blocks(&context, compressed, compressed_size, line_decoded, &reference[line * stride]);
+        if (memcmp(&decompressed[line * stride], line_decoded, width * sizeof(Vector3D)) != 0) {
+            printf("Row skip moved line %d\n", line);
+        }
+    }
+
+    free(input);
+    free(reference);
+    free(decompressed);
+    free(compressed);
+    return 0;
+}
+
+// Decoding into a surface must give the converted pixels of the decoded frame
+// and damage only the rows that changed
+int surface_test() {
+    const int width = 100, height = 12, stride = 128;
+    c21_context context;
+    c21_context_init(&context, width, height);
+    context.stride = stride;
+
+    Vector3D* input = calloc(stride * height, sizeof(Vector3D));
+    Vector3D* reference = calloc(stride * height, sizeof(Vector3D));
+    uint8_t* compressed = malloc(stride * height * sizeof(Vector3D) * 2);
+    uint32_t* pixels = calloc(width * height, sizeof(uint32_t));
+    uint8_t damaged_rows[12] = {0};
+    c21_surface surface = {pixels, width, damaged_rows};
+    unit_test_5(reference, stride * height);
+    for (int line = 0; line < height; line++) {
+        c21_surface_write(&surface, line, 0, &reference[line * stride], width);
+    }
+    memset(damaged_rows, 0, sizeof(damaged_rows));
+    memcpy(input, reference, stride * height * sizeof(Vector3D));
+    unit_test_5(&input[5 * stride + 7], 50);
+
+    // A row skip to line 5, then the line decoded in place
+    size_t compressed_size = encode_row_skip(5, compressed);
+    compressed_size += encode_block(&context, &input[5 * stride], &reference[5 * stride], width,
+                                    compressed + compressed_size, stride * sizeof(Vector3D) * 2);
+    decode_blocks_surface(&context, compressed, compressed_size, reference, reference, &surface, 0);
+
+    for (int line = 0; line < height; line++) {
+        if (damaged_rows[line] != (line == 5)) {
+            printf("Surface damage %d on line %d\n", damaged_rows[line], line);
+        }
+        for (int x = 0; x < width; x++) {
+            Vector3D pixel = reference[line * stride + x];
+            uint32_t expected = 0xFF000000u | (pixel.x << 16) | (pixel.y << 8) | pixel.z;
+            if (pixels[line * width + x] != expected) {
+                printf("Surface pixel %d, %d is %08x instead of %08x\n", x, line,
+                       pixels[line * width + x], expected);
+                break;
+            }
+        }
+    }
+
+    free(input);
+    free(reference);
+    free(compressed);
+    free(pixels);
+    return 0;
+}
+
+// Bitplane blocks and surface writes of any length, start parity and
+// alignment must give the pixels of the per pixel definition, whichever
+// vector kernels the build enables
+int kernel_test() {
+    const int width = 96;
+    const uint8_t verbs[] = {VERB_BIT7AND6, VERB_BIT5AND4, VERB_BIT3AND2, VERB_BIT1AND0};
+    const uint8_t shifts[] = {6, 4, 2, 0};
+    const uint8_t highs[] = {0x00, 0xC0, 0xF0, 0xFC};
+    c21_context context;
+    c21_context_init(&context, width, 1);
+
+    uint8_t reference_bytes[width * sizeof(Vector3D) + 1];
+    uint8_t output_bytes[width * sizeof(Vector3D) + 1];
+    uint8_t block[2 + width];
+    uint32_t pixels[width];
+    c21_surface surface = {pixels, width, NULL};
+    int failures = 0;
+    for (int v = 0; v < 4 && failures == 0; v++) {
+        uint8_t mask = (uint8_t)(0x03 << shifts[v]);
+        uint8_t dithering_even = ~(highs[v] | mask) & 0xAA;
+        uint8_t dithering_odd = ~(highs[v] | mask) & 0x55;
+        for (int length = 1; length <= 70 && failures == 0; length++) {
+            for (int x = 0; x < 4; x++) {
+                for (int offset = 0; offset < 2; offset++) {
+                    // Pixels of one byte alignment, the block ends where its fields end
+                    Vector3D* reference = (Vector3D*)&reference_bytes[offset];
+                    Vector3D* output = (Vector3D*)&output_bytes[offset];
+                    for (size_t i = 0; i < width * sizeof(Vector3D); i++) {
+                        reference_bytes[offset + i] = rand() & 0xFF;
+                        output_bytes[offset + i] = 0;
+                    }
+                    memset(pixels, 0, sizeof(pixels));
+                    size_t size = start_block(verbs[v], length, block);
+                    size_t fields = (length * 3 * 2 + 7) / 8;
+                    for (size_t i = 0; i < fields; i++) {
+                        block[size++] = rand() & 0xFF;
+                    }
+                    const uint8_t* packed = &block[size - fields];
+                    decode_blocks_surface(&context, block, size, &output[x], &reference[x], &surface, x);
+
+                    for (int i = 0; i < length; i++) {
+                        uint8_t dithering = ((x + i) % 2 == 0) ? dithering_even : dithering_odd;
+                        uint8_t expected[3];
+                        for (int c = 0; c < 3; c++) {
+                            int field = i * 3 + c;
+                            uint8_t bits = ((packed[field / 4] >> ((field % 4) * 2)) & 0x03) << shifts[v];
+                            expected[c] = (((uint8_t*)&reference[x + i])[c] & highs[v]) | bits | dithering;
+                        }
+                        uint32_t expected_pixel = 0xFF000000u | (expected[0] << 16) | (expected[1] << 8) | expected[2];
+                        if (memcmp(&output[x + i], expected, 3) != 0 || pixels[x + i] != expected_pixel) {
+                            printf("Kernel verb %02x length %d at x %d offset %d differs at pixel %d\n",
+                                   verbs[v], length, x, offset, i);
+                            failures++;
+                            break;
+                        }
+                    }
+                    for (int i = 0; i < width; i++) {
+                        if ((i < x || i >= x + length) && pixels[i] != 0) {
+                            printf("Kernel verb %02x length %d at x %d wrote pixel %d\n", verbs[v], length, x, i);
+                            failures++;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Surface writes of exactly length pixels, a sanitizer sees any read past them
+    for (int length = 0; length <= 40 && failures == 0; length++) {
+        for (int x = 0; x < 4; x++) {
+            Vector3D* line = malloc((length > 0 ? length : 1) * sizeof(Vector3D));
+            for (int i = 0; i < length; i++) {
+                line[i].x = rand() & 0xFF;
+                line[i].y = rand() & 0xFF;
+                line[i].z = rand() & 0xFF;
+            }
+            memset(pixels, 0, sizeof(pixels));
+            c21_surface_write(&surface, 0, x, line, length);
+            for (int i = 0; i < width; i++) {
+                uint32_t expected = (i < x || i >= x + length) ? 0 :
+                    0xFF000000u | (line[i - x].x << 16) | (line[i - x].y << 8) | line[i - x].z;
+                if (pixels[i] != expected) {
+                    printf("Surface write of %d pixels at x %d differs at pixel %d\n", length, x, i);
+                    failures++;
+                    break;
+                }
+            }
+            free(line);
+        }
+    }
+    return failures;
+}
+
+// Line addressed datagrams must decode in any order, a lost one only
+// leaving its own segment unchanged
+int transport_test() {
+    const int width = 64, height = 8, segment_width = 16;
+    c21_context context;
+    c21_context_init(&context, width, height);
+
+    Vector3D* input = calloc(width * height, sizeof(Vector3D));
+    Vector3D* reference = calloc(width * height, sizeof(Vector3D));
+    Vector3D* in_order = calloc(width * height, sizeof(Vector3D));
+    Vector3D* shuffled = calloc(width * height, sizeof(Vector3D));
+    uint8_t packets[32][512];
+    size_t packet_sizes[32];
+    unit_test_5(input, width * height);
+
+    // One segment per datagram, decoded in order as the sender wrote them
+    int packet_count = height * width / segment_width;
+    for (int p = 0; p < packet_count; p++) {
+        int line = p / (width / segment_width), x = (p % (width / segment_width)) * segment_width;
+        uint8_t blocks[256];
+        size_t size = encode_block(&context, &input[line * width + x], &reference[line * width + x],
+                                   segment_width, blocks, sizeof(blocks));
+        packet_sizes[p] = c21_packet_begin(packets[p], 7, p, 0);
+        packet_sizes[p] = c21_packet_add_segment(packets[p], packet_sizes[p], sizeof(packets[p]),
+                                                 line, x, blocks, size);
+        decode_blocks(&context, blocks, size, &in_order[line * width + x], &reference[line * width + x]);
+    }
+
+    // Every seventh datagram first, datagram 9 lost
+    for (int k = 0; k < packet_count; k++) {
+        int p = (k * 7) % packet_count;
+        c21_packet_header header;
+        c21_segment segments[4];
+        int count = c21_packet_parse(packets[p], packet_sizes[p], &header, segments, 4);
+        if (count != 1 || header.frame != 7 || header.packet != (uint32_t)p) {
+            printf("Transport parsed %d segments of frame %u packet %u\n", count, header.frame, header.packet);
+            continue;
+        }
+        if (p == 9) {
+            continue;
+        }
+        size_t pos = segments[0].line * width + segments[0].x;
+        decode_blocks(&context, segments[0].data, segments[0].size, &shuffled[pos], &reference[pos]);
+    }
+    for (int p = 0; p < packet_count; p++) {
+        int line = p / (width / segment_width), x = (p % (width / segment_width)) * segment_width;
+        const Vector3D* expected = (p == 9) ? &reference[line * width + x] : &in_order[line * width + x];
+        if (memcmp(&shuffled[line * width + x], expected, segment_width * sizeof(Vector3D)) != 0) {
+            printf("Transport segment %d decoded differently\n", p);
+        }
+    }
+
+    // Truncated datagrams are rejected, frame numbers wrap around
+    c21_packet_header header;
+    c21_segment segments[4];
+    if (c21_packet_parse(packets[0], packet_sizes[0] - 1, &header, segments, 4) != -1) {
+        printf("Transport accepted a truncated datagram\n");
+    }
+    if (!c21_frame_after(2, 0xFFFFFFFEu) || c21_frame_after(0xFFFFFFFEu, 2)) {
+        printf("Transport frame order does not wrap\n");
+    }
+
+    // Segments reaching past their line belong to another decoder thread
+    if (c21_packet_parse(packets[3], packet_sizes[3], &header, segments, 4) != 1 ||
+        !c21_segment_fits(&segments[0], width)) {
+        printf("Transport rejected a segment within its line\n");
+    }
+    uint8_t blocks[8];
+    c21_segment segment = {0, width - 4, blocks, start_block(VERB_SKIP, 5, blocks)};
+    if (c21_segment_fits(&segment, width)) {
+        printf("Transport accepted a segment past the end of its line\n");
+    }
+    segment.size = encode_row_skip(1, blocks);
+    segment.size += start_block(VERB_SKIP, 1, &blocks[segment.size]);
+    if (c21_segment_fits(&segment, width)) {
+        printf("Transport accepted a segment skipping rows\n");
+    }
+    segment.size = start_block(VERB_LINEAR, 2, blocks) + sizeof(Vector3D);
+    if (c21_segment_fits(&segment, width)) {
+        printf("Transport accepted a truncated block\n");
+    }
+
+    free(input);
+    free(reference);
+    free(in_order);
+    free(shuffled);
+    return 0;
+}
+
+typedef struct {
+    uint8_t packets[64][128];
+    size_t sizes[64];
+    int count;
+} captured_packets;
+
+void capture_packet(const uint8_t* packet, size_t size, void* user) {
+    captured_packets* captured = (captured_packets*)user;
+    if (captured->count < 64) {
+        memcpy(captured->packets[captured->count], packet, size);
+        captured->sizes[captured->count++] = size;
+    }
+}
+
+// Packetized segments split at block boundaries must decode like the segment,
+// also where the split leaves an odd number of pixels before it
+int packetizer_test() {
+    const int width = 400, height = 4, mtu = 128;
+    c21_context context;
+    c21_context_init(&context, width, height);
+
+    Vector3D* input = calloc(width * height, sizeof(Vector3D));
+    Vector3D* reference = calloc(width * height, sizeof(Vector3D));
+    Vector3D* whole = calloc(width * height, sizeof(Vector3D));
+    Vector3D* packetized = calloc(width * height, sizeof(Vector3D));
+    uint8_t* blocks = malloc(width * sizeof(Vector3D) * 2);
+    static captured_packets captured;
+    uint8_t packet[128];
+    unit_test_5(input, (height - 1) * width);
+    // The last line starts with an odd skip, every block boundary after it is odd
+    memcpy(&input[(height - 1) * width], input, width * sizeof(Vector3D));
+    memcpy(&reference[(height - 1) * width], input, 3 * sizeof(Vector3D));
+
+    c21_packetizer packetizer;
+    c21_packetizer_init(&packetizer, packet, mtu, capture_packet, &captured);
+    c21_packetizer_begin_frame(&packetizer, 3);
+    for (int line = 0; line < height - 1; line++) {
+        // A short segment of a few pixels, then a long one from pixel 10 on
+        size_t size = encode_block(&context, &input[line * width], &reference[line * width], 4,
+                                   blocks, width * sizeof(Vector3D) * 2);
+        decode_blocks(&context, blocks, size, &whole[line * width], &reference[line * width]);
+        if (!c21_packetizer_add(&packetizer, line, 0, blocks, size)) {
+            printf("Packetizer rejected line %d\n", line);
+        }
+        size = encode_block(&context, &input[line * width + 10], &reference[line * width + 10], width - 10,
+                            blocks, width * sizeof(Vector3D) * 2);
+        decode_blocks(&context, blocks, size, &whole[line * width + 10], &reference[line * width + 10]);
+        if (!c21_packetizer_add(&packetizer, line, 10, blocks, size)) {
+            printf("Packetizer rejected line %d\n", line);
+        }
+    }
+    size_t size = encode_block(&context, &input[(height - 1) * width], &reference[(height - 1) * width], width,
+                               blocks, width * sizeof(Vector3D) * 2);
+    decode_blocks(&context, blocks, size, &whole[(height - 1) * width], &reference[(height - 1) * width]);
+    uint8_t verb;
+    size_t skipped;
+    open_block(blocks, &verb, &skipped);
+    if (verb != VERB_SKIP || skipped % 2 == 0) {
+        printf("Packetizer test line starts with %zu pixels of verb %02x\n", skipped, verb);
+    }
+    if (!c21_packetizer_add(&packetizer, height - 1, 0, blocks, size)) {
+        printf("Packetizer rejected line %d\n", height - 1);
+    }
+    c21_packetizer_end_frame(&packetizer);
+
+    for (int p = 0; p < captured.count; p++) {
+        c21_packet_header header;
+        c21_segment segments[C21_MAX_PACKET_SEGMENTS];
+        int count = c21_packet_parse(captured.packets[p], captured.sizes[p], &header, segments,
+                                     C21_MAX_PACKET_SEGMENTS);
+        if (count < 0 || captured.sizes[p] > (size_t)mtu || header.frame != 3 || header.packet != (uint32_t)p ||
+            (header.flags & C21_FLAG_END_OF_FRAME) != (p == captured.count - 1 ? C21_FLAG_END_OF_FRAME : 0)) {
+            printf("Packetizer datagram %d of %zu bytes is wrong\n", p, captured.sizes[p]);
+            continue;
+        }
+        // Pieces decode at their position, where the dithering continues
+        for (int s = 0; s < count; s++) {
+            size_t pos = segments[s].line * width + segments[s].x;
+            decode_blocks_surface(&context, segments[s].data, segments[s].size, &packetized[pos], &reference[pos],
+                                  NULL, pos);
+        }
+    }
+    if (captured.count < 2 || memcmp(whole, packetized, width * height * sizeof(Vector3D)) != 0) {
+        printf("Packetizer changed the pixels in %d datagrams\n", captured.count);
+    }
+
+    free(input);
+    free(reference);
+    free(whole);
+    free(packetized);
+    free(blocks);
+    return 0;
+}
+
+void protect_packet(const uint8_t* packet, size_t size, void* user) {
+    c21_fec_send((c21_fec_encoder*)user, packet, size);
+}
+
+// Function to feed the captured datagrams but lost_a and lost_b to a
+// decoder, returns the datagrams rebuilt and the number of the last one.
+// Padded datagrams fill all 128 bytes like segmentation offload sends them.
+int receive_protected(captured_packets* captured, int lost_a, int lost_b, int padded,
+                      c21_fec_decoder* decoder, uint8_t* rebuilt_copy, size_t* rebuilt_size) {
+    int rebuilt_count = 0;
+    for (int p = 0; p < captured->count; p++) {
+        if (p == lost_a || p == lost_b) {
+            continue;
+        }
+        uint8_t packet[128] = {0};
+        memcpy(packet, captured->packets[p], captured->sizes[p]);
+        size_t packet_size = padded ? sizeof(packet) : captured->sizes[p];
+        if (packet[2] & C21_FLAG_PARITY) {
+            uint8_t* rebuilt;
+            size_t size = c21_fec_recover(decoder, packet, packet_size, &rebuilt);
+            if (size > 0 && c21_fec_remember(decoder, rebuilt, size)) {
+                memcpy(rebuilt_copy, rebuilt, size);
+                *rebuilt_size = size;
+                rebuilt_count++;
+            }
+        } else if (!c21_fec_remember(decoder, packet, packet_size)) {
+            printf("FEC took datagram %d for a duplicate\n", p);
+        }
+    }
+    return rebuilt_count;
+}
+
+// Any single lost datagram of a group comes back from the parity, two lost
+// ones in a group do not
+int fec_test() {
+    const int width = 400, height = 2, mtu = 128;
+    c21_context context;
+    c21_context_init(&context, width, height);
+
+    Vector3D* input = calloc(width * height, sizeof(Vector3D));
+    Vector3D* reference = calloc(width * height, sizeof(Vector3D));
+    uint8_t* blocks = malloc(width * sizeof(Vector3D) * 2);
+    static captured_packets captured;
+    uint8_t packet[128];
+    unit_test_5(input, width * height);
+
+    c21_fec_encoder encoder;
+    if (!c21_fec_encoder_init(&encoder, 3, 2, mtu - C21_FEC_HEADER_SIZE, capture_packet, &captured)) {
+        printf("FEC encoder refused groups of 3\n");
+        return 0;
+    }
+    c21_packetizer packetizer;
+    c21_packetizer_init(&packetizer, packet, mtu - C21_FEC_HEADER_SIZE, protect_packet, &encoder);
+    c21_packetizer_begin_frame(&packetizer, 5);
+    for (int line = 0; line < height; line++) {
+        size_t size = encode_block(&context, &input[line * width], &reference[line * width], width,
+                                   blocks, width * sizeof(Vector3D) * 2);
+        c21_packetizer_add(&packetizer, line, 0, blocks, size);
+    }
+    c21_packetizer_end_frame(&packetizer);
+    // Groups of 3 in each of 2 lanes, the last ones shorter
+    int lane_datagrams[2] = {(packetizer.packet_number + 1) / 2, packetizer.packet_number / 2};
+    if (encoder.parity_sent != (size_t)((lane_datagrams[0] + 2) / 3 + (lane_datagrams[1] + 2) / 3)) {
+        printf("FEC sent %zu parity datagrams for %u datagrams\n", encoder.parity_sent, packetizer.packet_number);
+    }
+
+    uint8_t rebuilt[128];
+    size_t rebuilt_size = 0;
+    for (int lost = 0; lost < 2 * captured.count; lost++) {
+        int padded = lost >= captured.count;
+        if (captured.packets[lost % captured.count][2] & C21_FLAG_PARITY) {
+            continue;
+        }
+        c21_fec_decoder decoder;
+        c21_fec_decoder_init(&decoder);
+        int count = receive_protected(&captured, lost % captured.count, -1, padded, &decoder, rebuilt,
+                                      &rebuilt_size);
+        if (count != 1 || rebuilt_size != captured.sizes[lost % captured.count] ||
+            memcmp(rebuilt, captured.packets[lost % captured.count], rebuilt_size) != 0) {
+            printf("FEC rebuilt %d datagrams for lost datagram %d%s\n", count, lost % captured.count,
+                   padded ? " of padded ones" : "");
+        }
+        // The original arriving late is not decoded again
+        if (c21_fec_remember(&decoder, captured.packets[lost % captured.count],
+                             captured.sizes[lost % captured.count])) {
+            printf("FEC let datagram %d through twice\n", lost % captured.count);
+        }
+        c21_fec_decoder_free(&decoder);
+    }
+
+    // Datagrams 0 and 2 share the first group of lane 0
+    c21_fec_decoder decoder;
+    c21_fec_decoder_init(&decoder);
+    if (receive_protected(&captured, 0, 2, 0, &decoder, rebuilt, &rebuilt_size) != 0 || decoder.unrecoverable != 1) {
+        printf("FEC rebuilt a group that lost two datagrams\n");
+    }
+    c21_fec_decoder_free(&decoder);
+
+    c21_fec_encoder_free(&encoder);
+    free(input);
+    free(reference);
+    free(blocks);
+    return 0;
+}
+
+// Gaps in the datagram numbers become NACK ranges, the sender answers with
+// the datagrams it still keeps
+int nack_test() {
+    c21_nack_tracker tracker;
+    c21_nack_begin_frame(&tracker, 9);
+    const uint32_t arrived[] = {0, 1, 4, 5, 3, 9};
+    c21_nack_range gaps[2];
+    int gap_count = 0;
+    for (int i = 0; i < 6; i++) {
+        if (c21_nack_mark(&tracker, arrived[i], &gaps[gap_count < 2 ? gap_count : 1])) {
+            gap_count++;
+        }
+    }
+    if (gap_count != 2 || gaps[0].first != 2 || gaps[0].count != 2 || gaps[1].first != 6 || gaps[1].count != 3) {
+        printf("NACK found %d gaps\n", gap_count);
+    }
+    c21_nack_range ranges[C21_NACK_MAX_RANGES];
+    int count = c21_nack_missing(&tracker, 11, ranges, C21_NACK_MAX_RANGES);
+    if (count != 3 || ranges[0].first != 2 || ranges[0].count != 1 || ranges[1].first != 6 ||
+        ranges[1].count != 3 || ranges[2].first != 10 || ranges[2].count != 1) {
+        printf("NACK listed %d missing ranges\n", count);
+    }
+
+    uint8_t packet[C21_PACKET_HEADER_SIZE + C21_NACK_MAX_RANGES * C21_NACK_RANGE_SIZE];
+    c21_nack_range parsed[C21_NACK_MAX_RANGES];
+    uint32_t frame = 0;
+    size_t size = c21_nack_write(packet, sizeof(packet), 9, ranges, count);
+    if (c21_nack_parse(packet, size, &frame, parsed, C21_NACK_MAX_RANGES) != count || frame != 9 ||
+        memcmp(parsed, ranges, count * sizeof(c21_nack_range)) != 0) {
+        printf("NACK of %zu bytes did not parse back\n", size);
+    }
+    if (c21_nack_parse(packet, size - 1, &frame, parsed, C21_NACK_MAX_RANGES) != -1) {
+        printf("NACK accepted a truncated datagram\n");
+    }
+
+    // A ring of 4 keeps datagrams 2 to 5 of frame 9 after frame 8 and datagrams 0 to 5
+    c21_retransmit_ring ring;
+    if (!c21_retransmit_init(&ring, 4, 64)) {
+        printf("NACK ring allocation failed\n");
+        return 0;
+    }
+    for (int p = 0; p < 8; p++) {
+        uint8_t datagram[64];
+        size_t datagram_size = c21_packet_begin(datagram, p < 2 ? 8 : 9, p < 2 ? p : p - 2, 0);
+        memset(&datagram[datagram_size], p, 8);
+        c21_retransmit_store(&ring, datagram, datagram_size + 8);
+    }
+    static captured_packets captured;
+    c21_nack_range asked[2] = {{1, 2}, {5, 1}};
+    int sent = c21_retransmit(&ring, 9, asked, 2, capture_packet, &captured);
+    if (sent != 2 || ring.expired != 1 || captured.count != 2) {
+        printf("NACK sent %d datagrams again, %zu expired\n", sent, ring.expired);
+    }
+    for (int p = 0; p < captured.count; p++) {
+        c21_packet_header header;
+        if (!c21_packet_parse_header(captured.packets[p], captured.sizes[p], &header) || header.frame != 9 ||
+            (header.packet != 2 && header.packet != 5) || captured.packets[p][C21_PACKET_HEADER_SIZE] != header.packet + 2) {
+            printf("NACK sent datagram %u of frame %u again\n", header.packet, header.frame);
+        }
+    }
+    c21_retransmit_free(&ring);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     tests();    
+    row_skip_test();
+    surface_test();
+    kernel_test();
+    transport_test();
+    packetizer_test();
+    fec_test();
+    nack_test();
     return 0;
 }
@@ -0,0 +1,239 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+// Line addressed datagrams of the UDP sender and receiver.
+// Single byte markers between segments made the position of a segment
+// depend on every datagram before it, so one lost or reordered datagram
+// moved the rest of the frame. Here every segment carries its own line and
+// x offset, and frame and packet numbers let the receiver count losses.
+
+#include <string.h>
+#include "codec21.h"
+#include "transport.h"
+
+// Function to write a big endian 16-bit field
+static void put_u16(uint8_t* output, uint32_t value) {
+    output[0] = (uint8_t)(value >> 8);
+    output[1] = (uint8_t)value;
+}
+
+// Function to write a big endian 32-bit field
+static void put_u32(uint8_t* output, uint32_t value) {
+    put_u16(output, value >> 16);
+    put_u16(output + 2, value & 0xFFFF);
+}
+
+static uint32_t get_u16(const uint8_t* input) {
+    return ((uint32_t)input[0] << 8) | input[1];
+}
+
+static uint32_t get_u32(const uint8_t* input) {
+    return (get_u16(input) << 16) | get_u16(input + 2);
+}
+
+size_t c21_packet_begin(uint8_t* packet, uint32_t frame, uint32_t packet_number, uint8_t flags) {
+    packet[0] = C21_TRANSPORT_MAGIC;
+    packet[1] = C21_TRANSPORT_VERSION;
+    packet[2] = flags;
+    packet[3] = 0;
+    put_u32(&packet[4], frame);
+    put_u32(&packet[8], packet_number);
+    return C21_PACKET_HEADER_SIZE;
+}
+
+size_t c21_packet_add_segment(uint8_t* packet, size_t packet_size, size_t capacity,
+                              int line, int x, const uint8_t* data, size_t size) {
+    if (packet[3] == C21_MAX_PACKET_SEGMENTS || size > 0xFFFF ||
+        line < 0 || line > 0xFFFF || x < 0 || x > 0xFFFF ||
+        packet_size + C21_SEGMENT_HEADER_SIZE + size > capacity) {
+        return 0;
+    }
+    uint8_t* segment = &packet[packet_size];
+    put_u16(&segment[0], (uint32_t)line);
+    put_u16(&segment[2], (uint32_t)x);
+    put_u16(&segment[4], (uint32_t)size);
+    // The blocks may already be in place when the encoder wrote them there
+    if (&segment[C21_SEGMENT_HEADER_SIZE] != data) {
+        memmove(&segment[C21_SEGMENT_HEADER_SIZE], data, size);
+    }
+    packet[3]++;
+    return packet_size + C21_SEGMENT_HEADER_SIZE + size;
+}
+
+int c21_packet_parse_header(const uint8_t* packet, size_t size, c21_packet_header* header) {
+    if (size < C21_PACKET_HEADER_SIZE || packet[0] != C21_TRANSPORT_MAGIC ||
+        packet[1] != C21_TRANSPORT_VERSION) {
+        return 0;
+    }
+    header->flags = packet[2];
+    header->segment_count = packet[3];
+    header->frame = get_u32(&packet[4]);
+    header->packet = get_u32(&packet[8]);
+    return 1;
+}
+
+int c21_packet_parse(const uint8_t* packet, size_t size, c21_packet_header* header,
+                     c21_segment* segments, int capacity) {
+    if (!c21_packet_parse_header(packet, size, header) || (header->flags & (C21_FLAG_PARITY | C21_FLAG_NACK)) ||
+        header->segment_count > capacity) {
+        return -1;
+    }
+
+    size_t pos = C21_PACKET_HEADER_SIZE;
+    for (int s = 0; s < header->segment_count; s++) {
+        if (pos + C21_SEGMENT_HEADER_SIZE > size) {
+            return -1;
+        }
+        segments[s].line = (int)get_u16(&packet[pos]);
+        segments[s].x = (int)get_u16(&packet[pos + 2]);
+        segments[s].size = get_u16(&packet[pos + 4]);
+        segments[s].data = &packet[pos + C21_SEGMENT_HEADER_SIZE];
+        pos += C21_SEGMENT_HEADER_SIZE + segments[s].size;
+        if (pos > size) {
+            return -1;
+        }
+    }
+    return header->segment_count;
+}
+
+size_t c21_packet_length(const uint8_t* packet, size_t size) {
+    c21_packet_header header;
+    if (!c21_packet_parse_header(packet, size, &header)) {
+        return 0;
+    }
+    size_t pos = C21_PACKET_HEADER_SIZE;
+    for (int s = 0; s < header.segment_count; s++) {
+        if (pos + C21_SEGMENT_HEADER_SIZE > size) {
+            return 0;
+        }
+        pos += C21_SEGMENT_HEADER_SIZE + get_u16(&packet[pos + 4]);
+        if (pos > size) {
+            return 0;
+        }
+    }
+    return pos;
+}
+
+int c21_segment_fits(const c21_segment* segment, int width) {
+    if (segment->x >= width) {
+        return 0;
+    }
+    size_t room = (size_t)(width - segment->x);
+    size_t pos = 0, pixels = 0;
+    while (pos < segment->size) {
+        // The extended length byte has to be there before the block is read
+        if ((segment->data[pos] & LENGTH_FLAG) && pos + 2 > segment->size) {
+            return 0;
+        }
+        uint8_t verb;
+        size_t length;
+        pos += block_extent(&segment->data[pos], &verb, &length);
+        pixels += length;
+        // A row skip would move the blocks after it into lines of another decoder
+        if (verb == VERB_ROWSKIP || pos > segment->size || pixels > room) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int c21_frame_after(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) > 0;
+}
+
+void c21_packetizer_init(c21_packetizer* packetizer, uint8_t* buffer, size_t mtu,
+                         void (*send)(const uint8_t* packet, size_t size, void* user), void* user) {
+    memset(packetizer, 0, sizeof(*packetizer));
+    packetizer->packet = buffer;
+    packetizer->mtu = mtu;
+    packetizer->send = send;
+    packetizer->user = user;
+}
+
+void c21_packetizer_begin_frame(c21_packetizer* packetizer, uint32_t frame) {
+    packetizer->frame = frame;
+    packetizer->packet_number = 0;
+    packetizer->size = 0;
+}
+
+// Function to send the datagram being filled
+static void flush_packet(c21_packetizer* packetizer) {
+    if (packetizer->size > 0) {
+        packetizer->send(packetizer->packet, packetizer->size, packetizer->user);
+        packetizer->packet_number++;
+        packetizer->size = 0;
+    }
+}
+
+// Function to append a piece of a segment, starting a new datagram if needed
+static int add_piece(c21_packetizer* packetizer, int line, int x, const uint8_t* blocks, size_t size) {
+    if (packetizer->size == 0) {
+        packetizer->size = c21_packet_begin(packetizer->packet, packetizer->frame,
+                                            packetizer->packet_number, 0);
+    }
+    size_t packet_size = c21_packet_add_segment(packetizer->packet, packetizer->size, packetizer->mtu,
+                                                line, x, blocks, size);
+    if (packet_size == 0) {
+        if (packetizer->packet[3] == 0) {
+            return 0;
+        }
+        flush_packet(packetizer);
+        return add_piece(packetizer, line, x, blocks, size);
+    }
+    packetizer->size = packet_size;
+    return 1;
+}
+
+int c21_packetizer_add(c21_packetizer* packetizer, int line, int x, const uint8_t* blocks, size_t size) {
+    const size_t payload = packetizer->mtu - C21_PACKET_HEADER_SIZE - C21_SEGMENT_HEADER_SIZE;
+    size_t pos = 0;
+    while (size - pos > payload) {
+        // Walk the blocks to the last boundary that fits the room left, or a
+        // whole datagram if too little is left. Dithering follows the x of a
+        // pixel, so any block boundary is a place to split.
+        size_t room = packetizer->size ? packetizer->mtu - packetizer->size - C21_SEGMENT_HEADER_SIZE : payload;
+        if (packetizer->size && packetizer->size + C21_SEGMENT_HEADER_SIZE >= packetizer->mtu) {
+            room = 0;
+        }
+        size_t bytes = 0, pixels = 0;
+        while (pos + bytes < size) {
+            uint8_t verb;
+            size_t length;
+            size_t extent = block_extent(&blocks[pos + bytes], &verb, &length);
+            if (bytes + extent > room) {
+                break;
+            }
+            bytes += extent;
+            pixels += length;
+        }
+        if (bytes == 0) {
+            if (room == payload) {
+                return 0;
+            }
+            flush_packet(packetizer);
+            continue;
+        }
+        if (!add_piece(packetizer, line, x, &blocks[pos], bytes)) {
+            return 0;
+        }
+        flush_packet(packetizer);
+        pos += bytes;
+        x += (int)pixels;
+    }
+    return add_piece(packetizer, line, x, &blocks[pos], size - pos);
+}
+
+void c21_packetizer_end_frame(c21_packetizer* packetizer) {
+    if (packetizer->size == 0) {
+        packetizer->size = c21_packet_begin(packetizer->packet, packetizer->frame,
+                                            packetizer->packet_number, 0);
+    }
+    packetizer->packet[2] |= C21_FLAG_END_OF_FRAME;
+    flush_packet(packetizer);
+}
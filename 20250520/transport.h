@@ -0,0 +1,100 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Datagram layout, all fields big endian:
+//   magic u8, version u8, flags u8, segment count u8, frame u32, packet u32,
+//   then per segment line u16, x u16, bytes u16 and the blocks of the segment.
+// Every segment says where its pixels go, so datagrams decode in any order
+// and a lost one only leaves its own pixels of the frame unchanged.
+#define C21_TRANSPORT_MAGIC 0xC2
+#define C21_TRANSPORT_VERSION 1
+#define C21_PACKET_HEADER_SIZE 12
+#define C21_SEGMENT_HEADER_SIZE 6
+#define C21_MAX_PACKET_SEGMENTS 255
+
+// The last datagram of a frame, its packet number counts the datagrams before it
+#define C21_FLAG_END_OF_FRAME 0x01
+// Parity of a group of datagrams instead of segments, see fec.h
+#define C21_FLAG_PARITY 0x02
+// Request from the receiver to send datagrams again, see nack.h
+#define C21_FLAG_NACK 0x04
+
+typedef struct {
+    uint8_t flags;
+    int segment_count;
+    uint32_t frame;    // Sequence number of the frame
+    uint32_t packet;   // Sequence number of the datagram within the frame
+} c21_packet_header;
+
+// Blocks of a segment decode at line, x of the frame
+typedef struct {
+    int line;
+    int x;
+    const uint8_t* data;
+    size_t size;
+} c21_segment;
+
+// Writes the header of a datagram without segments, returns its size
+size_t c21_packet_begin(uint8_t* packet, uint32_t frame, uint32_t packet_number, uint8_t flags);
+// Appends a segment to a datagram of packet_size bytes, returns the new size
+// or 0 if it does not fit into capacity bytes
+size_t c21_packet_add_segment(uint8_t* packet, size_t packet_size, size_t capacity,
+                              int line, int x, const uint8_t* data, size_t size);
+// Reads the header of a datagram, returns 0 if it is not one
+int c21_packet_parse_header(const uint8_t* packet, size_t size, c21_packet_header* header);
+// Reads a datagram, the segments point into it.
+// Returns the number of segments, or -1 for a malformed, parity or NACK datagram.
+int c21_packet_parse(const uint8_t* packet, size_t size, c21_packet_header* header,
+                     c21_segment* segments, int capacity);
+// Returns the bytes of a datagram up to the end of its last segment, without
+// the padding segmentation offload adds, or 0 for a malformed datagram
+size_t c21_packet_length(const uint8_t* packet, size_t size);
+// Returns whether the blocks of a segment are complete and stay within the
+// width - x pixels of its line. The receiver drops segments that do not, a
+// segment decodes on the thread owning its line and must not reach others.
+int c21_segment_fits(const c21_segment* segment, int width);
+
+// Returns whether frame a comes after frame b, sequence numbers wrap around
+int c21_frame_after(uint32_t a, uint32_t b);
+
+// Datagram size that passes common tunnels and links without fragmenting
+#define C21_DEFAULT_MTU 1200
+
+// Packs consecutive segments into datagrams of up to mtu bytes.
+// Segments larger than a datagram are split at block boundaries, the pieces
+// decode at their own x.
+typedef struct {
+    uint8_t* packet;          // Datagram being filled, mtu bytes
+    size_t mtu;
+    size_t size;              // Bytes of the datagram so far, zero if not started
+    uint32_t frame;
+    uint32_t packet_number;   // Datagrams of the frame sent so far
+    void (*send)(const uint8_t* packet, size_t size, void* user);
+    void* user;
+} c21_packetizer;
+
+// Sets up a packetizer writing into buffer, sending every full datagram
+void c21_packetizer_init(c21_packetizer* packetizer, uint8_t* buffer, size_t mtu,
+                         void (*send)(const uint8_t* packet, size_t size, void* user), void* user);
+// Starts the datagrams of a frame
+void c21_packetizer_begin_frame(c21_packetizer* packetizer, uint32_t frame);
+// Adds the blocks of a segment decoding at line, x. Segments stay on their
+// line and carry no row skips. Returns 0 if a single block does not fit a
+// datagram, the segment is not sent then.
+int c21_packetizer_add(c21_packetizer* packetizer, int line, int x, const uint8_t* blocks, size_t size);
+// Sends what is left marked as the last datagram of the frame
+void c21_packetizer_end_frame(c21_packetizer* packetizer);
+
+#endif
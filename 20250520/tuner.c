@@ -0,0 +1,338 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+/*
+gcc -O2 -o tuner.out tuner.c codec21.c decoder.c -lpng && ./tuner.out ../testpath/benchmark.png ../testpath/photocontent.png ../testpath/textcontent.png
+*/
+
+// Encoder parameter tuner.
+// Every point of a parameter grid encodes the same progressive sequences:
+// PNG files repeated for a few frames like the unit tests do, and synthetic
+// sequences with motion. Each point gets its compressed bytes, encoder and
+// decoder time per megapixel and the mean squared error of what the decoder
+// shows. Points no other point beats on all four are written as CSV, each
+// with a profile file that c21_context_load_profile reads back.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <png.h>
+#include "codec21.h"
+
+#define DEFAULT_FRAMES 4
+#define SYNTHETIC_WIDTH 640
+#define SYNTHETIC_HEIGHT 360
+#define SYNTHETIC_FRAMES 8
+
+typedef struct {
+    char name[256];
+    int width;
+    int height;
+    int frame_count;   // Frames stored, sequences play them in a loop
+    int play_frames;   // Frames encoded progressively
+    Vector3D* frames;
+} Sequence;
+
+typedef struct {
+    c21_context tunables;
+    size_t bytes;
+    size_t pixels;
+    double encode_us_per_mp;
+    double decode_us_per_mp;
+    double mse;
+    int pareto;
+} TunePoint;
+
+// Parameter grid, the defaults are in the middle of each row
+static const size_t quantized_sizes[] = {4, 8, 16};
+static const size_t linear_lengths[] = {12, 20, 32};
+static const size_t lut_sizes[] = {20, 30, 50};
+static const int linear_tolerances[] = {3, 6, 10};
+static const uint32_t lut_thresholds[] = {64, 192, 768};
+#define GRID(a) (sizeof(a) / sizeof(a[0]))
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+// Function to load a PNG as packed RGB, alpha is dropped
+int load_png(const char* path, Sequence* sequence, int play_frames) {
+    png_image image;
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file(&image, path)) {
+        fprintf(stderr, "Failed to read %s: %s\n", path, image.message);
+        return 0;
+    }
+    image.format = PNG_FORMAT_RGB;
+    sequence->frames = malloc(PNG_IMAGE_SIZE(image));
+    if (!sequence->frames ||
+        !png_image_finish_read(&image, NULL, sequence->frames, 0, NULL)) {
+        fprintf(stderr, "Failed to decode %s: %s\n", path, image.message);
+        free(sequence->frames);
+        png_image_free(&image);
+        return 0;
+    }
+    snprintf(sequence->name, sizeof(sequence->name), "%s", path);
+    sequence->width = image.width;
+    sequence->height = image.height;
+    sequence->frame_count = 1;
+    sequence->play_frames = play_frames;
+    return 1;
+}
+
+// Function to generate moving synthetic content.
+// Kind 0 scrolls gradients, kind 1 types dark glyphs onto a light page,
+// kind 2 adds low amplitude noise to a fixed gradient like a camera.
+int generate_sequence(int kind, Sequence* sequence) {
+    static const char* names[] = {"synthetic_scroll", "synthetic_text", "synthetic_noise"};
+    int width = SYNTHETIC_WIDTH, height = SYNTHETIC_HEIGHT;
+    size_t frame_pixels = (size_t)width * height;
+    sequence->frames = malloc(frame_pixels * SYNTHETIC_FRAMES * sizeof(Vector3D));
+    if (!sequence->frames) {
+        fprintf(stderr, "Failed to allocate synthetic frames\n");
+        return 0;
+    }
+    snprintf(sequence->name, sizeof(sequence->name), "%s", names[kind]);
+    sequence->width = width;
+    sequence->height = height;
+    sequence->frame_count = SYNTHETIC_FRAMES;
+    sequence->play_frames = SYNTHETIC_FRAMES;
+
+    uint32_t seed = 21;
+    for (int f = 0; f < SYNTHETIC_FRAMES; f++) {
+        Vector3D* frame = &sequence->frames[f * frame_pixels];
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                Vector3D* pixel = &frame[y * width + x];
+                if (kind == 0) {
+                    int u = x + f * 8;
+                    pixel->x = (uint8_t)(u * 255 / (width + SYNTHETIC_FRAMES * 8));
+                    pixel->y = (uint8_t)(y * 255 / height);
+                    pixel->z = (((u + y) / 32) % 2) ? 200 : 40;
+                } else if (kind == 1) {
+                    // Glyph cells of 8x16 pixels, more of them appear every frame
+                    int column = x / 8, row = y / 16;
+                    int cell = row * (width / 8) + column;
+                    int typed = (f + 1) * (width / 8) * 3;
+                    int ink = cell < typed && ((column * 7 + row * 13) % 5) != 0 &&
+                              (x % 8) > 0 && (x % 8) < 6 && (y % 16) > 3 && (y % 16) < 13 &&
+                              ((x * 3 + y * 5 + cell) % 4) != 0;
+                    Vector3D paper = {238, 238, 230}, text = {20, 24, 60};
+                    *pixel = ink ? text : paper;
+                } else {
+                    seed = seed * 1103515245u + 12345u;
+                    int noise = (int)((seed >> 16) % 7) - 3;
+                    int r = x * 200 / width + 20 + noise;
+                    int g = y * 200 / height + 20 + noise;
+                    pixel->x = (uint8_t)r;
+                    pixel->y = (uint8_t)g;
+                    pixel->z = (uint8_t)(128 + noise);
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+// Function to encode and decode a sequence progressively with one parameter point
+void measure_sequence(const Sequence* sequence, TunePoint* point,
+                      Vector3D* reference, uint8_t* compressed, size_t* line_sizes) {
+    c21_context context = point->tunables;
+    context.width = sequence->width;
+    context.height = sequence->height;
+    context.stride = sequence->width;
+
+    size_t frame_pixels = (size_t)sequence->width * sequence->height;
+    size_t line_capacity = sequence->width * sizeof(Vector3D) * 2;
+    memset(reference, 0, frame_pixels * sizeof(Vector3D));
+
+    for (int f = 0; f < sequence->play_frames; f++) {
+        const Vector3D* frame = &sequence->frames[(f % sequence->frame_count) * frame_pixels];
+
+        double encode_start = now_us();
+        for (int line = 0; line < sequence->height; line++) {
+            size_t start_pos = (size_t)line * sequence->width;
+            line_sizes[line] = encode_block(&context, &frame[start_pos], &reference[start_pos],
+                                            sequence->width, &compressed[line * line_capacity],
+                                            line_capacity);
+        }
+        double decode_start = now_us();
+        for (int line = 0; line < sequence->height; line++) {
+            size_t start_pos = (size_t)line * sequence->width;
+            decode_blocks(&context, &compressed[line * line_capacity], line_sizes[line],
+                          &reference[start_pos], &reference[start_pos]);
+        }
+        double decode_end = now_us();
+
+        for (int line = 0; line < sequence->height; line++) {
+            point->bytes += line_sizes[line];
+        }
+        point->encode_us_per_mp += decode_start - encode_start;
+        point->decode_us_per_mp += decode_end - decode_start;
+        point->pixels += frame_pixels;
+
+        const uint8_t* a = (const uint8_t*)frame;
+        const uint8_t* b = (const uint8_t*)reference;
+        for (size_t i = 0; i < frame_pixels * sizeof(Vector3D); i++) {
+            double diff = (double)a[i] - (double)b[i];
+            point->mse += diff * diff;
+        }
+    }
+}
+
+// Function to check whether a is at least as good as b everywhere and better somewhere
+int dominates(const TunePoint* a, const TunePoint* b) {
+    double av[4] = {(double)a->bytes, a->encode_us_per_mp, a->decode_us_per_mp, a->mse};
+    double bv[4] = {(double)b->bytes, b->encode_us_per_mp, b->decode_us_per_mp, b->mse};
+    int better = 0;
+    for (int k = 0; k < 4; k++) {
+        if (av[k] > bv[k]) return 0;
+        if (av[k] < bv[k]) better = 1;
+    }
+    return better;
+}
+
+int compare_bytes(const void* a, const void* b) {
+    const TunePoint* pa = (const TunePoint*)a;
+    const TunePoint* pb = (const TunePoint*)b;
+    return (pa->bytes > pb->bytes) - (pa->bytes < pb->bytes);
+}
+
+int main(int argc, char* argv[]) {
+    const char* csv_path = "tuner_pareto.csv";
+    const char* profile_prefix = "tuned_";
+    int play_frames = DEFAULT_FRAMES;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:p:f:")) != -1) {
+        switch (opt) {
+            case 'o': csv_path = optarg; break;
+            case 'p': profile_prefix = optarg; break;
+            case 'f': play_frames = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-o pareto.csv] [-p profile_prefix] [-f frames] [file.png ...]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (play_frames < 1) play_frames = 1;
+
+    // Corpus of the PNG files given and the synthetic sequences
+    int sequence_count = 0;
+    Sequence* sequences = calloc(argc - optind + 3, sizeof(Sequence));
+    if (!sequences) {
+        fprintf(stderr, "Failed to allocate sequences\n");
+        return 1;
+    }
+    for (int i = optind; i < argc; i++) {
+        if (load_png(argv[i], &sequences[sequence_count], play_frames)) {
+            sequence_count++;
+        }
+    }
+    for (int kind = 0; kind < 3; kind++) {
+        if (generate_sequence(kind, &sequences[sequence_count])) {
+            sequence_count++;
+        }
+    }
+
+    size_t max_pixels = 0;
+    int max_height = 0;
+    for (int s = 0; s < sequence_count; s++) {
+        size_t pixels = (size_t)sequences[s].width * sequences[s].height;
+        if (pixels > max_pixels) max_pixels = pixels;
+        if (sequences[s].height > max_height) max_height = sequences[s].height;
+        printf("Sequence %s: %dx%d, %d frames\n", sequences[s].name,
+               sequences[s].width, sequences[s].height, sequences[s].play_frames);
+    }
+    Vector3D* reference = malloc(max_pixels * sizeof(Vector3D));
+    uint8_t* compressed = malloc(max_pixels * sizeof(Vector3D) * 2);
+    size_t* line_sizes = malloc(max_height * sizeof(size_t));
+
+    int point_count = GRID(quantized_sizes) * GRID(linear_lengths) * GRID(lut_sizes) *
+                      GRID(linear_tolerances) * GRID(lut_thresholds);
+    TunePoint* points = calloc(point_count, sizeof(TunePoint));
+    if (!reference || !compressed || !line_sizes || !points) {
+        fprintf(stderr, "Failed to allocate tuner buffers\n");
+        return 1;
+    }
+
+    // Sweep the grid
+    int p = 0;
+    for (size_t a = 0; a < GRID(quantized_sizes); a++)
+    for (size_t b = 0; b < GRID(linear_lengths); b++)
+    for (size_t c = 0; c < GRID(lut_sizes); c++)
+    for (size_t d = 0; d < GRID(linear_tolerances); d++)
+    for (size_t e = 0; e < GRID(lut_thresholds); e++) {
+        TunePoint* point = &points[p++];
+        c21_context_init(&point->tunables, 0, 0);
+        point->tunables.quantized_size = quantized_sizes[a];
+        point->tunables.linear_length = linear_lengths[b];
+        point->tunables.lut_size = lut_sizes[c];
+        point->tunables.linear_tolerance = linear_tolerances[d];
+        point->tunables.lut_threshold = lut_thresholds[e];
+        for (int s = 0; s < sequence_count; s++) {
+            measure_sequence(&sequences[s], point, reference, compressed, line_sizes);
+        }
+        double megapixels = point->pixels / 1000000.0;
+        point->encode_us_per_mp /= megapixels;
+        point->decode_us_per_mp /= megapixels;
+        point->mse /= (double)point->pixels * sizeof(Vector3D);
+        printf("Point %d of %d: %zu bytes, encode %.0f us/MP, decode %.0f us/MP, MSE %.4f\n",
+               p, point_count, point->bytes, point->encode_us_per_mp, point->decode_us_per_mp,
+               point->mse);
+    }
+
+    // Keep the points nothing else dominates
+    for (int i = 0; i < point_count; i++) {
+        points[i].pareto = 1;
+        for (int j = 0; j < point_count && points[i].pareto; j++) {
+            if (j != i && dominates(&points[j], &points[i])) {
+                points[i].pareto = 0;
+            }
+        }
+    }
+    qsort(points, point_count, sizeof(TunePoint), compare_bytes);
+
+    FILE* csv = fopen(csv_path, "w");
+    if (!csv) {
+        perror("Failed to create CSV");
+        return 1;
+    }
+    fprintf(csv, "profile,quantized_size,linear_length,lut_size,linear_tolerance,lut_threshold,"
+                 "bytes,ratio,encode_us_per_mp,decode_us_per_mp,mse\n");
+    int frontier = 0;
+    for (int i = 0; i < point_count; i++) {
+        if (!points[i].pareto) continue;
+        const c21_context* t = &points[i].tunables;
+        char profile_path[512];
+        snprintf(profile_path, sizeof(profile_path), "%s%d.profile", profile_prefix, frontier++);
+        c21_context_save_profile(t, profile_path);
+        fprintf(csv, "%s,%zu,%zu,%zu,%d,%u,%zu,%.4f,%.1f,%.1f,%.6f\n",
+                profile_path, t->quantized_size, t->linear_length, t->lut_size,
+                t->linear_tolerance, t->lut_threshold, points[i].bytes,
+                (double)points[i].pixels * sizeof(Vector3D) / (double)points[i].bytes,
+                points[i].encode_us_per_mp, points[i].decode_us_per_mp, points[i].mse);
+    }
+    fclose(csv);
+    printf("%d of %d points on the Pareto frontier, written to %s\n", frontier, point_count, csv_path);
+
+    for (int s = 0; s < sequence_count; s++) {
+        free(sequences[s].frames);
+    }
+    free(sequences);
+    free(points);
+    free(line_sizes);
+    free(compressed);
+    free(reference);
+    return 0;
+}
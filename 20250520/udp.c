@@ -0,0 +1,227 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+// Batched datagram input and output of the UDP sender and receiver.
+// One sendto or recvfrom per datagram made the system calls, not the codec,
+// the limit of a full motion frame. Linux moves a batch with sendmmsg and
+// recvmmsg, and with UDP_SEGMENT and UDP_GRO a batch crosses the stack as
+// one large buffer. Other systems fall back to one call per datagram.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include "udp.h"
+
+#if defined(__linux__) && defined(UDP_SEGMENT)
+#define C21_UDP_OFFLOAD 1
+#endif
+
+int c21_udp_sender_init(c21_udp_sender* sender, int sockfd, const struct sockaddr* address,
+                        socklen_t address_length, size_t mtu, int offload) {
+    memset(sender, 0, sizeof(*sender));
+    if (address_length > sizeof(sender->address)) {
+        return 0;
+    }
+    sender->buffer = malloc(mtu * C21_SEND_BATCH);
+    if (!sender->buffer) {
+        return 0;
+    }
+    sender->sockfd = sockfd;
+    memcpy(&sender->address, address, address_length);
+    sender->address_length = address_length;
+    sender->mtu = mtu;
+    sender->batch = C21_SEND_BATCH;
+#if defined(C21_UDP_OFFLOAD)
+    // One segmented send carries at most 64 KB
+    sender->offload = offload;
+    if (offload && (int)(65507 / mtu) < sender->batch) {
+        sender->batch = (int)(65507 / mtu);
+    }
+#endif
+    return 1;
+}
+
+void c21_udp_sender_free(c21_udp_sender* sender) {
+    free(sender->buffer);
+    sender->buffer = NULL;
+}
+
+void c21_udp_send(c21_udp_sender* sender, const uint8_t* packet, size_t size) {
+    if (size > sender->mtu) {
+        fprintf(stderr, "Datagram of %zu bytes is larger than %zu\n", size, sender->mtu);
+        return;
+    }
+    memcpy(&sender->buffer[sender->count * sender->mtu], packet, size);
+    sender->sizes[sender->count++] = size;
+    if (sender->count == sender->batch) {
+        c21_udp_flush(sender);
+    }
+}
+
+#if defined(C21_UDP_OFFLOAD)
+// Function to send the batch as one buffer cut into datagrams of mtu bytes,
+// returns 0 if the kernel does not segment for this socket
+static int send_segmented(c21_udp_sender* sender) {
+    // Every datagram but the last fills its mtu bytes, the receiver ignores
+    // the padding after the segments
+    for (int i = 0; i < sender->count - 1; i++) {
+        memset(&sender->buffer[i * sender->mtu + sender->sizes[i]], 0, sender->mtu - sender->sizes[i]);
+    }
+    struct iovec iov = {sender->buffer, (sender->count - 1) * sender->mtu + sender->sizes[sender->count - 1]};
+    char control[CMSG_SPACE(sizeof(uint16_t))] = {0};
+    struct msghdr message = {0};
+    message.msg_name = &sender->address;
+    message.msg_namelen = sender->address_length;
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_UDP;
+    header->cmsg_type = UDP_SEGMENT;
+    header->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t segment_size = (uint16_t)sender->mtu;
+    memcpy(CMSG_DATA(header), &segment_size, sizeof(segment_size));
+
+    sender->syscalls++;
+    if (sendmsg(sender->sockfd, &message, 0) < 0) {
+        if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+            fprintf(stderr, "UDP segmentation offload unavailable, sending datagrams one by one\n");
+            return 0;
+        }
+        perror("UDP send failed");
+    }
+    return 1;
+}
+#endif
+
+void c21_udp_flush(c21_udp_sender* sender) {
+    if (sender->count == 0) {
+        return;
+    }
+    sender->datagrams += sender->count;
+#if defined(C21_UDP_OFFLOAD)
+    if (sender->offload && sender->count > 1) {
+        if (send_segmented(sender)) {
+            sender->count = 0;
+            return;
+        }
+        sender->offload = 0;
+    }
+#endif
+#if defined(__linux__)
+    struct mmsghdr messages[C21_SEND_BATCH];
+    struct iovec iov[C21_SEND_BATCH];
+    memset(messages, 0, sizeof(messages[0]) * sender->count);
+    for (int i = 0; i < sender->count; i++) {
+        iov[i].iov_base = &sender->buffer[i * sender->mtu];
+        iov[i].iov_len = sender->sizes[i];
+        messages[i].msg_hdr.msg_name = &sender->address;
+        messages[i].msg_hdr.msg_namelen = sender->address_length;
+        messages[i].msg_hdr.msg_iov = &iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    // A full socket buffer may take only part of the batch
+    int sent = 0;
+    while (sent < sender->count) {
+        sender->syscalls++;
+        int result = sendmmsg(sender->sockfd, &messages[sent], sender->count - sent, 0);
+        if (result <= 0) {
+            perror("UDP send failed");
+            break;
+        }
+        sent += result;
+    }
+#else
+    for (int i = 0; i < sender->count; i++) {
+        sender->syscalls++;
+        if (sendto(sender->sockfd, &sender->buffer[i * sender->mtu], sender->sizes[i], 0,
+                   (struct sockaddr*)&sender->address, sender->address_length) < 0) {
+            perror("UDP send failed");
+        }
+    }
+#endif
+    sender->count = 0;
+}
+
+void c21_udp_receiver_init(c21_udp_receiver* receiver, int sockfd, int offload) {
+    receiver->sockfd = sockfd;
+    receiver->offload = 0;
+    receiver->syscalls = 0;
+#if defined(C21_UDP_OFFLOAD) && defined(UDP_GRO)
+    int enable = 1;
+    if (offload && setsockopt(sockfd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0) {
+        receiver->offload = 1;
+    }
+#endif
+}
+
+int c21_udp_receive(c21_udp_receiver* receiver, uint8_t** buffers, size_t buffer_size, int count,
+                    size_t* sizes, size_t* datagram_sizes, struct sockaddr_in* sources) {
+#if defined(__linux__)
+    struct mmsghdr messages[C21_RECEIVE_BATCH];
+    struct iovec iov[C21_RECEIVE_BATCH];
+    char control[C21_RECEIVE_BATCH][CMSG_SPACE(sizeof(int))];
+    if (count > C21_RECEIVE_BATCH) {
+        count = C21_RECEIVE_BATCH;
+    }
+    memset(messages, 0, sizeof(messages[0]) * count);
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = buffers[i];
+        iov[i].iov_len = buffer_size;
+        messages[i].msg_hdr.msg_iov = &iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        if (sources) {
+            messages[i].msg_hdr.msg_name = &sources[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+        }
+        if (receiver->offload) {
+            messages[i].msg_hdr.msg_control = control[i];
+            messages[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+    }
+    receiver->syscalls++;
+    int received = recvmmsg(receiver->sockfd, messages, count, MSG_WAITFORONE, NULL);
+    for (int i = 0; i < received; i++) {
+        sizes[i] = messages[i].msg_len;
+        datagram_sizes[i] = messages[i].msg_len;
+#if defined(C21_UDP_OFFLOAD) && defined(UDP_GRO)
+        // Coalesced datagrams say how large each of them was
+        struct msghdr* message = &messages[i].msg_hdr;
+        for (struct cmsghdr* header = CMSG_FIRSTHDR(message); header; header = CMSG_NXTHDR(message, header)) {
+            if (header->cmsg_level == SOL_UDP && header->cmsg_type == UDP_GRO) {
+                int segment_size;
+                memcpy(&segment_size, CMSG_DATA(header), sizeof(segment_size));
+                if (segment_size > 0) {
+                    datagram_sizes[i] = (size_t)segment_size;
+                }
+            }
+        }
+#endif
+    }
+    return received;
+#else
+    (void)count;
+    receiver->syscalls++;
+    socklen_t source_length = sizeof(struct sockaddr_in);
+    ssize_t received = recvfrom(receiver->sockfd, buffers[0], buffer_size, 0, (struct sockaddr*)sources,
+                                sources ? &source_length : NULL);
+    if (received < 0) {
+        return -1;
+    }
+    sizes[0] = datagram_sizes[0] = (size_t)received;
+    return 1;
+#endif
+}
@@ -0,0 +1,69 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+#ifndef UDP_H
+#define UDP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Datagrams sent with one system call at most
+#define C21_SEND_BATCH 32
+// Datagrams received with one system call at most
+#define C21_RECEIVE_BATCH 16
+
+// Datagrams queued for one sendmmsg call. With segmentation offload the
+// datagrams are laid out mtu bytes apart and padded, so a single sendmsg
+// carries the batch and the kernel or the network card cuts it up.
+typedef struct {
+    int sockfd;
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    uint8_t* buffer;               // C21_SEND_BATCH datagrams of mtu bytes
+    size_t mtu;
+    size_t sizes[C21_SEND_BATCH];
+    int count;
+    int batch;                     // Datagrams of a full batch
+    int offload;                   // UDP_SEGMENT in use, cleared if the kernel refuses it
+    size_t syscalls;
+    size_t datagrams;
+} c21_udp_sender;
+
+// Prepares batches of datagrams of up to mtu bytes to address.
+// Offload asks for UDP_SEGMENT where the kernel has it. Returns 0 on failure.
+int c21_udp_sender_init(c21_udp_sender* sender, int sockfd, const struct sockaddr* address,
+                        socklen_t address_length, size_t mtu, int offload);
+void c21_udp_sender_free(c21_udp_sender* sender);
+// Queues a datagram, sending the batch once it is full
+void c21_udp_send(c21_udp_sender* sender, const uint8_t* packet, size_t size);
+// Sends the datagrams queued so far
+void c21_udp_flush(c21_udp_sender* sender);
+
+// Receives batches of datagrams with recvmmsg. With receive offload one
+// buffer may hold several datagrams of the same size back to back.
+typedef struct {
+    int sockfd;
+    int offload;                   // UDP_GRO in use
+    size_t syscalls;
+} c21_udp_receiver;
+
+// Prepares receiving from a bound socket. Offload asks for UDP_GRO, the
+// buffers must then be 64 KB.
+void c21_udp_receiver_init(c21_udp_receiver* receiver, int sockfd, int offload);
+// Waits for at least one datagram and receives up to count of them into
+// buffers of buffer_size bytes. Sizes get the bytes of every buffer and
+// datagram_sizes the size of the datagrams it holds, the last one may be
+// shorter. Sources get the sender of every buffer unless it is NULL.
+// Returns the number of buffers filled, or -1 on error.
+int c21_udp_receive(c21_udp_receiver* receiver, uint8_t** buffers, size_t buffer_size, int count,
+                    size_t* sizes, size_t* datagram_sizes, struct sockaddr_in* sources);
+
+#endif
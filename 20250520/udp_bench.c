@@ -0,0 +1,181 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+/*
+gcc -O2 -o udp_bench.out udp_bench.c udp.c -lpthread && ./udp_bench.out > udp_bench.csv
+*/
+
+// Datagrams per second over loopback with one system call per datagram,
+// with sendmmsg and recvmmsg, and with segmentation and receive offload.
+// A sender thread sends datagrams of the default transport size as fast as
+// it can for a while, the receiver counts what arrives. The received rate
+// is the ceiling of the method, loopback drops what the receiver misses.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "udp.h"
+
+#define DATAGRAM_SIZE 1200
+#define RUN_SECONDS 1.0
+#define RECEIVE_BUFFER_SIZE 65536
+
+typedef enum {
+    MODE_SINGLE,    // sendto and recvfrom
+    MODE_BATCH,     // sendmmsg and recvmmsg
+    MODE_OFFLOAD,   // UDP_SEGMENT and UDP_GRO on top of the batches
+} BenchMode;
+
+typedef struct {
+    int sockfd;
+    BenchMode mode;
+    atomic_int stopping;
+    size_t datagrams;
+    size_t syscalls;
+    int offload;
+} ReceiveState;
+
+static double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void* receive_thread(void* arg) {
+    ReceiveState* state = (ReceiveState*)arg;
+    uint8_t* memory = malloc(RECEIVE_BUFFER_SIZE * C21_RECEIVE_BATCH);
+    if (!memory) {
+        return NULL;
+    }
+    uint8_t* buffers[C21_RECEIVE_BATCH];
+    for (int i = 0; i < C21_RECEIVE_BATCH; i++) {
+        buffers[i] = &memory[i * RECEIVE_BUFFER_SIZE];
+    }
+    c21_udp_receiver receiver;
+    c21_udp_receiver_init(&receiver, state->sockfd, state->mode == MODE_OFFLOAD);
+    state->offload = receiver.offload;
+
+    while (!atomic_load(&state->stopping)) {
+        if (state->mode == MODE_SINGLE) {
+            state->syscalls++;
+            if (recvfrom(state->sockfd, buffers[0], RECEIVE_BUFFER_SIZE, 0, NULL, NULL) > 0) {
+                state->datagrams++;
+            }
+            continue;
+        }
+        size_t sizes[C21_RECEIVE_BATCH], datagram_sizes[C21_RECEIVE_BATCH];
+        int received = c21_udp_receive(&receiver, buffers, RECEIVE_BUFFER_SIZE, C21_RECEIVE_BATCH,
+                                       sizes, datagram_sizes, NULL);
+        for (int i = 0; i < received; i++) {
+            state->datagrams += (sizes[i] + datagram_sizes[i] - 1) / datagram_sizes[i];
+        }
+    }
+    if (state->mode != MODE_SINGLE) {
+        state->syscalls = receiver.syscalls;
+    }
+    free(memory);
+    return NULL;
+}
+
+// Function to run one method, prints a CSV row
+static void run_mode(BenchMode mode, const char* name) {
+    int receive_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    int send_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (receive_socket < 0 || send_socket < 0) {
+        perror("Socket creation failed");
+        exit(1);
+    }
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    socklen_t address_length = sizeof(address);
+    int buffer_size = 8 << 20;
+    setsockopt(receive_socket, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    // The receiver checks for the end of the run every 100 ms
+    struct timeval timeout = {0, 100000};
+    setsockopt(receive_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (bind(receive_socket, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        getsockname(receive_socket, (struct sockaddr*)&address, &address_length) < 0) {
+        perror("Bind failed");
+        exit(1);
+    }
+
+    ReceiveState state;
+    memset(&state, 0, sizeof(state));
+    state.sockfd = receive_socket;
+    state.mode = mode;
+    atomic_init(&state.stopping, 0);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, receive_thread, &state) != 0) {
+        perror("Failed to create receive thread");
+        exit(1);
+    }
+
+    c21_udp_sender sender;
+    if (!c21_udp_sender_init(&sender, send_socket, (struct sockaddr*)&address, address_length,
+                             DATAGRAM_SIZE, mode == MODE_OFFLOAD)) {
+        fprintf(stderr, "Failed to allocate the send batch\n");
+        exit(1);
+    }
+    uint8_t datagram[DATAGRAM_SIZE];
+    memset(datagram, 0x5A, sizeof(datagram));
+
+    size_t sent = 0, send_calls = 0;
+    double start = now_seconds();
+    double elapsed = 0.0;
+    while (elapsed < RUN_SECONDS) {
+        // A frame worth of datagrams between clock reads
+        for (int i = 0; i < C21_SEND_BATCH * 4; i++) {
+            if (mode == MODE_SINGLE) {
+                send_calls++;
+                sendto(send_socket, datagram, sizeof(datagram), 0, (struct sockaddr*)&address, address_length);
+            } else {
+                c21_udp_send(&sender, datagram, sizeof(datagram));
+            }
+            sent++;
+        }
+        elapsed = now_seconds() - start;
+    }
+    c21_udp_flush(&sender);
+    elapsed = now_seconds() - start;
+    if (mode != MODE_SINGLE) {
+        send_calls = sender.syscalls;
+    }
+
+    // Whatever is still queued on loopback arrives right away
+    usleep(200000);
+    atomic_store(&state.stopping, 1);
+    pthread_join(thread, NULL);
+
+    printf("%s,%d,%zu,%zu,%.3f,%.0f,%zu,%zu,%d\n", name, DATAGRAM_SIZE, sent, state.datagrams, elapsed,
+           state.datagrams / elapsed, send_calls, state.syscalls,
+           mode == MODE_OFFLOAD && sender.offload && state.offload);
+    fflush(stdout);
+
+    c21_udp_sender_free(&sender);
+    close(send_socket);
+    close(receive_socket);
+}
+
+int main(void) {
+    printf("method,datagram_bytes,sent,received,seconds,received_per_s,send_calls,receive_calls,offload\n");
+    run_mode(MODE_SINGLE, "single");
+    run_mode(MODE_BATCH, "batch");
+    run_mode(MODE_OFFLOAD, "offload");
+    return 0;
+}
@@ -0,0 +1,361 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+// io_uring transport of the UDP sender and receiver.
+// The sender copies datagrams into slots and submits the sends of a band of
+// lines as one linked chain, so a band costs one system call and the
+// encoder never waits for the socket. The receiver arms one multishot
+// receive over a ring of decode pool buffers it registers with the kernel,
+// so datagrams land without a system call each and the receiving thread
+// only collects completions. The rings are set up with the system calls
+// directly, the program does not need liburing.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+#define C21_URING_BUFFER_GROUP 0
+
+// Function to map the rings of a new io_uring instance, returns 0 on failure
+static int ring_init(c21_uring* ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return 0;
+    }
+
+    ring->sq_memory_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_memory_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && ring->cq_memory_size > ring->sq_memory_size) {
+        ring->sq_memory_size = ring->cq_memory_size;
+    }
+    ring->sq_memory = mmap(NULL, ring->sq_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_memory == MAP_FAILED) {
+        close(ring->fd);
+        return 0;
+    }
+    if (single_mmap) {
+        ring->cq_memory = ring->sq_memory;
+        ring->cq_memory_size = 0;
+    } else {
+        ring->cq_memory = mmap(NULL, ring->cq_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_memory == MAP_FAILED) {
+            munmap(ring->sq_memory, ring->sq_memory_size);
+            close(ring->fd);
+            return 0;
+        }
+    }
+    ring->sqe_memory_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqe_memory = mmap(NULL, ring->sqe_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_SQES);
+    if (ring->sqe_memory == MAP_FAILED) {
+        if (ring->cq_memory_size) {
+            munmap(ring->cq_memory, ring->cq_memory_size);
+        }
+        munmap(ring->sq_memory, ring->sq_memory_size);
+        close(ring->fd);
+        return 0;
+    }
+
+    uint8_t* sq = ring->sq_memory;
+    uint8_t* cq = ring->cq_memory;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->sqes = ring->sqe_memory;
+    ring->cqes = cq + params.cq_off.cqes;
+    return 1;
+}
+
+static void ring_free(c21_uring* ring) {
+    munmap(ring->sqe_memory, ring->sqe_memory_size);
+    if (ring->cq_memory_size) {
+        munmap(ring->cq_memory, ring->cq_memory_size);
+    }
+    munmap(ring->sq_memory, ring->sq_memory_size);
+    close(ring->fd);
+}
+
+// Function to take the next submission entry, NULL if the ring is full.
+// The kernel reads the entry at the next ring_submit, not before, so it may
+// still be filled in after the tail moved.
+static struct io_uring_sqe* ring_entry(c21_uring* ring) {
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head > ring->sq_mask) {
+        return NULL;
+    }
+    struct io_uring_sqe* entry = &((struct io_uring_sqe*)ring->sqes)[tail & ring->sq_mask];
+    memset(entry, 0, sizeof(*entry));
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return entry;
+}
+
+// Function to hand the queued entries to the kernel, waiting for wait completions
+static int ring_submit(c21_uring* ring, unsigned wait) {
+    ring->syscalls++;
+    int result = (int)syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait,
+                              wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (result >= 0) {
+        ring->queued -= (unsigned)result < ring->queued ? (unsigned)result : ring->queued;
+    }
+    return result;
+}
+
+// Function to take the next completion, returns 0 if there is none
+static int ring_completion(c21_uring* ring, struct io_uring_cqe* completion) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    *completion = ((struct io_uring_cqe*)ring->cqes)[head & ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int c21_uring_sender_init(c21_uring_sender* sender, int sockfd, size_t mtu) {
+    memset(sender, 0, sizeof(*sender));
+    if (!ring_init(&sender->ring, C21_URING_ENTRIES)) {
+        return 0;
+    }
+    sender->slots = malloc(mtu * C21_URING_ENTRIES);
+    if (!sender->slots) {
+        ring_free(&sender->ring);
+        return 0;
+    }
+    sender->sockfd = sockfd;
+    sender->mtu = mtu;
+    for (int i = 0; i < C21_URING_ENTRIES; i++) {
+        sender->free_slots[i] = C21_URING_ENTRIES - 1 - i;
+    }
+    sender->free_count = C21_URING_ENTRIES;
+    sender->link_last = -1;
+    return 1;
+}
+
+// Function to give the slots of completed sends back
+static void reap_sends(c21_uring_sender* sender) {
+    struct io_uring_cqe completion;
+    while (ring_completion(&sender->ring, &completion)) {
+        if (completion.res < 0 && completion.res != -ECANCELED) {
+            fprintf(stderr, "UDP send failed: %s\n", strerror(-completion.res));
+        }
+        sender->free_slots[sender->free_count++] = (int)completion.user_data;
+    }
+}
+
+// Function to submit the open band, the chain ends with its last entry
+static void submit_band(c21_uring_sender* sender, unsigned wait) {
+    if (sender->link_last >= 0) {
+        ((struct io_uring_sqe*)sender->ring.sqes)[sender->link_last].flags &= ~IOSQE_IO_LINK;
+        sender->link_last = -1;
+    }
+    if (ring_submit(&sender->ring, wait) < 0) {
+        perror("io_uring submit failed");
+    }
+}
+
+void c21_uring_send(c21_uring_sender* sender, const uint8_t* packet, size_t size) {
+    if (size > sender->mtu) {
+        fprintf(stderr, "Datagram of %zu bytes is larger than %zu\n", size, sender->mtu);
+        return;
+    }
+    // Every slot in flight, wait for the kernel to finish some
+    reap_sends(sender);
+    while (sender->free_count == 0) {
+        submit_band(sender, 1);
+        reap_sends(sender);
+    }
+    int slot = sender->free_slots[--sender->free_count];
+    uint8_t* data = &sender->slots[slot * sender->mtu];
+    memcpy(data, packet, size);
+
+    struct io_uring_sqe* entry = ring_entry(&sender->ring);
+    entry->opcode = IORING_OP_SEND;
+    entry->fd = sender->sockfd;
+    entry->addr = (uint64_t)(uintptr_t)data;
+    entry->len = (uint32_t)size;
+    entry->user_data = (uint64_t)slot;
+    // The previous send of the band leaves before this one
+    if (sender->link_last >= 0) {
+        ((struct io_uring_sqe*)sender->ring.sqes)[sender->link_last].flags |= IOSQE_IO_LINK;
+    }
+    sender->link_last = (int)(entry - (struct io_uring_sqe*)sender->ring.sqes);
+    sender->datagrams++;
+}
+
+void c21_uring_flush(c21_uring_sender* sender) {
+    if (sender->ring.queued > 0) {
+        submit_band(sender, 0);
+    }
+    reap_sends(sender);
+}
+
+void c21_uring_sender_free(c21_uring_sender* sender) {
+    // Wait for the sends still using the slots
+    c21_uring_flush(sender);
+    while (sender->free_count < C21_URING_ENTRIES) {
+        submit_band(sender, 1);
+        reap_sends(sender);
+    }
+    ring_free(&sender->ring);
+    free(sender->slots);
+}
+
+// Function to register a buffer with the kernel under its buffer id
+static void provide_buffer(c21_uring_receiver* receiver, int id) {
+    struct io_uring_buf_ring* ring = receiver->buffer_ring;
+    struct io_uring_buf* buffer = &ring->bufs[receiver->buffer_tail & (C21_URING_RECEIVE_BUFFERS - 1)];
+    buffer->addr = (uint64_t)(uintptr_t)receiver->buffers[id];
+    buffer->len = (uint32_t)c21_decode_pool_buffer_size(receiver->pool);
+    buffer->bid = (uint16_t)id;
+    receiver->buffer_tail++;
+    __atomic_store_n(&ring->tail, receiver->buffer_tail, __ATOMIC_RELEASE);
+}
+
+// Function to queue the multishot receive, it keeps completing until the buffers run out
+static void arm_receive(c21_uring_receiver* receiver) {
+    struct io_uring_sqe* entry = ring_entry(&receiver->ring);
+    if (!entry) {
+        return;
+    }
+    entry->opcode = IORING_OP_RECVMSG;
+    entry->fd = receiver->sockfd;
+    entry->addr = (uint64_t)(uintptr_t)&receiver->message;
+    entry->len = 1;
+    entry->ioprio = IORING_RECV_MULTISHOT;
+    entry->flags = IOSQE_BUFFER_SELECT;
+    entry->buf_group = C21_URING_BUFFER_GROUP;
+    receiver->armed = 1;
+}
+
+int c21_uring_receiver_init(c21_uring_receiver* receiver, int sockfd, c21_decode_pool* pool) {
+    memset(receiver, 0, sizeof(*receiver));
+    if (!ring_init(&receiver->ring, C21_URING_ENTRIES)) {
+        return 0;
+    }
+    receiver->sockfd = sockfd;
+    receiver->pool = pool;
+    receiver->message.msg_namelen = sizeof(struct sockaddr_in);
+    receiver->buffer_ring_size = C21_URING_RECEIVE_BUFFERS * sizeof(struct io_uring_buf);
+    receiver->buffer_ring = mmap(NULL, receiver->buffer_ring_size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (receiver->buffer_ring == MAP_FAILED) {
+        ring_free(&receiver->ring);
+        return 0;
+    }
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t)(uintptr_t)receiver->buffer_ring;
+    registration.ring_entries = C21_URING_RECEIVE_BUFFERS;
+    registration.bgid = C21_URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, receiver->ring.fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        munmap(receiver->buffer_ring, receiver->buffer_ring_size);
+        ring_free(&receiver->ring);
+        return 0;
+    }
+    for (int id = 0; id < C21_URING_RECEIVE_BUFFERS; id++) {
+        receiver->buffers[id] = c21_decode_pool_buffer(pool);
+        provide_buffer(receiver, id);
+    }
+    arm_receive(receiver);
+    return 1;
+}
+
+void c21_uring_receiver_free(c21_uring_receiver* receiver) {
+    // Closing the ring cancels the receive before the buffers go back
+    ring_free(&receiver->ring);
+    munmap(receiver->buffer_ring, receiver->buffer_ring_size);
+    for (int id = 0; id < C21_URING_RECEIVE_BUFFERS; id++) {
+        if (receiver->buffers[id]) {
+            c21_decode_pool_release(receiver->pool, receiver->buffers[id]);
+        }
+    }
+}
+
+int c21_uring_receive(c21_uring_receiver* receiver, uint8_t** buffers, uint8_t** packets, size_t* sizes,
+                      struct sockaddr_in* sources, int count) {
+    // Buffers handed out by the previous call are the caller's, fill their places
+    for (int id = 0; id < C21_URING_RECEIVE_BUFFERS; id++) {
+        if (!receiver->buffers[id]) {
+            receiver->buffers[id] = c21_decode_pool_buffer(receiver->pool);
+            provide_buffer(receiver, id);
+        }
+    }
+    if (!receiver->armed) {
+        arm_receive(receiver);
+    }
+
+    int received = 0;
+    while (received == 0) {
+        struct io_uring_cqe completion;
+        if (receiver->ring.queued > 0 || !ring_completion(&receiver->ring, &completion)) {
+            // Nothing completed yet, wait for the kernel
+            if (ring_submit(&receiver->ring, 1) < 0 && errno != EINTR) {
+                return -1;
+            }
+            continue;
+        }
+        do {
+            if (!(completion.flags & IORING_CQE_F_MORE)) {
+                receiver->armed = 0;
+            }
+            if (completion.res < 0) {
+                if (completion.res != -ENOBUFS) {
+                    fprintf(stderr, "UDP receive failed: %s\n", strerror(-completion.res));
+                }
+                continue;
+            }
+            if (completion.flags & IORING_CQE_F_BUFFER) {
+                // The buffer starts with the lengths, then the address and the datagram
+                int id = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+                uint8_t* buffer = receiver->buffers[id];
+                struct io_uring_recvmsg_out out;
+                memcpy(&out, buffer, sizeof(out));
+                size_t name_offset = sizeof(out);
+                size_t payload_offset = name_offset + receiver->message.msg_namelen;
+                receiver->buffers[id] = NULL;
+                if ((size_t)completion.res < payload_offset || (out.flags & MSG_TRUNC) ||
+                    out.payloadlen > (size_t)completion.res - payload_offset) {
+                    // A datagram larger than the buffer, dropped like a lost one
+                    c21_decode_pool_release(receiver->pool, buffer);
+                    continue;
+                }
+                memset(&sources[received], 0, sizeof(sources[received]));
+                memcpy(&sources[received], &buffer[name_offset],
+                       out.namelen < sizeof(sources[received]) ? out.namelen : sizeof(sources[received]));
+                buffers[received] = buffer;
+                packets[received] = &buffer[payload_offset];
+                sizes[received++] = out.payloadlen;
+            }
+        } while (received < count && ring_completion(&receiver->ring, &completion));
+        if (received == 0 && !receiver->armed) {
+            arm_receive(receiver);
+        }
+    }
+    return received;
+}
@@ -0,0 +1,98 @@
+// This document is Licensed under Creative Commons CC0.
+// To the extent possible under law, the author(s) have dedicated all copyright and related and neighboring rights
+// to this document to the public domain worldwide.
+// This document is distributed without any warranty.
+// You should have received a copy of the CC0 Public Domain Dedication along with this document.
+// If not, see https://creativecommons.org/publicdomain/zero/1.0/legalcode.
+
+// Disclaimer: Patent rights reserved regardless of the license above
+
+#ifndef URING_H
+#define URING_H
+
+// io_uring transport of the UDP sender and receiver, built with -DC21_WITH_IO_URING.
+// It talks to the kernel directly, so it needs the Linux headers only.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "pool.h"
+
+// Datagrams in flight to the kernel at most, a power of two
+#define C21_URING_ENTRIES 64
+// Decode pool buffers the receiver keeps registered, a power of two below
+// the buffers of the pool so decoding never waits for the ring
+#define C21_URING_RECEIVE_BUFFERS 16
+
+// Submission and completion rings shared with the kernel
+typedef struct {
+    int fd;
+    void* sq_memory;
+    size_t sq_memory_size;
+    void* cq_memory;
+    size_t cq_memory_size;
+    void* sqe_memory;
+    size_t sqe_memory_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    void* sqes;
+    void* cqes;
+    unsigned queued;       // Entries prepared and not submitted yet
+    size_t syscalls;
+} c21_uring;
+
+// Sends datagrams on a connected socket. Datagrams are copied into slots
+// that stay untouched until the kernel completes them, and the sends of a
+// band are linked so they leave in order with one system call.
+typedef struct {
+    c21_uring ring;
+    int sockfd;
+    uint8_t* slots;        // C21_URING_ENTRIES datagrams of mtu bytes
+    size_t mtu;
+    int free_slots[C21_URING_ENTRIES];
+    int free_count;
+    int link_last;         // Index of the last entry of the open band, -1 if none
+    size_t datagrams;
+} c21_uring_sender;
+
+// Returns 0 if the kernel has no io_uring or memory runs out
+int c21_uring_sender_init(c21_uring_sender* sender, int sockfd, size_t mtu);
+void c21_uring_sender_free(c21_uring_sender* sender);
+// Queues a datagram as the next link of the band
+void c21_uring_send(c21_uring_sender* sender, const uint8_t* packet, size_t size);
+// Submits the band queued so far without waiting for it
+void c21_uring_flush(c21_uring_sender* sender);
+
+// Receives with one multishot receive into decode pool buffers registered
+// with the kernel as a provided buffer ring. Datagrams complete without a
+// system call each, the receiving thread collects what completed. The
+// kernel writes the sender address in front of every datagram.
+typedef struct {
+    c21_uring ring;
+    int sockfd;
+    c21_decode_pool* pool;
+    void* buffer_ring;          // Shared with the kernel, C21_URING_RECEIVE_BUFFERS entries
+    size_t buffer_ring_size;
+    uint8_t* buffers[C21_URING_RECEIVE_BUFFERS];  // Buffer of every buffer id, NULL once handed out
+    uint16_t buffer_tail;
+    int armed;                  // Whether the multishot receive is active
+    struct msghdr message;      // Room the kernel leaves for the address in every buffer
+} c21_uring_receiver;
+
+// Returns 0 if the kernel has no io_uring, multishot receive or buffer rings
+int c21_uring_receiver_init(c21_uring_receiver* receiver, int sockfd, c21_decode_pool* pool);
+void c21_uring_receiver_free(c21_uring_receiver* receiver);
+// Waits for at least one datagram and returns up to count of them, the
+// datagram of packets[i] is inside buffers[i] and came from sources[i]. The
+// caller holds every buffer and releases it to the decode pool, the ring
+// gets a free pool buffer in its place. Returns -1 on error.
+int c21_uring_receive(c21_uring_receiver* receiver, uint8_t** buffers, uint8_t** packets, size_t* sizes,
+                      struct sockaddr_in* sources, int count);
+
+#endif
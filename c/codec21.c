@@ -612,6 +612,52 @@ size_t encode_block(const Vector3D* input, const Vector3D* reference,
     return output_pos;
 }
 
+// Function to divide rounding towards negative infinity, divisor is positive
+int32_t floor_divide(int32_t dividend, int32_t divisor) {
+    int32_t quotient = dividend / divisor;
+    if (dividend % divisor != 0 && dividend < 0) {
+        quotient--;
+    }
+    return quotient;
+}
+
+// Function to interpolate a linear block using integers only.
+// Pixel i of a block of n pixels is start + floor(i * (end - start) / (n - 1))
+// on each channel, evaluated as a DDA of whole and fractional steps.
+void interpolate_linear(Vector3D start, Vector3D end, size_t length, Vector3D* output) {
+    if (length == 0) {
+        return;
+    }
+    if (length == 1) {
+        output[0] = start;
+        return;
+    }
+
+    const int32_t steps = (int32_t)length - 1;
+    const uint8_t* first = (const uint8_t*)&start;
+    const uint8_t* last = (const uint8_t*)&end;
+    int32_t value[3], remainder[3], whole[3], fraction[3];
+    for (int c = 0; c < 3; c++) {
+        int32_t delta = (int32_t)last[c] - (int32_t)first[c];
+        value[c] = first[c];
+        remainder[c] = 0;
+        whole[c] = floor_divide(delta, steps);
+        fraction[c] = delta - whole[c] * steps;
+    }
+    for (size_t i = 0; i < length; i++) {
+        uint8_t* out = (uint8_t*)&output[i];
+        for (int c = 0; c < 3; c++) {
+            out[c] = (uint8_t)value[c];
+            value[c] += whole[c];
+            remainder[c] += fraction[c];
+            if (remainder[c] >= steps) {
+                remainder[c] -= steps;
+                value[c]++;
+            }
+        }
+    }
+}
+
 // Main decoding function that handles all block types
 size_t decode_blocks(const uint8_t* input, size_t input_size, 
                     Vector3D* output, const Vector3D* reference) {
@@ -639,12 +685,7 @@ size_t decode_blocks(const uint8_t* input, size_t input_size,
                 input_pos += sizeof(Vector3D);
                 
                 // Interpolate points
-                for (int i = 0; i < length; i++) {
-                    float t = ((float)i) / (float)(length - 1);
-                    output[output_pos + i].x = start.x + t * (end.x - start.x);
-                    output[output_pos + i].y = start.y + t * (end.y - start.y);
-                    output[output_pos + i].z = start.z + t * (end.z - start.z);
-                }
+                interpolate_linear(start, end, length, &output[output_pos]);
                 output_pos += length;
                 break;
             }
@@ -2,11 +2,17 @@ package codec21
 
 import (
 	"bufio"
+	"bytes"
 	"fmt"
 	"image"
 	"image/png"
 	"os"
+	"path/filepath"
+	"regexp"
+	"sort"
+	"strconv"
 	"testing"
+	"time"
 
 	_ "image/png"
 )
@@ -284,6 +290,185 @@ func testLookupTableMethod(t *testing.T, bits uint8, size uint8) {
 	referencePtr = verifyImage(img, postfix, referencePtr)
 }
 
+// Golden corpus thresholds. Override them with the environment variables of the same name.
+//
+// CODEC21_GOLDEN_MAX_DIFF is the largest channel difference allowed between a decoded stream and its png.
+// CODEC21_GOLDEN_MIN_MPIXS is the slowest decode throughput in megapixels per second any stream type may have.
+// CODEC21_GOLDEN_BASELINE names a csv of type,mpixs lines written by an earlier run with CODEC21_GOLDEN_UPDATE=1,
+// a stream type fails when it decodes slower than CODEC21_GOLDEN_TOLERANCE times its baseline.
+const goldenMaxDiff = 0
+const goldenMinMPixs = 1.0
+const goldenTolerance = 0.5
+const goldenDecodeRepeats = 3
+
+var goldenStream = regexp.MustCompile(`^testout_([a-z]+[0-9]?)(?:_([0-9]+)ms)?\.c21$`)
+
+type goldenFrame struct {
+	ms   int
+	name string
+}
+
+// Decodes every golden stream in testpath/testout and compares it to the png next to it.
+// Progressive streams (full_*ms, quantized_*ms) are decoded in order over the previous frame.
+func TestCODEC21GoldenCorpus(t *testing.T) {
+	files, err := filepath.Glob("testpath/testout/testout_*.c21")
+	if err != nil || len(files) == 0 {
+		t.Skip("no golden streams in testpath/testout")
+	}
+
+	sequences := map[string][]goldenFrame{}
+	for _, file := range files {
+		m := goldenStream.FindStringSubmatch(filepath.Base(file))
+		if m == nil {
+			continue
+		}
+		ms, _ := strconv.Atoi(m[2])
+		sequences[m[1]] = append(sequences[m[1]], goldenFrame{ms: ms, name: file})
+	}
+	types := make([]string, 0, len(sequences))
+	for kind := range sequences {
+		types = append(types, kind)
+	}
+	sort.Strings(types)
+
+	maxDiff := goldenEnvFloat(t, "CODEC21_GOLDEN_MAX_DIFF", goldenMaxDiff)
+	minMPixs := goldenEnvFloat(t, "CODEC21_GOLDEN_MIN_MPIXS", goldenMinMPixs)
+	tolerance := goldenEnvFloat(t, "CODEC21_GOLDEN_TOLERANCE", goldenTolerance)
+	baseline := goldenReadBaseline(t, os.Getenv("CODEC21_GOLDEN_BASELINE"))
+
+	measured := map[string]float64{}
+	for _, kind := range types {
+		frames := sequences[kind]
+		sort.Slice(frames, func(i, j int) bool { return frames[i].ms < frames[j].ms })
+
+		var pixels int
+		var elapsed time.Duration
+		var reference *Image
+		for _, frame := range frames {
+			expected, err := goldenReadPNG(frame.name[:len(frame.name)-len(".c21")] + ".png")
+			if err != nil {
+				t.Fatalf("%s: %v", frame.name, err)
+			}
+			bounds := expected.Bounds()
+			if reference == nil {
+				blank := NewImageRGBA(image.NewRGBA(bounds))
+				reference = &blank
+			}
+			stream, err := os.ReadFile(frame.name)
+			if err != nil {
+				t.Fatal(err)
+			}
+
+			var decoded *RGBAImage
+			var fastest time.Duration
+			for i := 0; i < goldenDecodeRepeats; i++ {
+				start := time.Now()
+				decoded, err = Decompress(bounds, bufio.NewReader(bytes.NewReader(stream)), reference)
+				took := time.Since(start)
+				if err != nil {
+					t.Fatalf("%s: %v", frame.name, err)
+				}
+				if i == 0 || took < fastest {
+					fastest = took
+				}
+			}
+			elapsed += fastest
+			pixels += bounds.Dx() * bounds.Dy()
+
+			if diff, at := goldenCompare(decoded, expected); float64(diff) > maxDiff {
+				t.Errorf("%s: channel differs by %v at %v", frame.name, diff, at)
+			}
+			current := Image(decoded)
+			reference = &current
+		}
+
+		mpixs := float64(pixels) / elapsed.Seconds() / 1e6
+		measured[kind] = mpixs
+		t.Logf("%-10s %2d streams %8.2f MPix/s", kind, len(frames), mpixs)
+		if mpixs < minMPixs {
+			t.Errorf("%s: decodes at %.2f MPix/s, below %.2f", kind, mpixs, minMPixs)
+		}
+		if expected, ok := baseline[kind]; ok && mpixs < expected*tolerance {
+			t.Errorf("%s: decodes at %.2f MPix/s, baseline %.2f", kind, mpixs, expected)
+		}
+	}
+
+	if os.Getenv("CODEC21_GOLDEN_UPDATE") == "1" && os.Getenv("CODEC21_GOLDEN_BASELINE") != "" {
+		var out bytes.Buffer
+		for _, kind := range types {
+			_, _ = fmt.Fprintf(&out, "%s,%.2f\n", kind, measured[kind])
+		}
+		if err := os.WriteFile(os.Getenv("CODEC21_GOLDEN_BASELINE"), out.Bytes(), 0600); err != nil {
+			t.Fatal(err)
+		}
+	}
+}
+
+func goldenEnvFloat(t *testing.T, name string, fallback float64) float64 {
+	value := os.Getenv(name)
+	if value == "" {
+		return fallback
+	}
+	f, err := strconv.ParseFloat(value, 64)
+	if err != nil {
+		t.Fatalf("%s: %v", name, err)
+	}
+	return f
+}
+
+func goldenReadBaseline(t *testing.T, path string) map[string]float64 {
+	baseline := map[string]float64{}
+	if path == "" || os.Getenv("CODEC21_GOLDEN_UPDATE") == "1" {
+		return baseline
+	}
+	data, err := os.ReadFile(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	for _, line := range bytes.Split(data, []byte("\n")) {
+		fields := bytes.Split(bytes.TrimSpace(line), []byte(","))
+		if len(fields) != 2 {
+			continue
+		}
+		f, err := strconv.ParseFloat(string(fields[1]), 64)
+		if err != nil {
+			t.Fatalf("%s: %v", path, err)
+		}
+		baseline[string(fields[0])] = f
+	}
+	return baseline
+}
+
+func goldenReadPNG(name string) (image.Image, error) {
+	pngFile, err := os.Open(name)
+	if err != nil {
+		return nil, err
+	}
+	defer func() { _ = pngFile.Close() }()
+	return png.Decode(bufio.NewReader(pngFile))
+}
+
+// Returns the largest red, green or blue difference and where it is
+func goldenCompare(decoded *RGBAImage, expected image.Image) (int, image.Point) {
+	worst, at := 0, image.Point{}
+	bounds := expected.Bounds()
+	for y := bounds.Min.Y; y < bounds.Max.Y; y++ {
+		for x := bounds.Min.X; x < bounds.Max.X; x++ {
+			r, g, b := decoded.At(x, y)
+			er, eg, eb, _ := expected.At(x, y).RGBA()
+			for _, d := range []int{int(r) - int(er>>8), int(g) - int(eg>>8), int(b) - int(eb>>8)} {
+				if d < 0 {
+					d = -d
+				}
+				if d > worst {
+					worst, at = d, image.Point{X: x, Y: y}
+				}
+			}
+		}
+	}
+	return worst, at
+}
+
 func readImage() (*image.Image, string, error) {
 	pngFile, err := os.Open("./testpath/benchmark.png")
 	if err != nil {
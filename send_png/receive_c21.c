@@ -7,6 +7,7 @@
 #include <arpa/inet.h>
 #include <png.h>
 #include <time.h>
+#include "../20250520/arena.h"
 
 #define PORT 8888
 #define MAX_UDP_PAYLOAD 1200
@@ -62,7 +63,7 @@ void process_chunks_to_image(ImageBuffer *img, ChunkEntry *chunks, uint16_t max_
     }
 }
 
-void write_png(ImageBuffer *img, int frame_number) {
+void write_png(ImageBuffer *img, int frame_number, c21_arena *arena) {
     char filename[32];
     snprintf(filename, sizeof(filename), "frame_%d.png", frame_number);
     
@@ -96,7 +97,12 @@ void write_png(ImageBuffer *img, int frame_number) {
                  PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
-    png_bytep *row_pointers = malloc(sizeof(png_bytep) * img->height);
+    png_bytep *row_pointers = c21_arena_alloc(arena, sizeof(png_bytep) * img->height);
+    if (!row_pointers) {
+        png_destroy_write_struct(&png, &info);
+        fclose(fp);
+        return;
+    }
     for (int y = 0; y < img->height; y++) {
         row_pointers[y] = img->data + (y * img->width * RGB_BYTES_PER_PIXEL);
     }
@@ -105,19 +111,28 @@ void write_png(ImageBuffer *img, int frame_number) {
     png_write_image(png, row_pointers);
     png_write_end(png, NULL);
 
-    free(row_pointers);
     png_destroy_write_struct(&png, &info);
     fclose(fp);
     printf("Wrote %s\n", filename);
 }
 
-void cleanup_chunks(ChunkEntry *chunks, uint16_t max_ordinal) {
+// Chunk data lives in the frame arena, resetting the arena frees all of it
+void cleanup_chunks(ChunkEntry *chunks, uint16_t max_ordinal, c21_arena *arena) {
     for (uint16_t i = 0; i < max_ordinal; i++) {
-        if (chunks[i].received) {
-            free(chunks[i].data);
-            chunks[i].received = 0;
-        }
+        chunks[i].received = 0;
+    }
+    c21_arena_reset(arena);
+}
+
+// Keeps a copy of a received chunk until the frame is written
+void store_chunk(ChunkEntry *chunk, const unsigned char *buffer, size_t n, c21_arena *arena) {
+    chunk->data = c21_arena_alloc(arena, n);
+    if (!chunk->data) {
+        return;
     }
+    memcpy(chunk->data, buffer, n);
+    chunk->size = n;
+    chunk->received = 1;
 }
 
 int main() {
@@ -127,6 +142,15 @@ int main() {
     int frame_number = 0;
     ChunkEntry chunks[MAX_CHUNKS] = {0};
     uint16_t current_max_ordinal = 0;
+    size_t frame_heap_calls = 0;
+    
+    // Received chunks and png rows of a frame, sized for a full frame of raw
+    // pixels so the steady state makes no heap calls
+    c21_arena arena;
+    if (!c21_arena_init(&arena, MAX_WIDTH * MAX_HEIGHT * RGB_BYTES_PER_PIXEL * 2)) {
+        return 1;
+    }
+    frame_heap_calls = arena.heap_calls;
     
     ImageBuffer img = {
         .data = malloc(MAX_WIDTH * MAX_HEIGHT * RGB_BYTES_PER_PIXEL),
@@ -205,11 +229,8 @@ int main() {
                             if (n >= 3) {
                                 ordinal = (buffer[0] << 8) | buffer[1];
                                 if (ordinal < current_max_ordinal && !chunks[ordinal].received) {
-                                    chunks[ordinal].data = malloc(n);
-                                    memcpy(chunks[ordinal].data, buffer, n);
-                                    chunks[ordinal].size = n;
-                                    chunks[ordinal].received = 1;
-                                    missing_chunks--;
+                                    store_chunk(&chunks[ordinal], buffer, n, &arena);
+                                    missing_chunks -= chunks[ordinal].received;
                                 }
                             }
                         }
@@ -222,8 +243,10 @@ int main() {
 
                 // Process chunks and write frame
                 process_chunks_to_image(&img, chunks, current_max_ordinal);
-                write_png(&img, frame_number++);
-                cleanup_chunks(chunks, current_max_ordinal);
+                write_png(&img, frame_number++, &arena);
+                printf("Heap calls: %zu\n", arena.heap_calls - frame_heap_calls);
+                cleanup_chunks(chunks, current_max_ordinal, &arena);
+                frame_heap_calls = arena.heap_calls;
                 current_max_ordinal = 0;
                 
                 // Clear image buffer for next frame
@@ -233,10 +256,7 @@ int main() {
             else {
                 // Regular chunk
                 if (ordinal < MAX_CHUNKS) {
-                    chunks[ordinal].data = malloc(n);
-                    memcpy(chunks[ordinal].data, buffer, n);
-                    chunks[ordinal].size = n;
-                    chunks[ordinal].received = 1;
+                    store_chunk(&chunks[ordinal], buffer, n, &arena);
                     printf("Received chunk %d (size: %zd)\n", ordinal, n);
                 }
             }
@@ -244,7 +264,8 @@ int main() {
     }
 
     free(img.data);
-    cleanup_chunks(chunks, current_max_ordinal);
+    cleanup_chunks(chunks, current_max_ordinal, &arena);
+    c21_arena_free(&arena);
     close(sockfd);
     return 0;
 }
\ No newline at end of file
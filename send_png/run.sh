@@ -5,5 +5,5 @@ gcc -o send_png.out send_png.c -lssl -lcrypto -Wdeprecated-declarations
 gcc -o receive_png.out receive_png.c -lssl -lcrypto -Wdeprecated-declarations
 gcc -o viewer.out viewer.c -lX11 -lImlib2
 gcc -o send_c21.out send_c21.c -lpng -lssl -lcrypto -Wdeprecated-declarations
-gcc -o receive_c21.out receive_c21.c -lpng -lssl -lcrypto -Wdeprecated-declarations
+gcc -o receive_c21.out receive_c21.c ../20250520/arena.c -lpng -lssl -lcrypto -Wdeprecated-declarations
 